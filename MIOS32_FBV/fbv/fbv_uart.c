@@ -11,6 +11,8 @@
 /////////////////////////////////////////////////////////////////////////////
 
 #include <mios32.h>
+#include <FreeRTOS.h>
+#include <semphr.h>
 
 #include "fbv_uart.h"
 
@@ -21,29 +23,216 @@
 // Pin definitions and USART mappings
 /////////////////////////////////////////////////////////////////////////////
 
-#define FBV_UART_TX_PORT     GPIOA
-#define FBV_UART_TX_PIN      GPIO_Pin_2
-#define FBV_UART_RX_PORT     GPIOA
-#define FBV_UART_RX_PIN      GPIO_Pin_3
-#define FBV_UART             USART2
-#define FBV_UART_IRQ_CHANNEL USART2_IRQn
-#define FBV_UART_IRQHANDLER_FUNC void USART2_IRQHandler(void)
-#define FBV_UART_REMAP_FUNC  {}
+#if FBV_UART_NUM < 1 || FBV_UART_NUM > 2
+# error "FBV_UART_NUM must be 1 or 2"
+#endif
+
+// first floorboard: USART2 (PA2/PA3), DMA1 channel 7 (Tx) and channel 6 (Rx)
+#define FBV_UART0_TX_PORT     GPIOA
+#define FBV_UART0_TX_PIN      GPIO_Pin_2
+#define FBV_UART0_RX_PORT     GPIOA
+#define FBV_UART0_RX_PIN      GPIO_Pin_3
+#define FBV_UART0             USART2
+#define FBV_UART0_RCC         RCC_APB1Periph_USART2
+#define FBV_UART0_IRQ_CHANNEL USART2_IRQn
+#define FBV_UART0_IRQHANDLER_FUNC void USART2_IRQHandler(void)
+
+#define FBV_UART0_DMA_RCC                 RCC_AHBPeriph_DMA1
+#define FBV_UART0_TX_DMA_CHANNEL          DMA1_Channel7
+#define FBV_UART0_TX_DMA_IRQ_CHANNEL      DMA1_Channel7_IRQn
+#define FBV_UART0_TX_DMA_IRQHANDLER_FUNC  void DMA1_Channel7_IRQHandler(void)
+#define FBV_UART0_TX_DMA_IT_GL            DMA1_IT_GL7
+#define FBV_UART0_RX_DMA_CHANNEL          DMA1_Channel6
+#define FBV_UART0_RX_DMA_IRQ_CHANNEL      DMA1_Channel6_IRQn
+#define FBV_UART0_RX_DMA_IRQHANDLER_FUNC  void DMA1_Channel6_IRQHandler(void)
+#define FBV_UART0_RX_DMA_IT_GL            DMA1_IT_GL6
+
+// second floorboard: UART5 (PC12/PD2), without DMA
+// (UART4 on PC10/PC11 is taken by MIOS32 UART1, the remapped USART3)
+#define FBV_UART1_TX_PORT     GPIOC
+#define FBV_UART1_TX_PIN      GPIO_Pin_12
+#define FBV_UART1_RX_PORT     GPIOD
+#define FBV_UART1_RX_PIN      GPIO_Pin_2
+#define FBV_UART1             UART5
+#define FBV_UART1_RCC         RCC_APB1Periph_UART5
+#define FBV_UART1_IRQ_CHANNEL UART5_IRQn
+#define FBV_UART1_IRQHANDLER_FUNC void UART5_IRQHandler(void)
+
+// number of interfaces which have DMA channels, the others always transmit
+// via TXE and receive via RXNE interrupt (see FBV_UART_TX_DMA/FBV_UART_RX_DMA)
+#define FBV_UART_DMA_NUM 1
+#define FBV_UART_TX_DMA_USED(fbv) (FBV_UART_TX_DMA && (fbv) < FBV_UART_DMA_NUM)
+#define FBV_UART_RX_DMA_USED(fbv) (FBV_UART_RX_DMA && (fbv) < FBV_UART_DMA_NUM)
+#define FBV_UART_TXE  (!FBV_UART_TX_DMA || FBV_UART_NUM > FBV_UART_DMA_NUM)
+#define FBV_UART_RXNE (!FBV_UART_RX_DMA || FBV_UART_NUM > FBV_UART_DMA_NUM)
+
+// peripherals of each interface, indexed by the fbv argument of all functions
+// (with a single interface the index is always 0, so that the compiler folds
+// the table accesses into constants)
+typedef struct {
+  USART_TypeDef *usart;
+  GPIO_TypeDef *tx_port;
+  u16 tx_pin;
+  GPIO_TypeDef *rx_port;
+  u16 rx_pin;
+  u32 rcc;
+  u8 irq_channel;
+#if FBV_UART_TX_DMA || FBV_UART_RX_DMA
+  u32 dma_rcc;
+#endif
+#if FBV_UART_TX_DMA
+  DMA_Channel_TypeDef *tx_dma_channel;
+  u8 tx_dma_irq_channel;
+  u32 tx_dma_it_gl;
+#endif
+#if FBV_UART_RX_DMA
+  DMA_Channel_TypeDef *rx_dma_channel;
+  u8 rx_dma_irq_channel;
+  u32 rx_dma_it_gl;
+#endif
+} fbv_uart_hw_t;
+
+#if FBV_UART_TX_DMA
+#define FBV_UART_HW_TX_DMA(n) .tx_dma_channel = FBV_UART##n##_TX_DMA_CHANNEL, .tx_dma_irq_channel = FBV_UART##n##_TX_DMA_IRQ_CHANNEL, .tx_dma_it_gl = FBV_UART##n##_TX_DMA_IT_GL,
+#else
+#define FBV_UART_HW_TX_DMA(n)
+#endif
+#if FBV_UART_RX_DMA
+#define FBV_UART_HW_RX_DMA(n) .rx_dma_channel = FBV_UART##n##_RX_DMA_CHANNEL, .rx_dma_irq_channel = FBV_UART##n##_RX_DMA_IRQ_CHANNEL, .rx_dma_it_gl = FBV_UART##n##_RX_DMA_IT_GL,
+#else
+#define FBV_UART_HW_RX_DMA(n)
+#endif
+#if FBV_UART_TX_DMA || FBV_UART_RX_DMA
+#define FBV_UART_HW_DMA(n) .dma_rcc = FBV_UART##n##_DMA_RCC, FBV_UART_HW_TX_DMA(n) FBV_UART_HW_RX_DMA(n)
+#else
+#define FBV_UART_HW_DMA(n)
+#endif
+
+// the DMA fields of an interface without DMA stay 0
+#define FBV_UART_HW(n, dma) { .usart = FBV_UART##n, \
+    .tx_port = FBV_UART##n##_TX_PORT, .tx_pin = FBV_UART##n##_TX_PIN, \
+    .rx_port = FBV_UART##n##_RX_PORT, .rx_pin = FBV_UART##n##_RX_PIN, \
+    .rcc = FBV_UART##n##_RCC, .irq_channel = FBV_UART##n##_IRQ_CHANNEL, dma }
+
+static const fbv_uart_hw_t fbv_uart_hw[FBV_UART_NUM] = {
+  FBV_UART_HW(0, FBV_UART_HW_DMA(0)),
+#if FBV_UART_NUM >= 2
+  FBV_UART_HW(1, ), // no DMA
+#endif
+};
+
+
+/////////////////////////////////////////////////////////////////////////////
+// Ring buffer handling
+/////////////////////////////////////////////////////////////////////////////
+
+#if (FBV_UART_RX_BUFFER_SIZE & (FBV_UART_RX_BUFFER_SIZE-1)) || FBV_UART_RX_BUFFER_SIZE < 2 || FBV_UART_RX_BUFFER_SIZE > 32768
+# error "FBV_UART_RX_BUFFER_SIZE must be a power of two (2..32768)"
+#endif
+#if (FBV_UART_TX_BUFFER_SIZE & (FBV_UART_TX_BUFFER_SIZE-1)) || FBV_UART_TX_BUFFER_SIZE < 2 || FBV_UART_TX_BUFFER_SIZE > 32768
+# error "FBV_UART_TX_BUFFER_SIZE must be a power of two (2..32768)"
+#endif
+
+#define FBV_UART_RX_BUFFER_MASK (FBV_UART_RX_BUFFER_SIZE-1)
+#define FBV_UART_TX_BUFFER_MASK (FBV_UART_TX_BUFFER_SIZE-1)
+
+// The head and tail indices are free running 16bit counters which are masked
+// on buffer access; head-tail is the number of used bytes.
+// Each index has exactly one writer, therefore no interrupt has to be
+// disabled: the producer stores the data before it advances the head, the
+// consumer reads the data before it advances the tail.
+// The barrier keeps the compiler from reordering these accesses, on the
+// single core Cortex-M3 this is sufficient.
+#ifndef FBV_UART_BARRIER
+#define FBV_UART_BARRIER() __asm__ volatile("" ::: "memory")
+#endif
 
 
 /////////////////////////////////////////////////////////////////////////////
 // Local variables
+// all variables exist once per interface, indexed by the fbv argument
 /////////////////////////////////////////////////////////////////////////////
 
-static u8 rx_buffer[FBV_UART_RX_BUFFER_SIZE];
-static volatile u8 rx_buffer_tail;
-static volatile u8 rx_buffer_head;
-static volatile u8 rx_buffer_size;
+// Rx: single producer (USART interrupt or Rx DMA), single consumer (task)
+static u8 rx_buffer[FBV_UART_NUM][FBV_UART_RX_BUFFER_SIZE];
+static volatile u16 rx_buffer_tail[FBV_UART_NUM]; // written by consumer only
+static volatile u16 rx_buffer_head[FBV_UART_NUM]; // written by producer only
+
+// Tx: single consumer (TXE interrupt or Tx DMA)
+// Producers (tasks and timer interrupt) reserve space with a compare-and-swap on
+// tx_buffer_reserve, copy their bytes, and the last active producer publishes
+// all reserved bytes by advancing the head. A preempted producer therefore
+// never blocks another one.
+static u8 tx_buffer[FBV_UART_NUM][FBV_UART_TX_BUFFER_SIZE];
+static volatile u16 tx_buffer_tail[FBV_UART_NUM];    // written by consumer only
+static volatile u16 tx_buffer_head[FBV_UART_NUM];    // end of published bytes
+static volatile u32 tx_buffer_reserve[FBV_UART_NUM]; // [31:16] active producers, [15:0] end of reserved bytes
+
+#if FBV_UART_TX_DMA
+#define FBV_UART_TX_DMA_CLAIMED 0xffff
+static volatile u16 tx_dma_len[FBV_UART_NUM]; // number of bytes of the ongoing DMA transfer (0: DMA idle)
+#endif
+
+// LED commands which have been deferred from interrupt context
+// the state is stored per LED id, so that only the latest state of a LED is sent
+// a direct command of a LED drops its deferred command if it hasn't been sent yet
+#define FBV_UART_LED_DEFERRED_NUM 128
+static volatile u8 led_deferred_state[FBV_UART_NUM][FBV_UART_LED_DEFERRED_NUM];
+static volatile u32 led_deferred_pending[FBV_UART_NUM][FBV_UART_LED_DEFERRED_NUM/32];
+
+// shadow copy of the FBV display, identical frames are not sent again
+#define FBV_UART_DISPLAY_LEN 16
+static u8 display_shadow[FBV_UART_NUM][FBV_UART_DISPLAY_LEN];
+static u8 display_shadow_valid[FBV_UART_NUM];
+
+static fbv_uart_stats_t stats[FBV_UART_NUM];
+
+// detected FBV model and the ids of the present LEDs and switches (bitmasks)
+#define FBV_UART_ID_NUM 128
+static u8 model[FBV_UART_NUM];
+static u8 model_flags[FBV_UART_NUM];
+static u32 led_present[FBV_UART_NUM][FBV_UART_ID_NUM/32];
+static u32 switch_present[FBV_UART_NUM][FBV_UART_ID_NUM/32];
+
+// shadow copy of the LED states (bitmasks), a LED command which doesn't
+// change the state of a known LED is not sent again
+static volatile u32 led_shadow_on[FBV_UART_NUM][FBV_UART_ID_NUM/32];
+static volatile u32 led_shadow_valid[FBV_UART_NUM][FBV_UART_ID_NUM/32];
+
+// serializes the shadow comparison, the enqueue of the frame and the shadow
+// update of the LED and display commands (task context only, the interrupts
+// never touch the shadows); recursive, since FBV_UART_TxDeferredFlush sends
+// the LED commands while it holds the mutex
+static xSemaphoreHandle shadow_mutex[FBV_UART_NUM];
+#define FBV_UART_SHADOW_TAKE(fbv) { while( xSemaphoreTakeRecursive(shadow_mutex[fbv], (portTickType)1) != pdTRUE ); }
+#define FBV_UART_SHADOW_GIVE(fbv) { xSemaphoreGiveRecursive(shadow_mutex[fbv]); }
+
+// called from the USART interrupt whenever a complete frame has been received
+static void (*rx_frame_callback)(u8 fbv);
+
+#if FBV_UART_RXNE
+// frame tracking of the RXNE path: 0 = waiting for header, 1 = waiting for
+// size byte, 2 = inside of a frame (rx_frame_remaining bytes missing)
+static u8 rx_frame_state[FBV_UART_NUM];
+static u8 rx_frame_remaining[FBV_UART_NUM];
+#endif
+
+
+/////////////////////////////////////////////////////////////////////////////
+// Local prototypes
+/////////////////////////////////////////////////////////////////////////////
 
-static u8 tx_buffer[FBV_UART_TX_BUFFER_SIZE];
-static volatile u8 tx_buffer_tail;
-static volatile u8 tx_buffer_head;
-static volatile u8 tx_buffer_size;
+static void FBV_UART_InitInterface(u8 fbv);
+static void FBV_UART_ModelSelect(u8 fbv, u8 num);
+#if FBV_UART_TX_DMA
+static void FBV_UART_TxDMAInit(u8 fbv);
+static void FBV_UART_TxDMAStart(u8 fbv);
+#endif
+#if FBV_UART_RX_DMA
+static void FBV_UART_RxDMAInit(u8 fbv);
+static void FBV_UART_RxDMASync(u8 fbv);
+#endif
+static s32 FBV_UART_LedSend(u8 fbv, u8 led, u8 status, u8 blocking);
 
 
 /////////////////////////////////////////////////////////////////////////////
@@ -54,39 +243,53 @@ static volatile u8 tx_buffer_size;
 /////////////////////////////////////////////////////////////////////////////
 s32 FBV_UART_Init(u32 mode)
 {
-
-	USART_DeInit(FBV_UART);
-
-	GPIO_InitTypeDef GPIO_InitStructure;
-
   // currently only mode 0 supported
   if( mode != 0 )
     return -1; // unsupported mode
 
-  // map UART pins
-  FBV_UART_REMAP_FUNC;
+  u8 fbv;
+  for(fbv=0; fbv<FBV_UART_NUM; ++fbv) {
+    if( shadow_mutex[fbv] == NULL )
+      shadow_mutex[fbv] = xSemaphoreCreateRecursiveMutex();
+    FBV_UART_InitInterface(fbv);
+  }
+
+  return 0; // no error
+}
+
+
+/////////////////////////////////////////////////////////////////////////////
+// initializes the peripherals and buffers of a single interface
+/////////////////////////////////////////////////////////////////////////////
+static void FBV_UART_InitInterface(u8 fbv)
+{
+  const fbv_uart_hw_t *hw = &fbv_uart_hw[fbv];
+
+	USART_DeInit(hw->usart);
+
+	GPIO_InitTypeDef GPIO_InitStructure;
 
   // configure UART pins
   GPIO_StructInit(&GPIO_InitStructure);
   GPIO_InitStructure.GPIO_Speed = GPIO_Speed_2MHz;
 
   // outputs as open-drain
-  GPIO_InitStructure.GPIO_Pin = FBV_UART_TX_PIN;
+  GPIO_InitStructure.GPIO_Pin = hw->tx_pin;
 #if FBV_UART_TX_OD
   GPIO_InitStructure.GPIO_Mode = GPIO_Mode_AF_OD;
 #else
   GPIO_InitStructure.GPIO_Mode = GPIO_Mode_AF_PP;
 #endif
-  GPIO_Init(FBV_UART_TX_PORT, &GPIO_InitStructure);
+  GPIO_Init(hw->tx_port, &GPIO_InitStructure);
 
   // inputs with internal pull-up
   //GPIO_InitStructure.GPIO_Mode = GPIO_Mode_IPU;
   GPIO_InitStructure.GPIO_Mode = GPIO_Mode_IN_FLOATING;
-  GPIO_InitStructure.GPIO_Pin = FBV_UART_RX_PIN;
-  GPIO_Init(FBV_UART_RX_PORT, &GPIO_InitStructure);
+  GPIO_InitStructure.GPIO_Pin = hw->rx_pin;
+  GPIO_Init(hw->rx_port, &GPIO_InitStructure);
 
-  // enable all USART clocks
-  RCC_APB1PeriphClockCmd(RCC_APB1Periph_USART2, ENABLE);
+  // enable USART clock
+  RCC_APB1PeriphClockCmd(hw->rcc, ENABLE);
 
   // USART configuration
   USART_InitTypeDef USART_InitStructure;
@@ -97,74 +300,210 @@ s32 FBV_UART_Init(u32 mode)
   USART_InitStructure.USART_Mode = USART_Mode_Rx | USART_Mode_Tx;
 
   USART_InitStructure.USART_BaudRate = FBV_UART_BAUDRATE;
-  USART_Init(FBV_UART, &USART_InitStructure);
+  USART_Init(hw->usart, &USART_InitStructure);
 
   // configure and enable UART interrupts
   NVIC_InitTypeDef NVIC_InitStructure;
 
-  NVIC_InitStructure.NVIC_IRQChannel = FBV_UART_IRQ_CHANNEL;
+  NVIC_InitStructure.NVIC_IRQChannel = hw->irq_channel;
   NVIC_InitStructure.NVIC_IRQChannelPreemptionPriority = MIOS32_IRQ_UART_PRIORITY; // defined in mios32_irq.h
   NVIC_InitStructure.NVIC_IRQChannelSubPriority = 0;
   NVIC_InitStructure.NVIC_IRQChannelCmd = ENABLE;
   NVIC_Init(&NVIC_InitStructure);
-  USART_ITConfig(FBV_UART, USART_IT_RXNE, ENABLE);
-  //USART_ITConfig(FBV_UART, USART_IT_TXE, ENABLE);
+#if FBV_UART_RX_DMA
+  if( FBV_UART_RX_DMA_USED(fbv) )
+    USART_ITConfig(hw->usart, USART_IT_IDLE, ENABLE);
+  else
+#endif
+    USART_ITConfig(hw->usart, USART_IT_RXNE, ENABLE);
+  //USART_ITConfig(hw->usart, USART_IT_TXE, ENABLE);
+
+#if FBV_UART_TX_DMA
+  if( FBV_UART_TX_DMA_USED(fbv) )
+    FBV_UART_TxDMAInit(fbv);
+#endif
+#if FBV_UART_RX_DMA
+  if( FBV_UART_RX_DMA_USED(fbv) )
+    FBV_UART_RxDMAInit(fbv);
+#endif
 
   // clear buffer counters
-  rx_buffer_tail = rx_buffer_head = rx_buffer_size = 0;
-  tx_buffer_tail = tx_buffer_head = tx_buffer_size = 0;
+  rx_buffer_tail[fbv] = rx_buffer_head[fbv] = 0;
+  tx_buffer_tail[fbv] = tx_buffer_head[fbv] = 0;
+  tx_buffer_reserve[fbv] = 0;
 
-  // enable UARTs
-  USART_Cmd(FBV_UART, ENABLE);
+  // the display content and the LED states are unknown
+  display_shadow_valid[fbv] = 0;
+  memset((u32 *)led_shadow_valid[fbv], 0, sizeof(led_shadow_valid[fbv]));
 
-  return 0; // no error
+  // clear deferred LED commands
+  memset((u32 *)led_deferred_pending[fbv], 0, sizeof(led_deferred_pending[fbv]));
+
+  // clear statistics
+  memset(&stats[fbv], 0, sizeof(fbv_uart_stats_t));
+
+  // all controls are served until the model is known
+  FBV_UART_ModelSelect(fbv, FBV_MODEL_FULL);
+
+#if FBV_UART_RXNE
+  rx_frame_state[fbv] = 0;
+#endif
+
+  // enable UART
+  USART_Cmd(hw->usart, ENABLE);
+}
+
+
+#if FBV_UART_TX_DMA
+/////////////////////////////////////////////////////////////////////////////
+// initializes the Tx DMA channel of an interface
+/////////////////////////////////////////////////////////////////////////////
+static void FBV_UART_TxDMAInit(u8 fbv)
+{
+  const fbv_uart_hw_t *hw = &fbv_uart_hw[fbv];
+  DMA_InitTypeDef DMA_InitStructure;
+  NVIC_InitTypeDef NVIC_InitStructure;
+
+  RCC_AHBPeriphClockCmd(hw->dma_rcc, ENABLE);
+
+  // configure DMA channel for Tx, the memory address and length are set for each span
+  DMA_DeInit(hw->tx_dma_channel);
+  DMA_InitStructure.DMA_PeripheralBaseAddr = (u32)&hw->usart->DR;
+  DMA_InitStructure.DMA_MemoryBaseAddr = (u32)&tx_buffer[fbv][0];
+  DMA_InitStructure.DMA_DIR = DMA_DIR_PeripheralDST;
+  DMA_InitStructure.DMA_BufferSize = 1;
+  DMA_InitStructure.DMA_PeripheralInc = DMA_PeripheralInc_Disable;
+  DMA_InitStructure.DMA_MemoryInc = DMA_MemoryInc_Enable;
+  DMA_InitStructure.DMA_PeripheralDataSize = DMA_PeripheralDataSize_Byte;
+  DMA_InitStructure.DMA_MemoryDataSize = DMA_MemoryDataSize_Byte;
+  DMA_InitStructure.DMA_Mode = DMA_Mode_Normal;
+  DMA_InitStructure.DMA_Priority = DMA_Priority_Medium;
+  DMA_InitStructure.DMA_M2M = DMA_M2M_Disable;
+  DMA_Init(hw->tx_dma_channel, &DMA_InitStructure);
+  DMA_ITConfig(hw->tx_dma_channel, DMA_IT_TC, ENABLE);
+
+  NVIC_InitStructure.NVIC_IRQChannel = hw->tx_dma_irq_channel;
+  NVIC_InitStructure.NVIC_IRQChannelPreemptionPriority = MIOS32_IRQ_UART_PRIORITY;
+  NVIC_InitStructure.NVIC_IRQChannelSubPriority = 0;
+  NVIC_InitStructure.NVIC_IRQChannelCmd = ENABLE;
+  NVIC_Init(&NVIC_InitStructure);
+
+  USART_DMACmd(hw->usart, USART_DMAReq_Tx, ENABLE);
+  tx_dma_len[fbv] = 0;
+}
+#endif
+
+
+#if FBV_UART_RX_DMA
+/////////////////////////////////////////////////////////////////////////////
+// initializes the Rx DMA channel of an interface
+/////////////////////////////////////////////////////////////////////////////
+static void FBV_UART_RxDMAInit(u8 fbv)
+{
+  const fbv_uart_hw_t *hw = &fbv_uart_hw[fbv];
+  DMA_InitTypeDef DMA_RxInitStructure;
+  NVIC_InitTypeDef NVIC_InitStructure;
+
+  RCC_AHBPeriphClockCmd(hw->dma_rcc, ENABLE);
+
+  // configure DMA channel for Rx: the whole Rx buffer is written circularly,
+  // the half/complete interrupts ensure that long bursts are taken over in time
+  DMA_DeInit(hw->rx_dma_channel);
+  DMA_RxInitStructure.DMA_PeripheralBaseAddr = (u32)&hw->usart->DR;
+  DMA_RxInitStructure.DMA_MemoryBaseAddr = (u32)&rx_buffer[fbv][0];
+  DMA_RxInitStructure.DMA_DIR = DMA_DIR_PeripheralSRC;
+  DMA_RxInitStructure.DMA_BufferSize = FBV_UART_RX_BUFFER_SIZE;
+  DMA_RxInitStructure.DMA_PeripheralInc = DMA_PeripheralInc_Disable;
+  DMA_RxInitStructure.DMA_MemoryInc = DMA_MemoryInc_Enable;
+  DMA_RxInitStructure.DMA_PeripheralDataSize = DMA_PeripheralDataSize_Byte;
+  DMA_RxInitStructure.DMA_MemoryDataSize = DMA_MemoryDataSize_Byte;
+  DMA_RxInitStructure.DMA_Mode = DMA_Mode_Circular;
+  DMA_RxInitStructure.DMA_Priority = DMA_Priority_High;
+  DMA_RxInitStructure.DMA_M2M = DMA_M2M_Disable;
+  DMA_Init(hw->rx_dma_channel, &DMA_RxInitStructure);
+  DMA_ITConfig(hw->rx_dma_channel, DMA_IT_HT | DMA_IT_TC, ENABLE);
+
+  NVIC_InitStructure.NVIC_IRQChannel = hw->rx_dma_irq_channel;
+  NVIC_InitStructure.NVIC_IRQChannelPreemptionPriority = MIOS32_IRQ_UART_PRIORITY;
+  NVIC_InitStructure.NVIC_IRQChannelSubPriority = 0;
+  NVIC_InitStructure.NVIC_IRQChannelCmd = ENABLE;
+  NVIC_Init(&NVIC_InitStructure);
+
+  USART_DMACmd(hw->usart, USART_DMAReq_Rx, ENABLE);
+  DMA_Cmd(hw->rx_dma_channel, ENABLE);
+}
+#endif
+
+
+/////////////////////////////////////////////////////////////////////////////
+// returns the number of unread bytes in the receive buffer
+// if the Rx DMA has overtaken the consumer, the tail is moved to the oldest
+// byte which is still available (consumer side only)
+/////////////////////////////////////////////////////////////////////////////
+static u16 FBV_UART_RxBufferSync(u8 fbv)
+{
+  u16 used = (u16)(rx_buffer_head[fbv] - rx_buffer_tail[fbv]);
+
+  if( used > FBV_UART_RX_BUFFER_SIZE ) {
+    rx_buffer_tail[fbv] = (u16)(rx_buffer_head[fbv] - FBV_UART_RX_BUFFER_SIZE);
+    used = FBV_UART_RX_BUFFER_SIZE;
+  }
+
+  return used;
 }
 
 
 /////////////////////////////////////////////////////////////////////////////
 //! returns number of free bytes in receive buffer
-//! \param[in] uart UART number (0..1)
-//! \return uart number of free bytes
-//! \return 1: uart available
-//! \return 0: uart not available
+//! \param[in] fbv FBV interface number (0..FBV_UART_NUM-1)
+//! \return number of free bytes
+//! \note Applications shouldn't call these functions directly, instead please use \ref FBV
 /////////////////////////////////////////////////////////////////////////////
-s32 FBV_UART_RxBufferFree(void)
+s32 FBV_UART_RxBufferFree(u8 fbv)
 {
-    return FBV_UART_RX_BUFFER_SIZE - rx_buffer_size;
+    if( fbv >= FBV_UART_NUM )
+      return -1; // FBV interface not available
+
+    return FBV_UART_RX_BUFFER_SIZE - FBV_UART_RxBufferUsed(fbv);
 }
 
 
 /////////////////////////////////////////////////////////////////////////////
 //! returns number of used bytes in receive buffer
-//! \param[in] uart UART number (0..1)
-//! \return > 0: number of used bytes
-//! \return 0 if uart not available
+//! \param[in] fbv FBV interface number (0..FBV_UART_NUM-1)
+//! \return >= 0: number of used bytes
 //! \note Applications shouldn't call these functions directly, instead please use \ref FBV
 /////////////////////////////////////////////////////////////////////////////
-s32 FBV_UART_RxBufferUsed(void)
+s32 FBV_UART_RxBufferUsed(u8 fbv)
 {
-    return rx_buffer_size;
+    if( fbv >= FBV_UART_NUM )
+      return -1; // FBV interface not available
+
+    u16 used = (u16)(rx_buffer_head[fbv] - rx_buffer_tail[fbv]);
+    return (used > FBV_UART_RX_BUFFER_SIZE) ? FBV_UART_RX_BUFFER_SIZE : used;
 }
 
 
 /////////////////////////////////////////////////////////////////////////////
 //! gets a byte from the receive buffer
+//! \param[in] fbv FBV interface number (0..FBV_UART_NUM-1)
 //! \return -1 if no new byte available
-//! \return >= 0: number of received bytes
+//! \return >= 0: received byte
+//! \note must only be called from a single consumer context
 //! \note Applications shouldn't call these functions directly, instead please use \ref FBV
 /////////////////////////////////////////////////////////////////////////////
-s32 FBV_UART_RxBufferGet(void)
+s32 FBV_UART_RxBufferGet(u8 fbv)
 {
-   if( !rx_buffer_size )
+  if( fbv >= FBV_UART_NUM )
+    return -1; // FBV interface not available
+
+  if( !FBV_UART_RxBufferSync(fbv) )
     return -1; // nothing new in buffer
 
-  // get byte - this operation should be atomic!
-  MIOS32_IRQ_Disable();
-  u8 b = rx_buffer[rx_buffer_tail];
-  if( ++rx_buffer_tail >= FBV_UART_RX_BUFFER_SIZE )
-    rx_buffer_tail = 0;
-  --rx_buffer_size;
-  MIOS32_IRQ_Enable();
+  u16 tail = rx_buffer_tail[fbv];
+  u8 b = rx_buffer[fbv][tail & FBV_UART_RX_BUFFER_MASK];
+  FBV_UART_BARRIER(); // read the byte before the slot is released
+  rx_buffer_tail[fbv] = tail + 1;
 
   return b; // return received byte
 }
@@ -172,45 +511,55 @@ s32 FBV_UART_RxBufferGet(void)
 
 /////////////////////////////////////////////////////////////////////////////
 //! returns the next byte of the receive buffer without taking it
+//! \param[in] fbv FBV interface number (0..FBV_UART_NUM-1)
 //! \return -1 if no new byte available
-//! \return >= 0: number of received bytes
+//! \return >= 0: received byte
+//! \note must only be called from a single consumer context
 //! \note Applications shouldn't call these functions directly, instead please use \ref FBV
 /////////////////////////////////////////////////////////////////////////////
-s32 FBV_UART_RxBufferPeek(void)
+s32 FBV_UART_RxBufferPeek(u8 fbv)
 {
-  if( !rx_buffer_size )
-    return -1; // nothing new in buffer
+  if( fbv >= FBV_UART_NUM )
+    return -1; // FBV interface not available
 
-  // get byte - this operation should be atomic!
-  MIOS32_IRQ_Disable();
-  u8 b = rx_buffer[rx_buffer_tail];
-  MIOS32_IRQ_Enable();
+  if( !FBV_UART_RxBufferSync(fbv) )
+    return -1; // nothing new in buffer
 
-  return b; // return received byte
+  return rx_buffer[fbv][rx_buffer_tail[fbv] & FBV_UART_RX_BUFFER_MASK]; // return received byte
 }
 
 
 /////////////////////////////////////////////////////////////////////////////
 //! puts a byte onto the receive buffer
+//! \param[in] fbv FBV interface number (0..FBV_UART_NUM-1)
 //! \param[in] b byte which should be put into Rx buffer
 //! \return 0 if no error
 //! \return -1 if buffer full (retry)
+//! \return -2 if the Rx buffer is written by DMA
+//! \note must only be called from a single producer context (the USART interrupt)
 //! \note Applications shouldn't call these functions directly, instead please use \ref FBV
 /////////////////////////////////////////////////////////////////////////////
-s32 FBV_UART_RxBufferPut( u8 b)
+s32 FBV_UART_RxBufferPut(u8 fbv, u8 b)
 {
+  if( fbv >= FBV_UART_NUM )
+    return -1; // FBV interface not available
+
+#if FBV_UART_RX_DMA
+  if( FBV_UART_RX_DMA_USED(fbv) ) {
+    (void)b;
+    return -2; // the DMA owns the head of the Rx buffer
+  }
+#endif
 
-  if( rx_buffer_size >= FBV_UART_RX_BUFFER_SIZE )
+  u16 head = rx_buffer_head[fbv];
+
+  if( (u16)(head - rx_buffer_tail[fbv]) >= FBV_UART_RX_BUFFER_SIZE )
     return -1; // buffer full (retry)
 
-  // copy received byte into receive buffer
-  // this operation should be atomic!
-  MIOS32_IRQ_Disable();
-  rx_buffer[rx_buffer_head] = b;
-  if( ++rx_buffer_head >= FBV_UART_RX_BUFFER_SIZE )
-    rx_buffer_head = 0;
-  ++rx_buffer_size;
-  MIOS32_IRQ_Enable();
+  // copy received byte into receive buffer before it is published
+  rx_buffer[fbv][head & FBV_UART_RX_BUFFER_MASK] = b;
+  FBV_UART_BARRIER();
+  rx_buffer_head[fbv] = head + 1;
 
   return 0; // no error
 }
@@ -218,99 +567,195 @@ s32 FBV_UART_RxBufferPut( u8 b)
 
 /////////////////////////////////////////////////////////////////////////////
 //! returns number of free bytes in transmit buffer
+//! \param[in] fbv FBV interface number (0..FBV_UART_NUM-1)
 //! \return number of free bytes
 //! \note Applications shouldn't call these functions directly, instead please use \ref FBV
 /////////////////////////////////////////////////////////////////////////////
-s32 FBV_UART_TxBufferFree(void)
+s32 FBV_UART_TxBufferFree(u8 fbv)
 {
-    return FBV_UART_TX_BUFFER_SIZE - tx_buffer_size;
+    if( fbv >= FBV_UART_NUM )
+      return -1; // FBV interface not available
+
+    return FBV_UART_TX_BUFFER_SIZE - (u16)((u16)tx_buffer_reserve[fbv] - tx_buffer_tail[fbv]);
 }
 
 
 /////////////////////////////////////////////////////////////////////////////
 //! returns number of used bytes in transmit buffer
+//! \param[in] fbv FBV interface number (0..FBV_UART_NUM-1)
 //! \return number of used bytes
 //! \note Applications shouldn't call these functions directly, instead please use \ref FBV
 /////////////////////////////////////////////////////////////////////////////
-s32 FBV_UART_TxBufferUsed(void)
+s32 FBV_UART_TxBufferUsed(u8 fbv)
 {
-    return tx_buffer_size;
+    if( fbv >= FBV_UART_NUM )
+      return -1; // FBV interface not available
+
+    return (u16)(tx_buffer_head[fbv] - tx_buffer_tail[fbv]);
 }
 
 
 /////////////////////////////////////////////////////////////////////////////
 //! gets a byte from the transmit buffer
+//! \param[in] fbv FBV interface number (0..FBV_UART_NUM-1)
 //! \return -1 if no new byte available
 //! \return >= 0: transmitted byte
+//! \note must only be called from the single consumer context (the USART interrupt)
 //! \note Applications shouldn't call these functions directly, instead please use \ref FBV
 /////////////////////////////////////////////////////////////////////////////
-s32 FBV_UART_TxBufferGet(void)
+s32 FBV_UART_TxBufferGet(u8 fbv)
 {
+  if( fbv >= FBV_UART_NUM )
+    return -1; // FBV interface not available
 
-  if( !tx_buffer_size )
+  u16 tail = tx_buffer_tail[fbv];
+
+  if( tail == tx_buffer_head[fbv] )
     return -1; // nothing new in buffer
 
-  // get byte - this operation should be atomic!
-  MIOS32_IRQ_Disable();
-  u8 b = tx_buffer[tx_buffer_tail];
-  if( ++tx_buffer_tail >= FBV_UART_TX_BUFFER_SIZE )
-    tx_buffer_tail = 0;
-  --tx_buffer_size;
-  MIOS32_IRQ_Enable();
+  u8 b = tx_buffer[fbv][tail & FBV_UART_TX_BUFFER_MASK];
+  FBV_UART_BARRIER(); // read the byte before the slot is released
+  tx_buffer_tail[fbv] = tail + 1;
 
   return b; // return transmitted byte
 }
 
 
 /////////////////////////////////////////////////////////////////////////////
-//! puts more than one byte onto the transmit buffer (used for atomic sends)
-//! \param[in] *buffer pointer to buffer to be sent
-//! \param[in] len number of bytes to be sent
-//! \return 0 if no error
-//! \return -1 if buffer full or cannot get all requested bytes (retry)
-//! \note Applications shouldn't call these functions directly, instead please use \ref FBV
+// reserves len bytes in the transmit buffer
+// \param[in] len number of bytes
+// \param[out] *pos free running index of the first reserved byte
+// \return 0 if no error
+// \return -1 if not enough free space
 /////////////////////////////////////////////////////////////////////////////
-s32 FBV_UART_TxBufferPutMore_NonBlocking( u8 *buffer, u16 len)
+static s32 FBV_UART_TxBufferReserve(u8 fbv, u16 len, u16 *pos)
 {
+  u32 reserve, next;
 
-  if( (tx_buffer_size+len) >= FBV_UART_TX_BUFFER_SIZE )
-    return -1; // buffer full or cannot get all requested bytes (retry)
+  do {
+    reserve = tx_buffer_reserve[fbv];
+    u16 end = (u16)reserve;
 
-  // copy bytes to be transmitted into transmit buffer
-  // this operation should be atomic!
-  MIOS32_IRQ_Disable();
+    if( (u32)(u16)(end - tx_buffer_tail[fbv]) + len > FBV_UART_TX_BUFFER_SIZE )
+      return -1; // buffer full or cannot get all requested bytes
 
-  u16 i;
-  for(i=0; i<len; ++i) {
-    tx_buffer[tx_buffer_head] = *buffer++;
+    next = ((reserve & 0xffff0000) + 0x00010000) | (u16)(end + len);
+  } while( !__sync_bool_compare_and_swap(&tx_buffer_reserve[fbv], reserve, next) );
 
-    if( ++tx_buffer_head >= FBV_UART_TX_BUFFER_SIZE )
-      tx_buffer_head = 0;
+  *pos = (u16)reserve;
 
-    // enable Tx interrupt if buffer was empty
-    if( ++tx_buffer_size == 1 ) {
-        FBV_UART->CR1 |= (1 << 7); // enable TXE interrupt (TXEIE=1)
-    }
+  return 0; // no error
+}
+
+
+/////////////////////////////////////////////////////////////////////////////
+// finishes a reservation of FBV_UART_TxBufferReserve
+// the last active producer publishes all reserved bytes and starts the transmission
+/////////////////////////////////////////////////////////////////////////////
+static void FBV_UART_TxBufferCommit(u8 fbv)
+{
+  u32 reserve, next;
+
+  FBV_UART_BARRIER(); // the bytes have to be stored before they are published
+
+  do {
+    reserve = tx_buffer_reserve[fbv];
+    next = reserve - 0x00010000;
+  } while( !__sync_bool_compare_and_swap(&tx_buffer_reserve[fbv], reserve, next) );
+
+  if( next & 0xffff0000 )
+    return; // another producer is still copying, it will publish our bytes as well
+
+  // publish; never move the head backwards if a producer which preempted us
+  // has already published a later end
+  u16 end = (u16)next;
+  u16 head;
+  do {
+    head = tx_buffer_head[fbv];
+    if( (s16)(end - head) <= 0 )
+      return;
+  } while( !__sync_bool_compare_and_swap(&tx_buffer_head[fbv], head, end) );
+
+#if FBV_UART_TX_DMA
+  if( FBV_UART_TX_DMA_USED(fbv) ) {
+    // start a DMA transfer if none is ongoing, otherwise the new bytes are taken on completion
+    FBV_UART_TxDMAStart(fbv);
+    return;
   }
+#endif
+#if FBV_UART_TXE
+  fbv_uart_hw[fbv].usart->CR1 |= (1 << 7); // enable TXE interrupt (TXEIE=1)
+#endif
+}
 
-  MIOS32_IRQ_Enable();
+
+/////////////////////////////////////////////////////////////////////////////
+// puts more than one byte onto the transmit buffer if all of them fit
+// count_overflow: a rejected request is counted in tx_overflows (not done
+// by the blocking functions, which retry until the buffer has been drained)
+/////////////////////////////////////////////////////////////////////////////
+static s32 FBV_UART_TxBufferPutMore_Try(u8 fbv, u8 *buffer, u16 len, u8 count_overflow)
+{
+  u16 pos;
+
+  if( FBV_UART_TxBufferReserve(fbv, len, &pos) < 0 ) {
+    if( count_overflow )
+      __sync_fetch_and_add(&stats[fbv].tx_overflows, 1);
+    return -1; // buffer full or cannot get all requested bytes (retry)
+  }
+
+  // copy bytes to be transmitted into the reserved space
+  // (two spans if the reserved space wraps at the end of the buffer)
+  u16 offset = pos & FBV_UART_TX_BUFFER_MASK;
+  u16 first = FBV_UART_TX_BUFFER_SIZE - offset;
+  if( first >= len ) {
+    memcpy(&tx_buffer[fbv][offset], buffer, len);
+  } else {
+    memcpy(&tx_buffer[fbv][offset], buffer, first);
+    memcpy(&tx_buffer[fbv][0], buffer + first, len - first);
+  }
+
+  FBV_UART_TxBufferCommit(fbv);
 
   return 0; // no error
 }
 
+/////////////////////////////////////////////////////////////////////////////
+//! puts more than one byte onto the transmit buffer (used for atomic sends)
+//! \param[in] fbv FBV interface number (0..FBV_UART_NUM-1)
+//! \param[in] *buffer pointer to buffer to be sent
+//! \param[in] len number of bytes to be sent
+//! \return 0 if no error
+//! \return -1 if buffer full or cannot get all requested bytes (retry)
+//! \note can be called from interrupts, a rejected request is counted in tx_overflows
+//! \note Applications shouldn't call these functions directly, instead please use \ref FBV
+/////////////////////////////////////////////////////////////////////////////
+s32 FBV_UART_TxBufferPutMore_NonBlocking(u8 fbv, u8 *buffer, u16 len)
+{
+  if( fbv >= FBV_UART_NUM )
+    return -1; // FBV interface not available
+
+  return FBV_UART_TxBufferPutMore_Try(fbv, buffer, len, 1);
+}
+
+
 /////////////////////////////////////////////////////////////////////////////
 //! puts more than one byte onto the transmit buffer (used for atomic sends)<BR>
 //! (blocking function)
+//! \param[in] fbv FBV interface number (0..FBV_UART_NUM-1)
 //! \param[in] *buffer pointer to buffer to be sent
 //! \param[in] len number of bytes to be sent
 //! \return 0 if no error
 //! \note Applications shouldn't call these functions directly, instead please use \ref FBV
 /////////////////////////////////////////////////////////////////////////////
-s32 FBV_UART_TxBufferPutMore(u8 *buffer, u16 len)
+s32 FBV_UART_TxBufferPutMore(u8 fbv, u8 *buffer, u16 len)
 {
+  if( fbv >= FBV_UART_NUM )
+    return -1; // FBV interface not available
+
   s32 error;
 
-  while( (error=FBV_UART_TxBufferPutMore_NonBlocking(buffer, len)) == -1 );
+  while( (error=FBV_UART_TxBufferPutMore_Try(fbv, buffer, len, 0)) == -1 );
 
   return error;
 }
@@ -318,207 +763,1053 @@ s32 FBV_UART_TxBufferPutMore(u8 *buffer, u16 len)
 
 /////////////////////////////////////////////////////////////////////////////
 //! puts a byte onto the transmit buffer
+//! \param[in] fbv FBV interface number (0..FBV_UART_NUM-1)
 //! \param[in] b byte which should be put into Tx buffer
 //! \return 0 if no error
 //! \return -1 if buffer full (retry)
 //! \note Applications shouldn't call these functions directly, instead please use \ref FBV
 /////////////////////////////////////////////////////////////////////////////
-s32 FBV_UART_TxBufferPut_NonBlocking(u8 b)
+s32 FBV_UART_TxBufferPut_NonBlocking(u8 fbv, u8 b)
 {
   // for more comfortable usage...
   // -> just forward to FBV_UART_TxBufferPutMore
-  return FBV_UART_TxBufferPutMore_NonBlocking(&b, 1);
+  return FBV_UART_TxBufferPutMore_NonBlocking(fbv, &b, 1);
 }
 
 
 /////////////////////////////////////////////////////////////////////////////
 //! puts a byte onto the transmit buffer<BR>
 //! (blocking function)
+//! \param[in] fbv FBV interface number (0..FBV_UART_NUM-1)
 //! \param[in] b byte which should be put into Tx buffer
 //! \return 0 if no error
 //! \note Applications shouldn't call these functions directly, instead please use \ref FBV
 /////////////////////////////////////////////////////////////////////////////
-s32 FBV_UART_TxBufferPut(u8 b)
+s32 FBV_UART_TxBufferPut(u8 fbv, u8 b)
 {
   s32 error;
 
-  while( (error=FBV_UART_TxBufferPutMore(&b, 1)) == -1 );
+  while( (error=FBV_UART_TxBufferPutMore(fbv, &b, 1)) == -1 );
 
   return error;
 }
 
 
+#if FBV_UART_RX_DMA
 /////////////////////////////////////////////////////////////////////////////
-//! returns the size of the next message in the receive buffer without taking it
-//! \return -1 if no new byte available
-//! \return 0 if no new message available
-//! \return > 0: size of received message
+// takes over the bytes which have been written by the DMA since the last call
+// the write position is derived from the remaining transfer count of the
+// circular DMA channel, it is only known modulo the buffer size: a complete
+// lap of the DMA between two calls can't be detected (see FBV_UART_RX_DMA)
+// must be called from the USART or Rx DMA interrupt, or with disabled interrupts
+/////////////////////////////////////////////////////////////////////////////
+static void FBV_UART_RxDMASync(u8 fbv)
+{
+  u16 pos = FBV_UART_RX_BUFFER_SIZE - fbv_uart_hw[fbv].rx_dma_channel->CNDTR;
+  u16 head = rx_buffer_head[fbv];
+
+  u16 len = (pos - head) & FBV_UART_RX_BUFFER_MASK;
+  if( !len )
+    return; // nothing new
+
+  stats[fbv].rx_bytes += len;
+
+  // the DMA has already written the bytes, only the head has to be published
+  // if unread bytes have been overwritten, the consumer skips them (see FBV_UART_RxBufferSync)
+  // bytes which have already been counted by a previous call (the consumer
+  // hasn't moved the tail since) are not counted again
+  u16 used = (u16)(head - rx_buffer_tail[fbv]);
+  u16 lost = (used > FBV_UART_RX_BUFFER_SIZE) ? (used - FBV_UART_RX_BUFFER_SIZE) : 0;
+  used += len;
+  if( used > FBV_UART_RX_BUFFER_SIZE )
+    stats[fbv].rx_overruns += used - FBV_UART_RX_BUFFER_SIZE - lost;
+
+  rx_buffer_head[fbv] = head + len;
+}
+#endif
+
+
+#if FBV_UART_TX_DMA
+/////////////////////////////////////////////////////////////////////////////
+// starts a DMA transfer for the contiguous span which begins at the tail of
+// the Tx buffer (up to the head, or up to the end of the buffer if wrapped)
+// can be called from any context: the DMA channel is claimed with a
+// compare-and-swap, so that only one caller starts a transfer
+/////////////////////////////////////////////////////////////////////////////
+static void FBV_UART_TxDMAStart(u8 fbv)
+{
+  while( tx_buffer_head[fbv] != tx_buffer_tail[fbv] ) {
+    if( !__sync_bool_compare_and_swap(&tx_dma_len[fbv], 0, FBV_UART_TX_DMA_CLAIMED) )
+      return; // transfer ongoing or being started by another context
+
+    u16 tail = tx_buffer_tail[fbv];
+    u16 used = (u16)(tx_buffer_head[fbv] - tail);
+    if( used ) {
+      u16 offset = tail & FBV_UART_TX_BUFFER_MASK;
+      u16 len = FBV_UART_TX_BUFFER_SIZE - offset;
+      if( len > used )
+        len = used;
+
+      DMA_Channel_TypeDef *dma = fbv_uart_hw[fbv].tx_dma_channel;
+      dma->CMAR = (u32)&tx_buffer[fbv][offset];
+      dma->CNDTR = len;
+      tx_dma_len[fbv] = len;
+      DMA_Cmd(dma, ENABLE);
+
+      ++stats[fbv].tx_dma_transfers;
+      return;
+    }
+
+    // the span has been taken meanwhile: release the channel and check again
+    tx_dma_len[fbv] = 0;
+  }
+}
+#endif
+
+
+/////////////////////////////////////////////////////////////////////////////
+//! copies the transfer statistics
+//! \param[in] fbv FBV interface number (0..FBV_UART_NUM-1)
+//! \param[out] *target pointer to statistics structure
+//! \return 0 if no error
+/////////////////////////////////////////////////////////////////////////////
+s32 FBV_UART_StatsGet(u8 fbv, fbv_uart_stats_t *target)
+{
+  if( fbv >= FBV_UART_NUM )
+    return -1; // FBV interface not available
+
+  // each counter is read atomically, the set of counters may be off by one transfer
+  memcpy(target, &stats[fbv], sizeof(fbv_uart_stats_t));
+
+  return 0; // no error
+}
+
+
+/////////////////////////////////////////////////////////////////////////////
+//! clears the transfer statistics
+//! \param[in] fbv FBV interface number (0..FBV_UART_NUM-1)
+//! \return 0 if no error
+//! \note a counter which is incremented by an interrupt meanwhile may keep its old value
+/////////////////////////////////////////////////////////////////////////////
+s32 FBV_UART_StatsClear(u8 fbv)
+{
+  if( fbv >= FBV_UART_NUM )
+    return -1; // FBV interface not available
+
+  memset(&stats[fbv], 0, sizeof(fbv_uart_stats_t));
+
+  return 0; // no error
+}
+
+
+/////////////////////////////////////////////////////////////////////////////
+//! installs a function which is called whenever a complete frame has been
+//! received (RXNE path: the size byte of the frame has been counted down,
+//! Rx DMA path: idle-line after new bytes)
+//! \param[in] *callback_rx_frame pointer to callback function (NULL: disabled),
+//! the interface number is passed as argument
+//! \return 0 if no error
+//! \note the callback is executed in interrupt context, it should only wake up
+//! the task which reads the Rx buffer
+/////////////////////////////////////////////////////////////////////////////
+s32 FBV_UART_RxFrameCallback_Init(void (*callback_rx_frame)(u8 fbv))
+{
+  rx_frame_callback = callback_rx_frame;
+
+  return 0; // no error
+}
+
+
+#if FBV_UART_RXNE
+/////////////////////////////////////////////////////////////////////////////
+// tracks the frame boundaries of the received bytes
+// returns 1 if b completes a frame
+// a 0xF0 always starts a new frame (same as FBV_UART_RxBufferReceiveMessage)
+/////////////////////////////////////////////////////////////////////////////
+static u8 FBV_UART_RxFrameTrack(u8 fbv, u8 b)
+{
+  if( b == 0xF0 ) {
+    rx_frame_state[fbv] = 1;
+    return 0;
+  }
+
+  if( rx_frame_state[fbv] == 1 ) {
+    rx_frame_remaining[fbv] = b;
+    rx_frame_state[fbv] = b ? 2 : 0;
+    return b ? 0 : 1;
+  }
+
+  if( rx_frame_state[fbv] == 2 && --rx_frame_remaining[fbv] == 0 ) {
+    rx_frame_state[fbv] = 0;
+    return 1;
+  }
+
+  return 0;
+}
+#endif
+
+
+/////////////////////////////////////////////////////////////////////////////
+//! returns the number of Tx interrupts which have been saved compared to the
+//! TXE interrupt path (one interrupt per byte)
+//! \param[in] fbv FBV interface number (0..FBV_UART_NUM-1)
+//! \return number of saved interrupts (0 if DMA is not used)
+/////////////////////////////////////////////////////////////////////////////
+s32 FBV_UART_TxIrqsSavedGet(u8 fbv)
+{
+  if( fbv >= FBV_UART_NUM )
+    return -1; // FBV interface not available
+
+  u32 bytes = stats[fbv].tx_bytes;
+  u32 irqs = stats[fbv].tx_irqs;
+
+  // the TXE path takes one interrupt per byte, plus one at the end of each
+  // burst which only disables the interrupt, so that irqs exceeds bytes
+  return (bytes > irqs) ? (s32)(bytes - irqs) : 0;
+}
+
+
+#define FBV_UART_RX_AT(fbv, ix) rx_buffer[fbv][(u16)(ix) & FBV_UART_RX_BUFFER_MASK]
+
+/////////////////////////////////////////////////////////////////////////////
+//! returns the next complete frame of the receive buffer without copying it
+//! Bytes in front of a frame header are skipped. Frames with an invalid size
+//! byte, and frames which are truncated by a new 0xF0 header, are dropped
+//! (counted in rx_frames_dropped) and the parser resynchronises on the next
+//! 0xF0. All available bytes are scanned in one call.
+//! \param[in] fbv FBV interface number (0..FBV_UART_NUM-1)
+//! \param[out] *frame view of the frame, valid until FBV_UART_RxFrameRelease
+//! \return 1 if a frame is available
+//! \return 0 if no complete frame is available (yet)
+//! \note must only be called from a single consumer context
 //! \note Applications shouldn't call these functions directly, instead please use \ref FBV
 /////////////////////////////////////////////////////////////////////////////
-s32 FBV_UART_RxBufferReceiveMessage(mios32_fbv_message_t *target)
+s32 FBV_UART_RxFrameGet(u8 fbv, fbv_uart_frame_t *frame)
 {
-  if( !rx_buffer_size )
-    return -1; // nothing new in buffer
+  if( fbv >= FBV_UART_NUM )
+    return -1; // FBV interface not available
+
+  u16 used = FBV_UART_RxBufferSync(fbv);
+  u16 tail = rx_buffer_tail[fbv];
+  s32 found = 0;
+
+  while( used ) {
+    if( FBV_UART_RX_AT(fbv, tail) != 0xF0 ) {
+      ++stats[fbv].rx_bytes_skipped; // no header
+      ++tail;
+      --used;
+      continue;
+    }
+
+    if( used < 2 )
+      break; // size byte not received yet
+
+    u8 size = FBV_UART_RX_AT(fbv, tail + 1); // cmd + data
+    if( size == 0 || size > FBV_UART_RX_FRAME_SIZE_MAX ) {
+      ++stats[fbv].rx_frames_dropped; // invalid size: resync on the next header
+      ++tail;
+      --used;
+      continue;
+    }
+
+    // a header inside of the frame means that the frame has been truncated
+    u16 avail = used - 2;
+    u16 n = (avail < size) ? avail : size;
+    u16 i;
+    for(i=0; i<n && FBV_UART_RX_AT(fbv, tail + 2 + i) != 0xF0; ++i);
+    if( i < n ) {
+      ++stats[fbv].rx_frames_dropped;
+      tail += 2 + i;
+      used -= 2 + i;
+      continue;
+    }
+
+    if( avail < size )
+      break; // frame not complete yet
+
+    frame->fbv = fbv;
+    frame->cmd = FBV_UART_RX_AT(fbv, tail + 2);
+    frame->len = size - 1;
+    frame->pos = tail + 3;
+    found = 1;
+    break;
+  }
 
-  static mios32_fbv_message_t msg = {0};
+  // release the skipped bytes, the frame itself stays in the buffer
+  FBV_UART_BARRIER();
+  rx_buffer_tail[fbv] = tail;
 
+  return found;
+}
+
+
+/////////////////////////////////////////////////////////////////////////////
+//! returns a data byte of a frame (the byte after the command is index 0)
+//! \param[in] *frame frame returned by FBV_UART_RxFrameGet
+//! \param[in] index data byte number
+//! \return data byte, 0 if the index is outside of the frame
+/////////////////////////////////////////////////////////////////////////////
+u8 FBV_UART_RxFrameData(const fbv_uart_frame_t *frame, u8 index)
+{
+  return (index < frame->len) ? FBV_UART_RX_AT(frame->fbv, frame->pos + index) : 0;
+}
+
+
+/////////////////////////////////////////////////////////////////////////////
+//! takes a frame returned by FBV_UART_RxFrameGet from the receive buffer
+//! \param[in] *frame frame returned by FBV_UART_RxFrameGet
+//! \return 0 if no error
+//! \return -1 if the frame has been overwritten by the Rx DMA while it was
+//! held, the bytes read from it are invalid (counted in rx_frames_dropped,
+//! the lost bytes in rx_overruns)
+/////////////////////////////////////////////////////////////////////////////
+s32 FBV_UART_RxFrameRelease(const fbv_uart_frame_t *frame)
+{
+  u8 fbv = frame->fbv;
   s32 status = 0;
-  s32 retval = -1;
-  u8 b = 0x00;
 
-	if((status = FBV_UART_RxBufferGet()) >= 0) {
-		b = (u8)status;
+  FBV_UART_BARRIER(); // the frame has to be read before it is released
+
+#if FBV_UART_RX_DMA
+  if( FBV_UART_RX_DMA_USED(fbv) ) {
+    // the DMA doesn't stop at the tail: take over its current write position
+    // and check that it hasn't reached the header of the frame meanwhile
+    MIOS32_IRQ_Disable();
+    FBV_UART_RxDMASync(fbv);
+    MIOS32_IRQ_Enable();
+
+    if( (u16)(rx_buffer_head[fbv] - (u16)(frame->pos - 3)) > FBV_UART_RX_BUFFER_SIZE ) {
+      ++stats[fbv].rx_frames_dropped;
+      status = -1;
+    }
+  }
+#endif
+
+  rx_buffer_tail[fbv] = frame->pos + frame->len;
+
+  return status;
+}
+
+
+/////////////////////////////////////////////////////////////////////////////
+//! takes the next complete message from the receive buffer
+//! (copying variant of FBV_UART_RxFrameGet)
+//! \param[in] fbv FBV interface number (0..FBV_UART_NUM-1)
+//! \param[out] *target received message
+//! \return -1 if no complete message available
+//! \return 0 if a message has been received
+//! \note Applications shouldn't call these functions directly, instead please use \ref FBV
+/////////////////////////////////////////////////////////////////////////////
+s32 FBV_UART_RxBufferReceiveMessage(u8 fbv, mios32_fbv_message_t *target)
+{
+  fbv_uart_frame_t frame;
+
+  while( FBV_UART_RxFrameGet(fbv, &frame) > 0 ) {
+    target->header = 0xF0;
+    target->size = frame.len + 1;
+    target->cmd = frame.cmd;
+    target->pos = frame.len;
+
+    u8 i;
+    for(i=0; i<frame.len; ++i)
+      target->data[i] = FBV_UART_RX_AT(fbv, frame.pos + i);
 
-		//DEBUG_MSG("input: %02X\n", (u8)b);
+    if( FBV_UART_RxFrameRelease(&frame) == 0 )
+      return 0;
+    // the copy is invalid (overwritten by the Rx DMA), try the next frame
+  }
+
+  return -1; // nothing new in buffer
+}
+
+/////////////////////////////////////////////////////////////////////////////
+//! clears a packet, frames are added with FBV_UART_PacketAddFrame
+//! \param[out] *packet packet to be cleared
+/////////////////////////////////////////////////////////////////////////////
+void FBV_UART_PacketClear(fbv_uart_packet_t *packet)
+{
+	packet->len = 0;
+}
+
+
+/////////////////////////////////////////////////////////////////////////////
+//! adds a complete F0 size cmd data... frame to a packet
+//! \param[in,out] *packet packet which is built
+//! \param[in] cmd FBV command byte
+//! \param[in] *data command data (can be NULL if len is 0)
+//! \param[in] len number of data bytes
+//! \return 0 if no error
+//! \return -1 if the frame doesn't fit into the packet (packet unchanged)
+/////////////////////////////////////////////////////////////////////////////
+s32 FBV_UART_PacketAddFrame(fbv_uart_packet_t *packet, u8 cmd, const u8 *data, u8 len)
+{
+	if( (u16)packet->len + 3 + len > FBV_UART_PACKET_SIZE )
+		return -1; // packet full
+
+	u8 *p = &packet->buf[packet->len];
+	*p++ = 0xF0;    //header
+	*p++ = len + 1; //size (cmd + data)
+	*p++ = cmd;
+	if( len )
+		memcpy(p, data, len);
 
+	packet->len += 3 + len;
 
-		if(b == 0xF0) {
-			bzero(&msg,sizeof(mios32_fbv_message_t));
+	return 0; // no error
+}
+
+
+/////////////////////////////////////////////////////////////////////////////
+//! puts a packet onto the transmit buffer: all frames are either completely
+//! enqueued or rejected, frames of other writers can't interleave
+//! \param[in] fbv FBV interface number (0..FBV_UART_NUM-1)
+//! \param[in] *packet packet to be sent
+//! \return 0 if no error
+//! \return -1 if buffer full (retry, counted in tx_overflows)
+//! \note can be called from interrupts
+/////////////////////////////////////////////////////////////////////////////
+s32 FBV_UART_PacketSend_NonBlocking(u8 fbv, fbv_uart_packet_t *packet)
+{
+	return FBV_UART_TxBufferPutMore_NonBlocking(fbv, packet->buf, packet->len);
+}
+
+
+/////////////////////////////////////////////////////////////////////////////
+//! puts a packet onto the transmit buffer<BR>
+//! (blocking function, must not be called from interrupts)
+//! \param[in] fbv FBV interface number (0..FBV_UART_NUM-1)
+//! \param[in] *packet packet to be sent
+//! \return 0 if no error
+/////////////////////////////////////////////////////////////////////////////
+s32 FBV_UART_PacketSend(u8 fbv, fbv_uart_packet_t *packet)
+{
+	return FBV_UART_TxBufferPutMore(fbv, packet->buf, packet->len);
+}
+
+
+s32 FBV_UART_TxBufferSendInit(u8 fbv)
+{
+	fbv_uart_packet_t packet;
+	const u8 data[1] = { 0x00 }; // version 0?!?
+
+	FBV_UART_PacketClear(&packet);
+	FBV_UART_PacketAddFrame(&packet, 0x01, data, sizeof(data)); // version cmd?!?
+
+	return FBV_UART_PacketSend(fbv, &packet);
+}
+
+
+// adds a LED command frame to a packet
+static void FBV_UART_PacketAddLed(fbv_uart_packet_t *packet, u8 led, u8 status)
+{
+	u8 data[2];
+
+	data[0] = led; // led ID
+	if( led == FBV_ID_FOOT_CTRL_W_BTN) data[0] = FBV_ID_FOOT_CTRL_P1_LED;
+	if( led == FBV_ID_FOOT_CTRL_V_BTN) data[0] = FBV_ID_FOOT_CTRL_V_LED;
+	data[1] = status; // led state
+
+	FBV_UART_PacketAddFrame(packet, 0x04, data, sizeof(data)); // Led command
+}
+
+
+/////////////////////////////////////////////////////////////////////////////
+// sends a LED command unless the shadow copy shows that the LED already has
+// this state (counted in tx_led_skipped)
+// The comparison, the enqueue of the frame and the update of the shadow are
+// done while the shadow mutex is held: LED commands are sent from several
+// tasks, and the shadow always has to match the last command of the LED in
+// the buffer. The blocking variant releases the mutex while the buffer is full.
+// Task context only, interrupts have to use FBV_UART_TxBufferSendLedCommand_Deferred.
+// A deferred command of the LED which is still pending is older than this one
+// and is dropped, otherwise FBV_UART_TxDeferredFlush would override it later.
+// returns 1 if unchanged, -1 if the buffer is full (non-blocking only)
+/////////////////////////////////////////////////////////////////////////////
+static s32 FBV_UART_LedSend(u8 fbv, u8 led, u8 status, u8 blocking)
+{
+	u8 w = led >> 5;
+	u32 mask = (u32)1 << (led & 31);
+	u32 on = (status != FBV_LED_OFF) ? mask : 0;
+	fbv_uart_packet_t packet;
+	s32 error;
+
+	FBV_UART_PacketClear(&packet);
+	FBV_UART_PacketAddLed(&packet, led, status);
+
+	if( led < FBV_UART_LED_DEFERRED_NUM )
+		__sync_fetch_and_and(&led_deferred_pending[fbv][w], ~mask);
+
+	do {
+		FBV_UART_SHADOW_TAKE(fbv);
+		if( (led_shadow_valid[fbv][w] & mask) && (led_shadow_on[fbv][w] & mask) == on ) {
+			FBV_UART_SHADOW_GIVE(fbv);
+			__sync_fetch_and_add(&stats[fbv].tx_led_skipped, 1);
+			return 1; // unchanged
 		}
 
-		if( msg.header != 0xF0) {
-		  if( b == 0xF0) {
-			  msg.header = b;
-		  }
-		} else if (msg.size == 0) {
-		  msg.size = b;
-		  if(msg.size == (msg.pos + 0))
-			  retval = 0;
-		} else if (msg.cmd == 0) {
-		  msg.cmd = b;
-		  if(msg.size == (msg.pos + 1))
-			  retval = 0;
-		} else {
-		  msg.data[msg.pos++] = (u8)status;
-		  if(msg.size == (msg.pos + 1))
-			  retval = 0;
+		error = FBV_UART_TxBufferPutMore_Try(fbv, packet.buf, packet.len, !blocking);
+		if( error >= 0 ) {
+			led_shadow_on[fbv][w] = (led_shadow_on[fbv][w] & ~mask) | on;
+			led_shadow_valid[fbv][w] |= mask;
 		}
+		FBV_UART_SHADOW_GIVE(fbv);
+	} while( error < 0 && blocking );
+
+	// if the command has been rejected, the shadow still shows the last state in the buffer
+	return error;
+}
+
+
+/////////////////////////////////////////////////////////////////////////////
+//! forgets the shadow copy of the LEDs, so that the next command of each
+//! LED is sent in any case (e.g. after the FBV has been (re)connected)
+//! \param[in] fbv FBV interface number (0..FBV_UART_NUM-1)
+//! \return 0 if no error
+/////////////////////////////////////////////////////////////////////////////
+s32 FBV_UART_LedInvalidate(u8 fbv)
+{
+	if( fbv >= FBV_UART_NUM )
+		return -1; // FBV interface not available
 
+	int w;
+	for(w=0; w < (FBV_UART_ID_NUM/32); w++)
+		led_shadow_valid[fbv][w] = 0;
+
+	return 0;
+}
+
+
+/////////////////////////////////////////////////////////////////////////////
+//! sends a LED command if it completely fits into the transmit buffer
+//! \param[in] fbv FBV interface number (0..FBV_UART_NUM-1)
+//! \param[in] led FBV id of the LED (or of the foot controller button)
+//! \param[in] status FBV_LED_ON or FBV_LED_OFF
+//! \return 0 if no error
+//! \return 1 if the LED already has this state, or the model has no such LED
+//! \return -1 if buffer full (the command is dropped and counted in tx_overflows)
+/////////////////////////////////////////////////////////////////////////////
+s32 FBV_UART_TxBufferSendLedCommand_NonBlocking(u8 fbv, u8 led, u8 status)
+{
+	if( fbv >= FBV_UART_NUM )
+		return -1; // FBV interface not available
+
+	if( !FBV_UART_LedPresent(fbv, led) ) {
+		__sync_fetch_and_add(&stats[fbv].tx_caps_dropped, 1);
+		return 1; // the model has no such LED
 	}
 
-  if(retval == 0) {
-	  memcpy(target,&msg,sizeof(mios32_fbv_message_t));
-//	  bzero(&msg,sizeof(mios32_fbv_message_t))
-	  DEBUG_MSG("\n\nFBV Message DONE\n\n");
-  }
-  return retval; // return received byte
+	return FBV_UART_LedSend(fbv, led, status, 0);
 }
 
-s32 FBV_UART_TxBufferSendInit(void)
+
+/////////////////////////////////////////////////////////////////////////////
+//! defers a LED command to task context, can be called from interrupts
+//! the command is sent by FBV_UART_TxDeferredFlush; if the same LED is
+//! deferred again before, only the latest state is sent, and a direct
+//! command of the LED in between drops it
+//! \param[in] fbv FBV interface number (0..FBV_UART_NUM-1)
+//! \param[in] led FBV id of the LED (or of the foot controller button)
+//! \param[in] status FBV_LED_ON or FBV_LED_OFF
+//! \return 0 if no error
+//! \return -1 if the LED id is out of range (counted in tx_overflows)
+/////////////////////////////////////////////////////////////////////////////
+s32 FBV_UART_TxBufferSendLedCommand_Deferred(u8 fbv, u8 led, u8 status)
 {
-	FBV_UART_TxBufferPut(0xF0); //header
-	FBV_UART_TxBufferPut(0x02); //size
-	FBV_UART_TxBufferPut(0x01); // version cmd?!?
-	FBV_UART_TxBufferPut(0x00);  // version 0?!?
+	if( fbv >= FBV_UART_NUM )
+		return -1; // FBV interface not available
 
-	return 0;
+	if( led >= FBV_UART_LED_DEFERRED_NUM ) {
+		__sync_fetch_and_add(&stats[fbv].tx_overflows, 1);
+		return -1; // no slot for this id
+	}
+
+	if( !FBV_UART_LedPresent(fbv, led) ) {
+		__sync_fetch_and_add(&stats[fbv].tx_caps_dropped, 1);
+		return 1; // the model has no such LED
+	}
+
+	led_deferred_state[fbv][led] = status;
+	FBV_UART_BARRIER(); // the state has to be stored before it is marked as pending
+	__sync_fetch_and_or(&led_deferred_pending[fbv][led >> 5], (u32)1 << (led & 31));
+	__sync_fetch_and_add(&stats[fbv].tx_deferred, 1);
+
+	return 0; // no error
 }
 
 
-s32 FBV_UART_TxBufferSendLedCommand(u8 led, u8 status)
+/////////////////////////////////////////////////////////////////////////////
+//! sends the LED commands which have been deferred from interrupt context
+//! must be called periodically from task context, never blocks: commands
+//! which don't fit into the transmit buffer stay pending for the next call
+//! \param[in] fbv FBV interface number (0..FBV_UART_NUM-1)
+//! \return number of LED commands which are still pending
+/////////////////////////////////////////////////////////////////////////////
+s32 FBV_UART_TxDeferredFlush(u8 fbv)
 {
-	u8 led_inner = led;
-	if( led == FBV_ID_FOOT_CTRL_W_BTN) led_inner = FBV_ID_FOOT_CTRL_P1_LED;
-	if( led == FBV_ID_FOOT_CTRL_V_BTN) led_inner = FBV_ID_FOOT_CTRL_V_LED;
+	if( fbv >= FBV_UART_NUM )
+		return -1; // FBV interface not available
+
+	s32 remaining = 0;
+	int w;
+
+	for(w=0; w < (FBV_UART_LED_DEFERRED_NUM/32); w++) {
+		u32 pending = led_deferred_pending[fbv][w];
+
+		while( pending ) {
+			u8 bit = 31 - __builtin_clz(pending & -pending);
+			u8 led = (w << 5) | bit;
+			u32 mask = (u32)1 << bit;
+
+			pending &= ~mask;
+
+			if( remaining ) {
+				++remaining; // buffer full: keep it for the next call
+				continue;
+			}
+
+			// the command is taken and sent while the shadow mutex is held, so
+			// that a direct command of the LED from another task can't come in
+			// between (the interrupts only set pending bits)
+			FBV_UART_SHADOW_TAKE(fbv);
+			if( led_deferred_pending[fbv][w] & mask ) {
+				__sync_fetch_and_and(&led_deferred_pending[fbv][w], ~mask);
+				if( FBV_UART_TxBufferSendLedCommand_NonBlocking(fbv, led, led_deferred_state[fbv][led]) < 0 ) {
+					// buffer full: keep it for the next call
+					__sync_fetch_and_or(&led_deferred_pending[fbv][w], mask);
+					++remaining;
+				}
+			}
+			FBV_UART_SHADOW_GIVE(fbv);
+		}
+	}
+
+	return remaining;
+}
 
-	FBV_UART_TxBufferPut(0xF0); //header
-	FBV_UART_TxBufferPut(0x03); //size
-	FBV_UART_TxBufferPut(0x04); // Led command
-	FBV_UART_TxBufferPut(led_inner);  // led ID
-	FBV_UART_TxBufferPut(status); // led state
 
-	return 0;
+s32 FBV_UART_TxBufferSendLedCommand(u8 fbv, u8 led, u8 status)
+{
+	if( fbv >= FBV_UART_NUM )
+		return -1; // FBV interface not available
+
+	if( !FBV_UART_LedPresent(fbv, led) ) {
+		__sync_fetch_and_add(&stats[fbv].tx_caps_dropped, 1);
+		return 1; // the model has no such LED
+	}
+
+	return FBV_UART_LedSend(fbv, led, status, 1);
 }
 
-s32 FBV_UART_TxBufferSendChannelCommand(u8 group, u8 nr, u8 ch)
+s32 FBV_UART_TxBufferSendChannelCommand(u8 fbv, u8 group, u8 nr, u8 ch)
 {
-	FBV_UART_TxBufferPut(0xF0); //header
-	FBV_UART_TxBufferPut(0x05); //size
-	FBV_UART_TxBufferPut(0x08); // Channel command
-	FBV_UART_TxBufferPut(group);  // group (F/U)
-	FBV_UART_TxBufferPut(0x20);  // 'space'
-	FBV_UART_TxBufferPut(nr); // Channel number
-	FBV_UART_TxBufferPut(ch); // Channel char
-	FBV_UART_TxBufferPut(0xF0); //header
-	FBV_UART_TxBufferPut(0x02); //size
-	FBV_UART_TxBufferPut(0x20); // Channel command
-	FBV_UART_TxBufferPut(0x00);  // 0 = off, 1 = on
+	if( fbv >= FBV_UART_NUM )
+		return -1; // FBV interface not available
 
-	return 0;
+	if( !(model_flags[fbv] & FBV_CAP_CHANNEL_DISPLAY) ) {
+		__sync_fetch_and_add(&stats[fbv].tx_caps_dropped, 1);
+		return 1; // the model has no channel display
+	}
+
+	fbv_uart_packet_t packet;
+	const u8 channel[4] = { group, 0x20, nr, ch }; // group (F/U), 'space', Channel number, Channel char
+	const u8 flat[1] = { 0x00 };                   // 0 = off, 1 = on
+
+	FBV_UART_PacketClear(&packet);
+	FBV_UART_PacketAddFrame(&packet, 0x08, channel, sizeof(channel)); // Channel command
+	FBV_UART_PacketAddFrame(&packet, 0x20, flat, sizeof(flat));
+
+	return FBV_UART_PacketSend(fbv, &packet);
 }
 
-s32 FBV_UART_TxBufferSendDisplay(u8 *buf, u8 len)
+/////////////////////////////////////////////////////////////////////////////
+//! sends a text to the 16 character display of the FBV
+//! the text is padded with spaces; if it matches the current display content
+//! (shadow copy) no frame is sent
+//! The comparison, the enqueue of the frame and the update of the shadow are
+//! done while the shadow mutex is held (like for the LEDs), the shadow is
+//! only updated once the frame is in the transmit buffer.
+//! \note task context only
+//! \param[in] fbv FBV interface number (0..FBV_UART_NUM-1)
+//! \param[in] *buf characters to be displayed
+//! \param[in] len number of characters (only the first 16 are used)
+//! \return 0 if the frame has been sent
+//! \return 1 if the display already shows this text, or the model has no
+//! text display
+/////////////////////////////////////////////////////////////////////////////
+s32 FBV_UART_TxBufferSendDisplay(u8 fbv, u8 *buf, u8 len)
 {
-	FBV_UART_TxBufferPut(0xF0); //header
-	FBV_UART_TxBufferPut(0x13); //size
-	FBV_UART_TxBufferPut(0x10); // Channel command
-	FBV_UART_TxBufferPut(0x00);  // ???
-	FBV_UART_TxBufferPut(0x10);  // ???
+	if( fbv >= FBV_UART_NUM )
+		return -1; // FBV interface not available
+
+	if( !(model_flags[fbv] & FBV_CAP_TEXT_DISPLAY) ) {
+		__sync_fetch_and_add(&stats[fbv].tx_caps_dropped, 1);
+		return 1; // the model has no text display
+	}
+
+	u8 chars[FBV_UART_DISPLAY_LEN];
 	int i;
-	for(i=0; i < len && i < 16; i++)
-		FBV_UART_TxBufferPut(buf[i]); // chars
-	for(i=0; i < 16; i++)
-		FBV_UART_TxBufferPut(0x20); // 'space'
+	for(i=0; i < FBV_UART_DISPLAY_LEN; i++)
+		chars[i] = (i < len) ? buf[i] : 0x20; // chars, padded with 'space'
+
+	fbv_uart_packet_t packet;
+	u8 data[2 + FBV_UART_DISPLAY_LEN];
+	data[0] = 0x00; // ???
+	data[1] = 0x10; // ???
+	memcpy(&data[2], chars, FBV_UART_DISPLAY_LEN);
+
+	FBV_UART_PacketClear(&packet);
+	FBV_UART_PacketAddFrame(&packet, 0x10, data, sizeof(data)); // Display command
+
+	s32 error;
+	do {
+		FBV_UART_SHADOW_TAKE(fbv);
+		if( display_shadow_valid[fbv] && memcmp(chars, display_shadow[fbv], FBV_UART_DISPLAY_LEN) == 0 ) {
+			FBV_UART_SHADOW_GIVE(fbv);
+			__sync_fetch_and_add(&stats[fbv].tx_display_skipped, 1);
+			return 1; // unchanged
+		}
+
+		error = FBV_UART_TxBufferPutMore_Try(fbv, packet.buf, packet.len, 0);
+		if( error >= 0 ) {
+			memcpy(display_shadow[fbv], chars, FBV_UART_DISPLAY_LEN);
+			display_shadow_valid[fbv] = 1;
+		}
+		FBV_UART_SHADOW_GIVE(fbv);
+	} while( error < 0 ); // buffer full: release the mutex until it has been drained
+
 	return 0;
 }
 
-s32 FBV_UART_TxBufferSendTuner(u8 note, u8 flat)
-{
-	FBV_UART_TxBufferPut(0xF0); //header
-	FBV_UART_TxBufferPut(0x05); //size
-	FBV_UART_TxBufferPut(0x08); // Channel command
-	FBV_UART_TxBufferPut(0x20);  // group (F/U)
-	FBV_UART_TxBufferPut(0x20);  // 'space'
-	FBV_UART_TxBufferPut(0x20); // Channel number
-	FBV_UART_TxBufferPut(0x20); // Channel char
-	FBV_UART_TxBufferPut(0xF0); //header
-	FBV_UART_TxBufferPut(0x02); //size
-	FBV_UART_TxBufferPut(0x0C); // note
-	FBV_UART_TxBufferPut(note);  // ASCII
-	FBV_UART_TxBufferPut(0xF0); //header
-	FBV_UART_TxBufferPut(0x02); //size
-	FBV_UART_TxBufferPut(0x20); // Channel command
-	FBV_UART_TxBufferPut(flat);  // 0 = off, 1 = on
+
+/////////////////////////////////////////////////////////////////////////////
+//! forgets the shadow copy of the display, so that the next text is sent
+//! in any case (e.g. after the FBV has been (re)connected)
+//! \param[in] fbv FBV interface number (0..FBV_UART_NUM-1)
+//! \return 0 if no error
+/////////////////////////////////////////////////////////////////////////////
+s32 FBV_UART_DisplayInvalidate(u8 fbv)
+{
+	if( fbv >= FBV_UART_NUM )
+		return -1; // FBV interface not available
+
+	display_shadow_valid[fbv] = 0;
 	return 0;
 }
 
+s32 FBV_UART_TxBufferSendTuner(u8 fbv, u8 note, u8 flat)
+{
+	if( fbv >= FBV_UART_NUM )
+		return -1; // FBV interface not available
+
+	if( !(model_flags[fbv] & FBV_CAP_CHANNEL_DISPLAY) ) {
+		__sync_fetch_and_add(&stats[fbv].tx_caps_dropped, 1);
+		return 1; // the tuner is shown on the channel display
+	}
+
+	fbv_uart_packet_t packet;
+	const u8 channel[4] = { 0x20, 0x20, 0x20, 0x20 }; // group, 'space', Channel number, Channel char
+	const u8 note_data[1] = { note };                 // ASCII
+	const u8 flat_data[1] = { flat };                 // 0 = off, 1 = on
+
+	FBV_UART_PacketClear(&packet);
+	FBV_UART_PacketAddFrame(&packet, 0x08, channel, sizeof(channel));     // Channel command
+	FBV_UART_PacketAddFrame(&packet, 0x0C, note_data, sizeof(note_data)); // note
+	FBV_UART_PacketAddFrame(&packet, 0x20, flat_data, sizeof(flat_data)); // flat
+
+	return FBV_UART_PacketSend(fbv, &packet);
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// Capability tables of the FBV models
+// LED ids are the ids passed to FBV_UART_TxBufferSendLedCommand, the LEDs of
+// the pedal switches are addressed by their switch ids
+// The payload of the init frame isn't documented for any model (see the
+// protocol analysis in documents/), therefore no model is detected from it
+// so far and the reduced models are only selected with FBV_UART_ModelSet.
+// A handshake should only be entered here once it has been captured from
+// the real floorboard.
+/////////////////////////////////////////////////////////////////////////////
+
+static const u8 fbv_full_switches[] = {
+	FBV_ID_TAP, FBV_ID_DELAY, FBV_ID_MODULATION, FBV_ID_PITCH, FBV_ID_REVERB, FBV_ID_AMP2, FBV_ID_AMP1,
+	FBV_ID_CHAN_FAV, FBV_ID_CHAN_D, FBV_ID_CHAN_C, FBV_ID_CHAN_B, FBV_ID_CHAN_A, FBV_ID_BANK_UP, FBV_ID_BANK_DOWN,
+	FBV_ID_STOMP3, FBV_ID_STOMP2, FBV_ID_STOMP1, FBV_ID_FX_LOOP, FBV_ID_FOOT_CTRL_V_BTN, FBV_ID_FOOT_CTRL_W_BTN,
+};
+static const u8 fbv_full_leds[] = {
+	FBV_ID_TAP, FBV_ID_DELAY, FBV_ID_MODULATION, FBV_ID_PITCH, FBV_ID_REVERB, FBV_ID_AMP2, FBV_ID_AMP1,
+	FBV_ID_CHAN_FAV, FBV_ID_CHAN_D, FBV_ID_CHAN_C, FBV_ID_CHAN_B, FBV_ID_CHAN_A,
+	FBV_ID_STOMP3, FBV_ID_STOMP2, FBV_ID_STOMP1, FBV_ID_FX_LOOP,
+	FBV_ID_FOOT_CTRL_V_LED, FBV_ID_FOOT_CTRL_P2_LED, FBV_ID_FOOT_CTRL_W_LED, FBV_ID_FOOT_CTRL_P1_LED,
+	FBV_ID_FOOT_CTRL_V_BTN, FBV_ID_FOOT_CTRL_W_BTN,
+};
+
+// Shortboard: no amp/effect row, a single pedal
+static const u8 fbv_shortboard_switches[] = {
+	FBV_ID_TAP, FBV_ID_DELAY, FBV_ID_MODULATION,
+	FBV_ID_CHAN_FAV, FBV_ID_CHAN_D, FBV_ID_CHAN_C, FBV_ID_CHAN_B, FBV_ID_CHAN_A, FBV_ID_BANK_UP, FBV_ID_BANK_DOWN,
+	FBV_ID_STOMP1, FBV_ID_FX_LOOP, FBV_ID_FOOT_CTRL_W_BTN,
+};
+static const u8 fbv_shortboard_leds[] = {
+	FBV_ID_TAP, FBV_ID_DELAY, FBV_ID_MODULATION,
+	FBV_ID_CHAN_FAV, FBV_ID_CHAN_D, FBV_ID_CHAN_C, FBV_ID_CHAN_B, FBV_ID_CHAN_A,
+	FBV_ID_STOMP1, FBV_ID_FX_LOOP,
+	FBV_ID_FOOT_CTRL_W_LED, FBV_ID_FOOT_CTRL_P1_LED, FBV_ID_FOOT_CTRL_W_BTN,
+};
+
+// Express: four channel switches and a single pedal, no text display
+static const u8 fbv_express_switches[] = {
+	FBV_ID_CHAN_D, FBV_ID_CHAN_C, FBV_ID_CHAN_B, FBV_ID_CHAN_A, FBV_ID_FOOT_CTRL_W_BTN,
+};
+static const u8 fbv_express_leds[] = {
+	FBV_ID_CHAN_D, FBV_ID_CHAN_C, FBV_ID_CHAN_B, FBV_ID_CHAN_A,
+	FBV_ID_FOOT_CTRL_W_LED, FBV_ID_FOOT_CTRL_P1_LED, FBV_ID_FOOT_CTRL_W_BTN,
+};
+
+#define FBV_UART_MODEL(name, handshake, flags, pedals, switches, leds) \
+  { name, handshake, flags, pedals, sizeof(switches), switches, sizeof(leds), leds }
+
+// indexed by FBV_MODEL_*
+static const fbv_uart_model_t fbv_uart_models[FBV_MODEL_NUM] = {
+  FBV_UART_MODEL("FBV",            FBV_MODEL_HANDSHAKE_NONE, FBV_CAP_TEXT_DISPLAY | FBV_CAP_CHANNEL_DISPLAY, FBV_PEDAL_W | FBV_PEDAL_V, fbv_full_switches, fbv_full_leds),
+  FBV_UART_MODEL("FBV Shortboard", FBV_MODEL_HANDSHAKE_NONE, FBV_CAP_TEXT_DISPLAY | FBV_CAP_CHANNEL_DISPLAY, FBV_PEDAL_W, fbv_shortboard_switches, fbv_shortboard_leds),
+  FBV_UART_MODEL("FBV Express",    FBV_MODEL_HANDSHAKE_NONE, FBV_CAP_CHANNEL_DISPLAY, FBV_PEDAL_W, fbv_express_switches, fbv_express_leds),
+};
+
+
+/////////////////////////////////////////////////////////////////////////////
+// selects the capabilities of a model
+/////////////////////////////////////////////////////////////////////////////
+static void FBV_UART_ModelSelect(u8 fbv, u8 num)
+{
+  const fbv_uart_model_t *m = &fbv_uart_models[num];
+  u8 i;
+
+  model[fbv] = num;
+  model_flags[fbv] = m->flags;
+
+  memset(led_present[fbv], 0, sizeof(led_present[fbv]));
+  for(i=0; i<m->num_leds; ++i)
+    led_present[fbv][m->leds[i] >> 5] |= (u32)1 << (m->leds[i] & 31);
+
+  memset(switch_present[fbv], 0, sizeof(switch_present[fbv]));
+  for(i=0; i<m->num_switches; ++i)
+    switch_present[fbv][m->switches[i] >> 5] |= (u32)1 << (m->switches[i] & 31);
+}
+
+
+/////////////////////////////////////////////////////////////////////////////
+//! selects the model of a FBV from the payload of its init frame (0x90)
+//! LED, display and tuner commands for hardware which isn't present on this
+//! model are dropped afterwards (counted in tx_caps_dropped)
+//! \param[in] fbv FBV interface number (0..FBV_UART_NUM-1)
+//! \param[in] handshake first data byte of the init frame
+//! \return detected model (FBV_MODEL_*), unknown or undocumented payloads are
+//! served as FBV_MODEL_FULL
+//! \return -1 if the interface isn't available
+/////////////////////////////////////////////////////////////////////////////
+s32 FBV_UART_ModelDetect(u8 fbv, u8 handshake)
+{
+  if( fbv >= FBV_UART_NUM )
+    return -1; // FBV interface not available
+
+  u8 num;
+  for(num=0; num<FBV_MODEL_NUM && fbv_uart_models[num].handshake != handshake; ++num);
+  if( num >= FBV_MODEL_NUM )
+    num = FBV_MODEL_FULL; // unknown: nothing is dropped
+
+  FBV_UART_ModelSelect(fbv, num);
+
+  return num;
+}
+
+
+/////////////////////////////////////////////////////////////////////////////
+//! selects the model of a FBV whose init frame doesn't identify it
+//! \param[in] fbv FBV interface number (0..FBV_UART_NUM-1)
+//! \param[in] model FBV_MODEL_*
+//! \return 0 if no error, -1 if the interface or the model isn't available
+/////////////////////////////////////////////////////////////////////////////
+s32 FBV_UART_ModelSet(u8 fbv, u8 model)
+{
+  if( fbv >= FBV_UART_NUM )
+    return -1; // FBV interface not available
+
+  if( model >= FBV_MODEL_NUM )
+    return -1; // unknown model
+
+  FBV_UART_ModelSelect(fbv, model);
+
+  return 0; // no error
+}
+
+
+/////////////////////////////////////////////////////////////////////////////
+//! returns the capabilities of the detected model
+//! \param[in] fbv FBV interface number (0..FBV_UART_NUM-1)
+//! \return pointer to the capability table, NULL if the interface isn't available
+/////////////////////////////////////////////////////////////////////////////
+const fbv_uart_model_t *FBV_UART_ModelGet(u8 fbv)
+{
+  if( fbv >= FBV_UART_NUM )
+    return NULL; // FBV interface not available
+
+  return &fbv_uart_models[model[fbv]];
+}
+
+
+/////////////////////////////////////////////////////////////////////////////
+//! checks if the detected model has a LED
+//! \param[in] fbv FBV interface number (0..FBV_UART_NUM-1)
+//! \param[in] led LED id
+//! \return 1 if the LED is present, 0 if not
+/////////////////////////////////////////////////////////////////////////////
+s32 FBV_UART_LedPresent(u8 fbv, u8 led)
+{
+  if( fbv >= FBV_UART_NUM || led >= FBV_UART_ID_NUM )
+    return 0;
+
+  return (led_present[fbv][led >> 5] >> (led & 31)) & 1;
+}
+
+
+/////////////////////////////////////////////////////////////////////////////
+//! checks if the detected model has a switch
+//! \param[in] fbv FBV interface number (0..FBV_UART_NUM-1)
+//! \param[in] id switch id
+//! \return 1 if the switch is present, 0 if not
+/////////////////////////////////////////////////////////////////////////////
+s32 FBV_UART_SwitchPresent(u8 fbv, u8 id)
+{
+  if( fbv >= FBV_UART_NUM || id >= FBV_UART_ID_NUM )
+    return 0;
+
+  return (switch_present[fbv][id >> 5] >> (id & 31)) & 1;
+}
+
+
 /////////////////////////////////////////////////////////////////////////////
 // Interrupt handler for fbv UART
 /////////////////////////////////////////////////////////////////////////////
-FBV_UART_IRQHANDLER_FUNC
+static void FBV_UART_IRQHandler(u8 fbv)
 {
-  if( FBV_UART->SR & (1 << 5) ) { // check if RXNE flag is set
-    u8 b = FBV_UART->DR;
+  USART_TypeDef *usart = fbv_uart_hw[fbv].usart;
+
+#if FBV_UART_RX_DMA
+  if( FBV_UART_RX_DMA_USED(fbv) && (usart->SR & (1 << 4)) ) { // check if IDLE flag is set
+    u8 b = usart->DR; // clears IDLE flag (SR read followed by DR read)
+    (void)b;
+
+    ++stats[fbv].rx_irqs;
+    u32 rx_bytes = stats[fbv].rx_bytes;
+    FBV_UART_RxDMASync(fbv);
+    if( stats[fbv].rx_bytes != rx_bytes ) {
+      ++stats[fbv].rx_frames;
+      if( rx_frame_callback )
+        rx_frame_callback(fbv);
+    }
+  }
+#endif
+
+#if FBV_UART_RXNE
+  if( !FBV_UART_RX_DMA_USED(fbv) && (usart->SR & (1 << 5)) ) { // check if RXNE flag is set
+    u8 b = usart->DR;
+
+    ++stats[fbv].rx_irqs;
+    ++stats[fbv].rx_bytes;
 
     //s32 status = MIOS32_MIDI_SendByteToRxCallback(UART0, b);
 
     //if( status == 0 && FBV_UART_RxBufferPut(0, b) < 0 ) {
-    if( FBV_UART_RxBufferPut( b) < 0 ) {
+    if( FBV_UART_RxBufferPut(fbv, b) < 0 ) {
 
     	// here we could add some error handling
     	//DEBUG_MSG("errin:\n");
+    	++stats[fbv].rx_overruns;
     } else {
     	//DEBUG_MSG("input: %02X\n", (u8)b);
+    	if( FBV_UART_RxFrameTrack(fbv, b) ) {
+    	  ++stats[fbv].rx_frames;
+    	  if( rx_frame_callback )
+    	    rx_frame_callback(fbv);
+    	}
     }
 
   }
+#endif
 
-  if( FBV_UART->SR & (1 << 7) ) { // check if TXE flag is set
-    if( FBV_UART_TxBufferUsed() > 0 ) {
-      s32 b = FBV_UART_TxBufferGet();
+#if FBV_UART_TXE
+  if( !FBV_UART_TX_DMA_USED(fbv) && (usart->CR1 & (1 << 7)) && (usart->SR & (1 << 7)) ) { // check if TXE interrupt enabled and TXE flag is set
+    ++stats[fbv].tx_irqs;
+    if( FBV_UART_TxBufferUsed(fbv) > 0 ) {
+      s32 b = FBV_UART_TxBufferGet(fbv);
+      ++stats[fbv].tx_bytes;
 
       if( b < 0 ) {
     	  // here we could add some error handling
-    	  FBV_UART->DR = 0xff;
+    	  usart->DR = 0xff;
     	  //DEBUG_MSG("errout: %02X\n", (u8)b);
       } else {
-    	  FBV_UART->DR = (u8)b;
+    	  usart->DR = (u8)b;
     	  //DEBUG_MSG("output: %02X\n", (u8)b);
       }
     } else {
-      FBV_UART->CR1 &= ~(1 << 7); // disable TXE interrupt (TXEIE=0)
+      usart->CR1 &= ~(1 << 7); // disable TXE interrupt (TXEIE=0)
     }
   }
+#endif
+}
+
+
+#if FBV_UART_TX_DMA
+/////////////////////////////////////////////////////////////////////////////
+// Interrupt handler for fbv UART Tx DMA (transfer complete)
+/////////////////////////////////////////////////////////////////////////////
+static void FBV_UART_TxDMAIRQHandler(u8 fbv)
+{
+  DMA_ClearITPendingBit(fbv_uart_hw[fbv].tx_dma_it_gl);
+  DMA_Cmd(fbv_uart_hw[fbv].tx_dma_channel, DISABLE);
+
+  // release the transmitted span
+  u16 len = tx_dma_len[fbv];
+  FBV_UART_BARRIER();
+  tx_buffer_tail[fbv] += len;
+  tx_dma_len[fbv] = 0;
+
+  ++stats[fbv].tx_irqs;
+  stats[fbv].tx_bytes += len;
+
+  // re-arm with the next span (if any)
+  FBV_UART_TxDMAStart(fbv);
+}
+#endif
+
+
+#if FBV_UART_RX_DMA
+/////////////////////////////////////////////////////////////////////////////
+// Interrupt handler for fbv UART Rx DMA (half transfer / transfer complete)
+// only taken during bursts which exceed half of the Rx buffer
+/////////////////////////////////////////////////////////////////////////////
+static void FBV_UART_RxDMAIRQHandler(u8 fbv)
+{
+  DMA_ClearITPendingBit(fbv_uart_hw[fbv].rx_dma_it_gl);
+
+  ++stats[fbv].rx_irqs;
+  FBV_UART_RxDMASync(fbv);
 }
+#endif
 
 
+/////////////////////////////////////////////////////////////////////////////
+// Interrupt vectors of the interfaces
+/////////////////////////////////////////////////////////////////////////////
+FBV_UART0_IRQHANDLER_FUNC { FBV_UART_IRQHandler(0); }
+#if FBV_UART_TX_DMA
+FBV_UART0_TX_DMA_IRQHANDLER_FUNC { FBV_UART_TxDMAIRQHandler(0); }
+#endif
+#if FBV_UART_RX_DMA
+FBV_UART0_RX_DMA_IRQHANDLER_FUNC { FBV_UART_RxDMAIRQHandler(0); }
+#endif
+
+#if FBV_UART_NUM >= 2
+FBV_UART1_IRQHANDLER_FUNC { FBV_UART_IRQHandler(1); } // no DMA
+#endif
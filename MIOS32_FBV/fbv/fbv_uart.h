@@ -12,17 +12,23 @@
 #if defined(MIOS32_BOARD_MBHP_CORE_STM32)
 
 
-// Tx buffer size (1..256)
+// number of FBV interfaces (1..2), each floorboard is connected to its own UART
+// 0 = USART2 (PA2/PA3), 1 = UART5 (PC12/PD2)
+#ifndef FBV_UART_NUM
+#define FBV_UART_NUM 1
+#endif
+
+// Tx buffer size of each interface (power of two: 2..32768)
 #ifndef FBV_UART_TX_BUFFER_SIZE
 #define FBV_UART_TX_BUFFER_SIZE 256
 #endif
 
-// Rx buffer size (1..256)
+// Rx buffer size of each interface (power of two: 2..32768)
 #ifndef FBV_UART_RX_BUFFER_SIZE
 #define FBV_UART_RX_BUFFER_SIZE 256
 #endif
 
-// Baudrate of UART first interface
+// Baudrate of the FBV interfaces
 #ifndef FBV_UART_BAUDRATE
 #define FBV_UART_BAUDRATE 31250
 #endif
@@ -32,6 +38,40 @@
 #define FBV_UART_TX_OD 0
 #endif
 
+// transmit via DMA (1) or via TXE interrupt (0)
+// only interface 0 has DMA channels, interface 1 (UART5) always uses the interrupt
+// with DMA contiguous spans of the Tx buffer are sent in one transfer, so that
+// only one interrupt per span is taken instead of one interrupt per byte
+#ifndef FBV_UART_TX_DMA
+#define FBV_UART_TX_DMA 0
+#endif
+
+// receive via circular DMA (1) or via RXNE interrupt (0)
+// only interface 0 has DMA channels, interface 1 (UART5) always uses the interrupt
+// with DMA the received bytes are written directly into the Rx buffer, the
+// idle-line interrupt marks the end of a FBV frame, so that only one interrupt
+// per frame is taken instead of one interrupt per byte
+// limits of the DMA mode: the DMA doesn't stop at unread bytes, it overwrites
+// them once it is FBV_UART_RX_BUFFER_SIZE bytes ahead (~80 mS at 31250 baud
+// for 256 bytes); FBV_UART_RxFrameRelease reports a held frame which has been
+// overwritten. The write position is taken over by the idle-line and half/
+// complete transfer interrupts, if they are blocked for more than the time of
+// FBV_UART_RX_BUFFER_SIZE/2 bytes, a complete lap of the DMA goes unnoticed.
+#ifndef FBV_UART_RX_DMA
+#define FBV_UART_RX_DMA 0
+#endif
+
+// maximum size of a packet built with FBV_UART_PacketAddFrame (one or more frames)
+#ifndef FBV_UART_PACKET_SIZE
+#define FBV_UART_PACKET_SIZE 32
+#endif
+
+// maximum size byte of a received frame (cmd + data), larger frames are dropped
+// must not exceed the data array of mios32_fbv_message_t + 1
+#ifndef FBV_UART_RX_FRAME_SIZE_MAX
+#define FBV_UART_RX_FRAME_SIZE_MAX 65
+#endif
+
 // Interface assignment: 0 = disabled, 1 = FBV, 2 = COM
 #ifndef FBV_UART_ASSIGNMENT
 #define FBV_UART_ASSIGNMENT 1
@@ -76,6 +116,21 @@
 
 #define FBV_ID_NONE				0xFF
 
+// FBV models, selected from the init frame by FBV_UART_ModelDetect or with FBV_UART_ModelSet
+#define FBV_MODEL_FULL			0 // FBV (long board), also used for unknown models
+#define FBV_MODEL_SHORTBOARD	1
+#define FBV_MODEL_EXPRESS		2
+#define FBV_MODEL_NUM			3
+
+// the model doesn't have a documented init frame payload, it is never detected
+#define FBV_MODEL_HANDSHAKE_NONE	0xffff
+
+#define FBV_CAP_TEXT_DISPLAY	0x01 // 16 character display
+#define FBV_CAP_CHANNEL_DISPLAY	0x02 // channel display, also used for the tuner
+
+#define FBV_PEDAL_W				0x01
+#define FBV_PEDAL_V				0x02
+
 
 
 /////////////////////////////////////////////////////////////////////////////
@@ -89,6 +144,48 @@ typedef struct {
     u8 pos;
 } mios32_fbv_message_t;
 
+// view of a received frame inside of the Rx buffer (see FBV_UART_RxFrameGet)
+typedef struct {
+    u16 pos;  // Rx buffer index of the first data byte
+    u8 fbv;   // interface which received the frame
+    u8 cmd;
+    u8 len;   // number of data bytes
+} fbv_uart_frame_t;
+
+typedef struct {
+    u8 len;
+    u8 buf[FBV_UART_PACKET_SIZE];
+} fbv_uart_packet_t;
+
+// capabilities of a FBV model
+typedef struct {
+    const char *name;
+    u16 handshake;        // first data byte of the init frame (0x90), FBV_MODEL_HANDSHAKE_NONE: not documented
+    u8 flags;             // FBV_CAP_*
+    u8 pedals;            // FBV_PEDAL_*
+    u8 num_switches;
+    const u8 *switches;   // ids of the present switches
+    u8 num_leds;
+    const u8 *leds;       // ids of the present LEDs
+} fbv_uart_model_t;
+
+typedef struct {
+    u32 tx_bytes;         // bytes handed over to the USART
+    u32 tx_irqs;          // Tx interrupts taken (TXE or DMA transfer complete)
+    u32 tx_dma_transfers; // DMA transfers started
+    u32 rx_bytes;         // bytes received from the USART
+    u32 rx_irqs;          // Rx interrupts taken (RXNE, idle-line or DMA half/complete)
+    u32 rx_frames;        // received frames (RXNE) or idle-line events which delivered new bytes (DMA)
+    u32 rx_overruns;      // bytes lost because the Rx buffer was full
+    u32 rx_frames_dropped; // received frames with invalid size, truncated by a new header or overwritten by the Rx DMA
+    u32 rx_bytes_skipped; // received bytes outside of a frame
+    u32 tx_overflows;     // non-blocking sends which have been rejected (Tx buffer full)
+    u32 tx_deferred;      // LED commands deferred from interrupt context
+    u32 tx_display_skipped; // display frames not sent because the text didn't change
+    u32 tx_caps_dropped;  // LED/display/tuner commands dropped because the model lacks the hardware
+    u32 tx_led_skipped;   // LED commands not sent because the LED already had this state
+} fbv_uart_stats_t;
+
 
 /////////////////////////////////////////////////////////////////////////////
 // Prototypes
@@ -96,27 +193,52 @@ typedef struct {
 
 extern s32 FBV_UART_Init(u32 mode);
 
-extern s32 FBV_UART_RxBufferFree(void);
-extern s32 FBV_UART_RxBufferUsed(void);
-extern s32 FBV_UART_RxBufferGet(void);
-extern s32 FBV_UART_RxBufferPeek(void);
-extern s32 FBV_UART_RxBufferPut(u8 b);
-extern s32 FBV_UART_TxBufferFree(void);
-extern s32 FBV_UART_TxBufferUsed(void);
-extern s32 FBV_UART_TxBufferGet(void);
-extern s32 FBV_UART_TxBufferPut_NonBlocking(u8 b);
-extern s32 FBV_UART_TxBufferPut(u8 b);
-extern s32 FBV_UART_TxBufferPutMore_NonBlocking(u8 *buffer, u16 len);
-extern s32 FBV_UART_TxBufferPutMore(u8 *buffer, u16 len);
-
-extern s32 FBV_UART_RxBufferReceiveMessage(mios32_fbv_message_t *msg);
-
-extern s32 FBV_UART_TxBufferSendInit(void);
-extern s32 FBV_UART_TxBufferSendLedCommand(u8 led, u8 status);
-extern s32 FBV_UART_TxBufferSendChannelCommand(u8 group, u8 nr, u8 ch);
-extern s32 FBV_UART_TxBufferSendDisplay(u8 *buf, u8 len);
-
-extern s32 FBV_UART_TxBufferSendTuner(u8 note, u8 flat);
+extern s32 FBV_UART_RxBufferFree(u8 fbv);
+extern s32 FBV_UART_RxBufferUsed(u8 fbv);
+extern s32 FBV_UART_RxBufferGet(u8 fbv);
+extern s32 FBV_UART_RxBufferPeek(u8 fbv);
+extern s32 FBV_UART_RxBufferPut(u8 fbv, u8 b);
+extern s32 FBV_UART_TxBufferFree(u8 fbv);
+extern s32 FBV_UART_TxBufferUsed(u8 fbv);
+extern s32 FBV_UART_TxBufferGet(u8 fbv);
+extern s32 FBV_UART_TxBufferPut_NonBlocking(u8 fbv, u8 b);
+extern s32 FBV_UART_TxBufferPut(u8 fbv, u8 b);
+extern s32 FBV_UART_TxBufferPutMore_NonBlocking(u8 fbv, u8 *buffer, u16 len);
+extern s32 FBV_UART_TxBufferPutMore(u8 fbv, u8 *buffer, u16 len);
+
+extern s32 FBV_UART_RxFrameCallback_Init(void (*callback_rx_frame)(u8 fbv));
+
+extern s32 FBV_UART_StatsGet(u8 fbv, fbv_uart_stats_t *stats);
+extern s32 FBV_UART_StatsClear(u8 fbv);
+extern s32 FBV_UART_TxIrqsSavedGet(u8 fbv);
+
+extern s32 FBV_UART_RxFrameGet(u8 fbv, fbv_uart_frame_t *frame);
+extern u8 FBV_UART_RxFrameData(const fbv_uart_frame_t *frame, u8 index);
+extern s32 FBV_UART_RxFrameRelease(const fbv_uart_frame_t *frame);
+extern s32 FBV_UART_RxBufferReceiveMessage(u8 fbv, mios32_fbv_message_t *msg);
+
+extern void FBV_UART_PacketClear(fbv_uart_packet_t *packet);
+extern s32 FBV_UART_PacketAddFrame(fbv_uart_packet_t *packet, u8 cmd, const u8 *data, u8 len);
+extern s32 FBV_UART_PacketSend_NonBlocking(u8 fbv, fbv_uart_packet_t *packet);
+extern s32 FBV_UART_PacketSend(u8 fbv, fbv_uart_packet_t *packet);
+
+extern s32 FBV_UART_TxBufferSendInit(u8 fbv);
+extern s32 FBV_UART_TxBufferSendLedCommand(u8 fbv, u8 led, u8 status);
+extern s32 FBV_UART_TxBufferSendLedCommand_NonBlocking(u8 fbv, u8 led, u8 status);
+extern s32 FBV_UART_TxBufferSendLedCommand_Deferred(u8 fbv, u8 led, u8 status);
+extern s32 FBV_UART_TxDeferredFlush(u8 fbv);
+extern s32 FBV_UART_LedInvalidate(u8 fbv);
+extern s32 FBV_UART_TxBufferSendChannelCommand(u8 fbv, u8 group, u8 nr, u8 ch);
+extern s32 FBV_UART_TxBufferSendDisplay(u8 fbv, u8 *buf, u8 len);
+extern s32 FBV_UART_DisplayInvalidate(u8 fbv);
+
+extern s32 FBV_UART_ModelDetect(u8 fbv, u8 handshake);
+extern s32 FBV_UART_ModelSet(u8 fbv, u8 model);
+extern const fbv_uart_model_t *FBV_UART_ModelGet(u8 fbv);
+extern s32 FBV_UART_LedPresent(u8 fbv, u8 led);
+extern s32 FBV_UART_SwitchPresent(u8 fbv, u8 id);
+
+extern s32 FBV_UART_TxBufferSendTuner(u8 fbv, u8 note, u8 flat);
 
 
 /////////////////////////////////////////////////////////////////////////////
@@ -0,0 +1,14 @@
+/*
+ * Host stand-in for FreeRTOS.h, only used by the test harness in this directory
+ */
+
+#ifndef _FREERTOS_H
+#define _FREERTOS_H
+
+typedef long portBASE_TYPE;
+typedef unsigned long portTickType;
+
+#define pdTRUE  1
+#define pdFALSE 0
+
+#endif /* _FREERTOS_H */
@@ -0,0 +1,113 @@
+/*
+ * Host stand-in for mios32.h, only used by the test harness in this directory
+ *
+ * Provides the MIOS32 types and just enough of the STM32 peripheral library
+ * to compile fbv_uart.c on a PC. The peripheral registers are plain structs,
+ * the library functions are empty (see stub.c).
+ */
+
+#ifndef _MIOS32_H
+#define _MIOS32_H
+
+#include <string.h>
+
+
+/////////////////////////////////////////////////////////////////////////////
+// Types
+/////////////////////////////////////////////////////////////////////////////
+
+typedef unsigned char u8;
+typedef unsigned short u16;
+typedef unsigned int u32;
+typedef signed char s8;
+typedef signed short s16;
+typedef signed int s32;
+
+#define MIOS32_BOARD_MBHP_CORE_STM32 1
+
+// the harness runs the producers and the consumer on several cores, so that
+// a compiler barrier isn't sufficient
+#define FBV_UART_BARRIER() __sync_synchronize()
+
+// the copies into the Tx buffer yield the CPU now and then, so that other
+// producers and the consumer get between a reservation and its commit even
+// on a single core host
+extern void *stub_memcpy(void *dst, const void *src, size_t len);
+#define memcpy(dst, src, len) stub_memcpy(dst, src, len)
+
+
+/////////////////////////////////////////////////////////////////////////////
+// Peripherals
+/////////////////////////////////////////////////////////////////////////////
+
+typedef struct { volatile u16 SR, r0, DR, r1, BRR, r2, CR1, r3, CR2, r4, CR3; } USART_TypeDef;
+typedef struct { volatile u32 CCR, CNDTR, CPAR, CMAR; } DMA_Channel_TypeDef;
+typedef struct { volatile u32 CRL; } GPIO_TypeDef;
+
+extern USART_TypeDef stub_USART2, stub_UART5;
+#define USART2 (&stub_USART2)
+#define UART5  (&stub_UART5)
+
+extern DMA_Channel_TypeDef stub_DMA1_Channel6, stub_DMA1_Channel7;
+#define DMA1_Channel6 (&stub_DMA1_Channel6)
+#define DMA1_Channel7 (&stub_DMA1_Channel7)
+
+extern GPIO_TypeDef stub_GPIOA, stub_GPIOC, stub_GPIOD;
+#define GPIOA (&stub_GPIOA)
+#define GPIOC (&stub_GPIOC)
+#define GPIOD (&stub_GPIOD)
+
+enum { DISABLE = 0, ENABLE = 1 };
+
+typedef struct { int GPIO_Pin, GPIO_Speed, GPIO_Mode; } GPIO_InitTypeDef;
+enum { GPIO_Pin_2, GPIO_Pin_3, GPIO_Pin_12 };
+enum { GPIO_Speed_2MHz };
+enum { GPIO_Mode_AF_OD, GPIO_Mode_AF_PP, GPIO_Mode_IN_FLOATING, GPIO_Mode_IPU };
+extern void GPIO_StructInit(GPIO_InitTypeDef *init);
+extern void GPIO_Init(GPIO_TypeDef *gpio, GPIO_InitTypeDef *init);
+
+enum { RCC_APB1Periph_USART2, RCC_APB1Periph_UART5, RCC_AHBPeriph_DMA1 };
+extern void RCC_APB1PeriphClockCmd(int periph, int state);
+extern void RCC_AHBPeriphClockCmd(int periph, int state);
+
+typedef struct { int USART_BaudRate, USART_WordLength, USART_StopBits, USART_Parity, USART_HardwareFlowControl, USART_Mode; } USART_InitTypeDef;
+enum { USART_WordLength_8b, USART_StopBits_1, USART_Parity_No, USART_HardwareFlowControl_None };
+enum { USART_Mode_Rx = 4, USART_Mode_Tx = 8 };
+enum { USART_IT_IDLE, USART_IT_RXNE, USART_IT_TXE, USART_DMAReq_Tx, USART_DMAReq_Rx };
+extern void USART_Init(USART_TypeDef *usart, USART_InitTypeDef *init);
+extern void USART_DeInit(USART_TypeDef *usart);
+extern void USART_ITConfig(USART_TypeDef *usart, int it, int state);
+extern void USART_Cmd(USART_TypeDef *usart, int state);
+extern void USART_DMACmd(USART_TypeDef *usart, int req, int state);
+
+typedef struct { int NVIC_IRQChannel, NVIC_IRQChannelPreemptionPriority, NVIC_IRQChannelSubPriority, NVIC_IRQChannelCmd; } NVIC_InitTypeDef;
+enum { USART2_IRQn, UART5_IRQn, DMA1_Channel6_IRQn, DMA1_Channel7_IRQn };
+enum { MIOS32_IRQ_UART_PRIORITY = 8 };
+extern void NVIC_Init(NVIC_InitTypeDef *init);
+
+typedef struct {
+  u32 DMA_PeripheralBaseAddr, DMA_MemoryBaseAddr;
+  int DMA_DIR, DMA_BufferSize, DMA_PeripheralInc, DMA_MemoryInc, DMA_PeripheralDataSize, DMA_MemoryDataSize, DMA_Mode, DMA_Priority, DMA_M2M;
+} DMA_InitTypeDef;
+enum { DMA_DIR_PeripheralDST, DMA_DIR_PeripheralSRC, DMA_PeripheralInc_Disable, DMA_MemoryInc_Enable };
+enum { DMA_PeripheralDataSize_Byte, DMA_MemoryDataSize_Byte, DMA_Mode_Normal, DMA_Mode_Circular };
+enum { DMA_Priority_Medium, DMA_Priority_High, DMA_M2M_Disable };
+enum { DMA_IT_TC = 1, DMA_IT_HT = 2 };
+enum { DMA1_IT_GL6, DMA1_IT_GL7 };
+extern void DMA_DeInit(DMA_Channel_TypeDef *channel);
+extern void DMA_Init(DMA_Channel_TypeDef *channel, DMA_InitTypeDef *init);
+extern void DMA_ITConfig(DMA_Channel_TypeDef *channel, int it, int state);
+extern void DMA_Cmd(DMA_Channel_TypeDef *channel, int state);
+extern void DMA_ClearITPendingBit(int it);
+
+
+/////////////////////////////////////////////////////////////////////////////
+// MIOS32 functions
+/////////////////////////////////////////////////////////////////////////////
+
+extern s32 MIOS32_IRQ_Disable(void);
+extern s32 MIOS32_IRQ_Enable(void);
+
+extern s32 MIOS32_MIDI_SendDebugMessage(const char *format, ...);
+
+#endif /* _MIOS32_H */
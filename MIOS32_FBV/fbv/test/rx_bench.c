@@ -0,0 +1,203 @@
+/*
+ * Host test and benchmark of the FBV Rx path
+ *
+ * Built twice by the Makefile: with FBV_UART_RX_DMA=0 the bytes are fed into
+ * the RXNE interrupt one by one, with FBV_UART_RX_DMA=1 they are written into
+ * the Rx buffer like the circular DMA does (half/complete transfer interrupts
+ * at the buffer halves, an idle-line interrupt after each frame).
+ *
+ *   1. stream: every frame is taken by the consumer right after it has been
+ *      received, interrupts and host time per frame are reported
+ *   2. burst: the consumer is late by less than the Rx buffer, no frame may
+ *      be lost
+ *   3. held frame: more than the Rx buffer is received while a frame is held
+ *      with FBV_UART_RxFrameGet; with DMA the frame is overwritten and
+ *      FBV_UART_RxFrameRelease has to report it, with RXNE the frame has to
+ *      stay intact and the rejected bytes are counted as overruns
+ *   4. second interface (FBV_UART_NUM=2, the DMA variant is built with it):
+ *      UART5 has no DMA, its frames are received via RXNE interrupt while
+ *      interface 0 keeps its mode
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <time.h>
+
+#include <mios32.h>
+
+#include "fbv_uart.h"
+
+
+extern void USART2_IRQHandler(void);
+extern void UART5_IRQHandler(void);
+extern void DMA1_Channel6_IRQHandler(void);
+
+#define STREAM_FRAMES 100000
+#define FRAME_BYTES 5 // F0 03 81 <id> <state>
+
+static unsigned errors;
+
+#define CHECK(cond, ...) do { if( !(cond) ) { ++errors; printf("ERROR: " __VA_ARGS__); printf("\n"); } } while(0)
+
+
+/////////////////////////////////////////////////////////////////////////////
+// receives a byte like the USART (and the DMA) would
+/////////////////////////////////////////////////////////////////////////////
+static void hw_byte(u8 b)
+{
+#if FBV_UART_RX_DMA
+  DMA_Channel_TypeDef *dma = DMA1_Channel6;
+  u8 *buffer = (u8 *)(uintptr_t)dma->CMAR;
+
+  buffer[FBV_UART_RX_BUFFER_SIZE - dma->CNDTR] = b;
+  dma->CNDTR = (dma->CNDTR > 1) ? (dma->CNDTR - 1) : FBV_UART_RX_BUFFER_SIZE;
+
+  // half transfer and transfer complete interrupts
+  if( dma->CNDTR == FBV_UART_RX_BUFFER_SIZE || dma->CNDTR == FBV_UART_RX_BUFFER_SIZE/2 )
+    DMA1_Channel6_IRQHandler();
+#else
+  USART2->SR = (1 << 5); // RXNE
+  USART2->DR = b;
+  USART2_IRQHandler();
+  USART2->SR = 0;
+#endif
+}
+
+
+/////////////////////////////////////////////////////////////////////////////
+// the line becomes idle after a frame
+/////////////////////////////////////////////////////////////////////////////
+static void hw_idle(void)
+{
+#if FBV_UART_RX_DMA
+  USART2->SR = (1 << 4); // IDLE
+  USART2_IRQHandler();
+  USART2->SR = 0;
+#endif
+}
+
+
+/////////////////////////////////////////////////////////////////////////////
+// receives button frame n
+/////////////////////////////////////////////////////////////////////////////
+static void hw_frame(unsigned n)
+{
+  hw_byte(0xf0);
+  hw_byte(0x03);
+  hw_byte(0x81);
+  hw_byte(n & 0x7f);
+  hw_byte((n >> 7) & 0x01);
+  hw_idle();
+}
+
+
+/////////////////////////////////////////////////////////////////////////////
+// takes the next frame, returns 1 if it is button frame n
+/////////////////////////////////////////////////////////////////////////////
+static int take_frame(u8 fbv, unsigned n)
+{
+  fbv_uart_frame_t frame;
+
+  if( FBV_UART_RxFrameGet(fbv, &frame) <= 0 )
+    return 0;
+
+  u8 ok = frame.cmd == 0x81 && frame.len == 2 &&
+    FBV_UART_RxFrameData(&frame, 0) == (n & 0x7f) &&
+    FBV_UART_RxFrameData(&frame, 1) == ((n >> 7) & 0x01);
+
+  return (FBV_UART_RxFrameRelease(&frame) == 0) && ok;
+}
+
+
+/////////////////////////////////////////////////////////////////////////////
+// monotonic host time in nS
+/////////////////////////////////////////////////////////////////////////////
+static double now_ns(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+
+int main(void)
+{
+  fbv_uart_stats_t stats;
+  fbv_uart_frame_t frame;
+  unsigned n;
+
+  printf("Rx test (%s), Rx buffer %d bytes\n", FBV_UART_RX_DMA ? "circular DMA" : "RXNE interrupt", FBV_UART_RX_BUFFER_SIZE);
+
+  // 1. stream
+  FBV_UART_Init(0);
+  double start = now_ns();
+  unsigned taken = 0;
+  for(n=0; n<STREAM_FRAMES; ++n) {
+    hw_frame(n);
+    taken += take_frame(0, n);
+  }
+  double ns = (now_ns() - start) / STREAM_FRAMES;
+
+  FBV_UART_StatsGet(0, &stats);
+  CHECK(taken == STREAM_FRAMES, "stream: %u of %u frames taken", taken, STREAM_FRAMES);
+  CHECK(stats.rx_bytes == STREAM_FRAMES * FRAME_BYTES, "stream: %u bytes received", stats.rx_bytes);
+  printf("stream: %u frames of %d bytes, %.2f interrupts/frame, %.0f ns/frame (host)\n",
+         STREAM_FRAMES, FRAME_BYTES, (double)stats.rx_irqs / STREAM_FRAMES, ns);
+
+  // 2. burst which fits into the Rx buffer
+  FBV_UART_Init(0);
+  unsigned burst = FBV_UART_RX_BUFFER_SIZE / FRAME_BYTES;
+  for(n=0; n<burst; ++n)
+    hw_frame(n);
+  for(taken=0, n=0; n<burst; ++n)
+    taken += take_frame(0, n);
+
+  FBV_UART_StatsGet(0, &stats);
+  CHECK(taken == burst && stats.rx_overruns == 0, "burst: %u of %u frames taken, %u overruns", taken, burst, stats.rx_overruns);
+  printf("burst: %u frames, %u taken, %u overruns, %u interrupts\n", burst, taken, stats.rx_overruns, stats.rx_irqs);
+
+  // 3. a held frame is overtaken by more than the Rx buffer
+  FBV_UART_Init(0);
+  hw_frame(0x55);
+  CHECK(FBV_UART_RxFrameGet(0, &frame) > 0, "held: no frame");
+  for(n=0; n<2*burst; ++n)
+    hw_frame(n);
+  s32 status = FBV_UART_RxFrameRelease(&frame);
+
+  FBV_UART_StatsGet(0, &stats);
+  u32 lost = (1 + 2*burst) * FRAME_BYTES - FBV_UART_RX_BUFFER_SIZE;
+  CHECK(stats.rx_overruns == lost, "held: %u overruns instead of %u", stats.rx_overruns, lost);
+#if FBV_UART_RX_DMA
+  CHECK(status < 0, "held: overwritten frame not reported");
+  CHECK(stats.rx_frames_dropped == 1, "held: %u frames dropped", stats.rx_frames_dropped);
+#else
+  CHECK(status == 0, "held: frame reported as overwritten");
+#endif
+  printf("held: release %s, %u overruns, %u frames dropped\n", status < 0 ? "failed" : "ok", stats.rx_overruns, stats.rx_frames_dropped);
+
+#if FBV_UART_NUM >= 2
+  // 4. second interface, always RXNE
+  FBV_UART_Init(0);
+  for(taken=0, n=0; n<burst; ++n) {
+    u8 frame_bytes[FRAME_BYTES] = { 0xf0, 0x03, 0x81, n & 0x7f, (n >> 7) & 0x01 };
+    int i;
+    for(i=0; i<FRAME_BYTES; ++i) {
+      UART5->SR = (1 << 5); // RXNE
+      UART5->DR = frame_bytes[i];
+      UART5_IRQHandler();
+      UART5->SR = 0;
+    }
+    taken += take_frame(1, n);
+  }
+
+  FBV_UART_StatsGet(1, &stats);
+  CHECK(taken == burst && stats.rx_irqs == burst * FRAME_BYTES && stats.rx_frames == burst,
+        "interface 1: %u of %u frames taken, %u interrupts, %u frames", taken, burst, stats.rx_irqs, stats.rx_frames);
+  CHECK(FBV_UART_RxBufferPut(1, 0xf0) == 0, "interface 1: Rx buffer not written by the USART interrupt");
+  printf("interface 1 (RXNE): %u frames, %u taken, %u interrupts\n", burst, taken, stats.rx_irqs);
+#endif
+
+  printf("%s\n", errors ? "FAILED" : "PASSED");
+  return errors ? 1 : 0;
+}
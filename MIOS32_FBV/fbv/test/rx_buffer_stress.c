@@ -0,0 +1,188 @@
+/*
+ * Host stress test of the lock-free FBV Rx buffer
+ *
+ * A producer thread puts frames into the Rx buffer of interface 0 with
+ * FBV_UART_RxBufferPut like the RXNE interrupt does (retried while the buffer
+ * is full), while a consumer thread takes them alternately with
+ * FBV_UART_RxFrameGet/FBV_UART_RxFrameRelease and byte by byte with
+ * FBV_UART_RxBufferPeek/FBV_UART_RxBufferGet.
+ *
+ * Each frame carries a sequence number (F0 04 81 <seq[6:0]> <seq[13:7]>
+ * <seq[20:14]>). The consumer checks that the frames arrive complete and in
+ * order, so that a lost, duplicated or overwritten byte fails the test.
+ *
+ * Usage: rx_buffer_stress [<frames>]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <sched.h>
+
+#include <mios32.h>
+
+#include "fbv_uart.h"
+
+
+#define FRAME_BYTES 6
+
+static unsigned frames = 200000;
+static volatile int producer_done;
+
+static unsigned long long full_retries;
+
+
+/////////////////////////////////////////////////////////////////////////////
+// producer: receives the frames like the RXNE interrupt
+/////////////////////////////////////////////////////////////////////////////
+static void *producer(void *arg)
+{
+  unsigned seq;
+  int i;
+
+  for(seq=0; seq<frames; ++seq) {
+    u8 frame[FRAME_BYTES] = { 0xf0, 0x04, 0x81, seq & 0x7f, (seq >> 7) & 0x7f, (seq >> 14) & 0x7f };
+
+    for(i=0; i<FRAME_BYTES; ++i) {
+      while( FBV_UART_RxBufferPut(0, frame[i]) < 0 ) {
+        ++full_retries;
+        sched_yield();
+      }
+    }
+  }
+
+  producer_done = 1;
+  return NULL;
+}
+
+
+/////////////////////////////////////////////////////////////////////////////
+// consumer: takes the frames and checks the sequence numbers
+/////////////////////////////////////////////////////////////////////////////
+static unsigned frames_received;
+static unsigned errors;
+
+#define ERROR(...) do { if( errors++ < 10 ) { printf("ERROR: " __VA_ARGS__); printf("\n"); } } while(0)
+
+// returns 0 once the producer has finished and the buffer is empty
+static int wait_data(void)
+{
+  while( FBV_UART_RxBufferUsed(0) == 0 ) {
+    if( producer_done && FBV_UART_RxBufferUsed(0) == 0 )
+      return 0;
+    sched_yield();
+  }
+
+  return 1;
+}
+
+// takes a frame with FBV_UART_RxFrameGet, returns -1 if none will arrive
+static s32 take_frame(void)
+{
+  fbv_uart_frame_t frame;
+
+  while( FBV_UART_RxFrameGet(0, &frame) <= 0 ) {
+    if( producer_done && FBV_UART_RxFrameGet(0, &frame) <= 0 )
+      return -1;
+    sched_yield();
+  }
+
+  s32 seq = -2;
+  if( frame.cmd == 0x81 && frame.len == 3 )
+    seq = FBV_UART_RxFrameData(&frame, 0) | (FBV_UART_RxFrameData(&frame, 1) << 7) | (FBV_UART_RxFrameData(&frame, 2) << 14);
+
+  if( FBV_UART_RxFrameRelease(&frame) < 0 )
+    seq = -2;
+
+  return seq;
+}
+
+// takes a frame byte by byte, each byte is peeked before, returns -1 if none will arrive
+static s32 take_bytes(void)
+{
+  u8 frame[FRAME_BYTES];
+  int i;
+
+  for(i=0; i<FRAME_BYTES; ++i) {
+    if( !wait_data() )
+      return -1;
+
+    s32 peeked = FBV_UART_RxBufferPeek(0);
+    s32 b = FBV_UART_RxBufferGet(0);
+    if( b < 0 || b != peeked ) {
+      ERROR("frame %u: byte %d peeked as %d, taken as %d", frames_received, i, (int)peeked, (int)b);
+      return -2;
+    }
+    frame[i] = (u8)b;
+  }
+
+  if( frame[0] != 0xf0 || frame[1] != 0x04 || frame[2] != 0x81 )
+    return -2;
+
+  return frame[3] | (frame[4] << 7) | (frame[5] << 14);
+}
+
+static void *consumer(void *arg)
+{
+  unsigned next_seq = 0;
+
+  while( next_seq < frames ) {
+    s32 seq = (next_seq & 1) ? take_bytes() : take_frame();
+
+    if( seq == -1 )
+      break;
+
+    ++frames_received;
+    if( seq != (s32)next_seq ) {
+      ERROR("frame %u received as %d after %u frames", next_seq, (int)seq, frames_received);
+      if( seq < 0 )
+        break; // the stream is out of sync from now on
+      next_seq = seq;
+    }
+    ++next_seq;
+  }
+
+  if( next_seq != frames )
+    ERROR("%u of %u frames received", next_seq, frames);
+
+  return NULL;
+}
+
+
+int main(int argc, char **argv)
+{
+  pthread_t threads[2];
+
+  if( argc > 1 )
+    frames = strtoul(argv[1], NULL, 0);
+  if( frames < 1 || frames > 0x1fffff ) {
+    printf("usage: %s [<frames 1..%u>]\n", argv[0], 0x1fffff);
+    return 2;
+  }
+
+  printf("Rx buffer stress test: %u frames, Rx buffer %d bytes\n", frames, FBV_UART_RX_BUFFER_SIZE);
+
+  FBV_UART_Init(0);
+  pthread_create(&threads[1], NULL, consumer, NULL);
+  pthread_create(&threads[0], NULL, producer, NULL);
+  pthread_join(threads[0], NULL);
+  pthread_join(threads[1], NULL);
+
+  fbv_uart_stats_t stats;
+  FBV_UART_StatsGet(0, &stats);
+
+  printf("received %u frames, %llu retries on a full buffer, %u frames dropped, %u bytes skipped\n",
+         frames_received, full_retries, stats.rx_frames_dropped, stats.rx_bytes_skipped);
+
+  if( stats.rx_frames_dropped || stats.rx_bytes_skipped ) {
+    ++errors;
+    printf("ERROR: the frame parser lost the frame boundaries\n");
+  }
+  if( FBV_UART_RxBufferUsed(0) != 0 ) {
+    ++errors;
+    printf("ERROR: %d bytes left in the Rx buffer\n", (int)FBV_UART_RxBufferUsed(0));
+  }
+
+  printf("%s\n", errors ? "FAILED" : "PASSED");
+  return errors ? 1 : 0;
+}
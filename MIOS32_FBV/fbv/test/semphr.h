@@ -0,0 +1,16 @@
+/*
+ * Host stand-in for semphr.h, only used by the test harness in this directory
+ *
+ * The recursive mutexes are pthread mutexes (see stub.c).
+ */
+
+#ifndef _SEMPHR_H
+#define _SEMPHR_H
+
+typedef void *xSemaphoreHandle;
+
+extern xSemaphoreHandle xSemaphoreCreateRecursiveMutex(void);
+extern portBASE_TYPE xSemaphoreTakeRecursive(xSemaphoreHandle mutex, portTickType ticks);
+extern portBASE_TYPE xSemaphoreGiveRecursive(xSemaphoreHandle mutex);
+
+#endif /* _SEMPHR_H */
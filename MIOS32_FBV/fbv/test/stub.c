@@ -0,0 +1,139 @@
+/*
+ * Host stand-ins for the MIOS32 and STM32 library functions used by fbv_uart.c
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <pthread.h>
+#include <sched.h>
+
+#include <mios32.h>
+#include <FreeRTOS.h>
+#include <semphr.h>
+
+
+/////////////////////////////////////////////////////////////////////////////
+// Peripherals (registers are only written, the functions do nothing except
+// of DMA_Init, which sets the memory address and the transfer count)
+/////////////////////////////////////////////////////////////////////////////
+
+USART_TypeDef stub_USART2, stub_UART5;
+DMA_Channel_TypeDef stub_DMA1_Channel6, stub_DMA1_Channel7;
+GPIO_TypeDef stub_GPIOA, stub_GPIOC, stub_GPIOD;
+
+void GPIO_StructInit(GPIO_InitTypeDef *init) {}
+void GPIO_Init(GPIO_TypeDef *gpio, GPIO_InitTypeDef *init) {}
+void RCC_APB1PeriphClockCmd(int periph, int state) {}
+void RCC_AHBPeriphClockCmd(int periph, int state) {}
+void USART_Init(USART_TypeDef *usart, USART_InitTypeDef *init) {}
+void USART_DeInit(USART_TypeDef *usart) {}
+void USART_ITConfig(USART_TypeDef *usart, int it, int state) {}
+void USART_Cmd(USART_TypeDef *usart, int state) {}
+void USART_DMACmd(USART_TypeDef *usart, int req, int state) {}
+void NVIC_Init(NVIC_InitTypeDef *init) {}
+void DMA_DeInit(DMA_Channel_TypeDef *channel) {}
+void DMA_ITConfig(DMA_Channel_TypeDef *channel, int it, int state) {}
+void DMA_Cmd(DMA_Channel_TypeDef *channel, int state) {}
+void DMA_ClearITPendingBit(int it) {}
+
+void DMA_Init(DMA_Channel_TypeDef *channel, DMA_InitTypeDef *init)
+{
+  channel->CMAR = init->DMA_MemoryBaseAddr;
+  channel->CNDTR = init->DMA_BufferSize;
+}
+
+
+/////////////////////////////////////////////////////////////////////////////
+// memcpy which yields before every 4th copy (see mios32.h)
+/////////////////////////////////////////////////////////////////////////////
+
+void *stub_memcpy(void *dst, const void *src, size_t len)
+{
+  static __thread unsigned count;
+
+  if( (++count & 3) == 0 )
+    sched_yield();
+
+  return (memcpy)(dst, src, len);
+}
+
+
+/////////////////////////////////////////////////////////////////////////////
+// the critical sections of all threads are serialized by one (nestable) lock
+/////////////////////////////////////////////////////////////////////////////
+
+static pthread_mutex_t irq_lock;
+static pthread_once_t irq_lock_once = PTHREAD_ONCE_INIT;
+
+static void irq_lock_init(void)
+{
+  pthread_mutexattr_t attr;
+
+  pthread_mutexattr_init(&attr);
+  pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+  pthread_mutex_init(&irq_lock, &attr);
+  pthread_mutexattr_destroy(&attr);
+}
+
+s32 MIOS32_IRQ_Disable(void)
+{
+  pthread_once(&irq_lock_once, irq_lock_init);
+  pthread_mutex_lock(&irq_lock);
+  return 0;
+}
+
+s32 MIOS32_IRQ_Enable(void)
+{
+  pthread_mutex_unlock(&irq_lock);
+  return 0;
+}
+
+
+/////////////////////////////////////////////////////////////////////////////
+// recursive FreeRTOS mutexes; a take which would block fails after a yield,
+// like a take with a timeout of one tick
+/////////////////////////////////////////////////////////////////////////////
+
+xSemaphoreHandle xSemaphoreCreateRecursiveMutex(void)
+{
+  pthread_mutex_t *mutex = malloc(sizeof(pthread_mutex_t));
+  pthread_mutexattr_t attr;
+
+  pthread_mutexattr_init(&attr);
+  pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+  pthread_mutex_init(mutex, &attr);
+  pthread_mutexattr_destroy(&attr);
+
+  return mutex;
+}
+
+portBASE_TYPE xSemaphoreTakeRecursive(xSemaphoreHandle mutex, portTickType ticks)
+{
+  if( pthread_mutex_trylock(mutex) == 0 )
+    return pdTRUE;
+
+  sched_yield();
+  return pdFALSE;
+}
+
+portBASE_TYPE xSemaphoreGiveRecursive(xSemaphoreHandle mutex)
+{
+  return (pthread_mutex_unlock(mutex) == 0) ? pdTRUE : pdFALSE;
+}
+
+
+/////////////////////////////////////////////////////////////////////////////
+// debug messages are printed on stdout
+/////////////////////////////////////////////////////////////////////////////
+
+s32 MIOS32_MIDI_SendDebugMessage(const char *format, ...)
+{
+  va_list args;
+
+  va_start(args, format);
+  vprintf(format, args);
+  va_end(args);
+
+  return 0;
+}
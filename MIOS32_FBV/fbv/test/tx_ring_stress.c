@@ -0,0 +1,198 @@
+/*
+ * Host stress test of the lock-free FBV Tx ring
+ *
+ * Several producer threads put packets onto the Tx buffer of interface 0
+ * with FBV_UART_TxBufferPutMore (blocking) and FBV_UART_TxBufferPutMore_NonBlocking
+ * (retried on overflow), while a consumer thread drains it with
+ * FBV_UART_TxBufferGet like the TXE interrupt does.
+ *
+ * Each packet carries its length, the producer number and a sequence number,
+ * followed by a payload derived from both. The consumer checks that the
+ * packets of each producer arrive complete, unmixed and in order, so that a
+ * lost, duplicated or overwritten byte fails the test.
+ *
+ * Usage: tx_ring_stress [<producers> [<packets per producer>]]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <sched.h>
+
+#include <mios32.h>
+
+#include "fbv_uart.h"
+
+
+#define PRODUCERS_MAX 16
+#define PACKET_MIN 5
+#define PACKET_MAX 24
+
+static int producers = 4;
+static unsigned packets = 5000;
+static volatile int producers_done;
+
+static unsigned long long bytes_sent[PRODUCERS_MAX];
+static unsigned long long overflows[PRODUCERS_MAX];
+
+
+/////////////////////////////////////////////////////////////////////////////
+// payload byte of a packet
+/////////////////////////////////////////////////////////////////////////////
+static u8 payload(int id, unsigned seq, int i)
+{
+  return (u8)(id * 31 + seq * 7 + i * 13);
+}
+
+
+/////////////////////////////////////////////////////////////////////////////
+// producer: even threads use the blocking, odd threads the non-blocking put
+/////////////////////////////////////////////////////////////////////////////
+static void *producer(void *arg)
+{
+  int id = (int)(long)arg;
+  unsigned seed = id + 1;
+  u8 packet[PACKET_MAX];
+  unsigned seq;
+  int i;
+
+  for(seq=0; seq<packets; ++seq) {
+    int len = PACKET_MIN + rand_r(&seed) % (PACKET_MAX - PACKET_MIN + 1);
+
+    packet[0] = len;
+    packet[1] = id;
+    packet[2] = (u8)seq;
+    packet[3] = (u8)(seq >> 8);
+    packet[4] = (u8)(seq >> 16);
+    for(i=PACKET_MIN; i<len; ++i)
+      packet[i] = payload(id, seq, i);
+
+    if( id & 1 ) {
+      while( FBV_UART_TxBufferPutMore_NonBlocking(0, packet, len) < 0 ) {
+        ++overflows[id];
+        sched_yield();
+      }
+    } else {
+      FBV_UART_TxBufferPutMore(0, packet, len);
+    }
+
+    bytes_sent[id] += len;
+  }
+
+  __sync_fetch_and_add(&producers_done, 1);
+  return NULL;
+}
+
+
+/////////////////////////////////////////////////////////////////////////////
+// consumer: takes the bytes one by one and checks the packets
+/////////////////////////////////////////////////////////////////////////////
+static unsigned long long bytes_received;
+static unsigned errors;
+
+static void *consumer(void *arg)
+{
+  unsigned next_seq[PRODUCERS_MAX] = { 0 };
+  u8 packet[PACKET_MAX];
+  int pos = 0;
+
+  for(;;) {
+    s32 b = FBV_UART_TxBufferGet(0);
+
+    if( b < 0 ) {
+      if( producers_done == producers && FBV_UART_TxBufferUsed(0) == 0 )
+        break;
+      sched_yield();
+      continue;
+    }
+
+    ++bytes_received;
+    packet[pos++] = (u8)b;
+
+    if( pos == 1 && (b < PACKET_MIN || b > PACKET_MAX) ) {
+      if( errors++ < 10 )
+        printf("ERROR: invalid packet length %d after %llu bytes\n", (int)b, bytes_received);
+      pos = 0; // the stream is out of sync from now on
+      continue;
+    }
+
+    if( pos < PACKET_MIN || pos < packet[0] )
+      continue;
+
+    int id = packet[1];
+    unsigned seq = packet[2] | (packet[3] << 8) | (packet[4] << 16);
+    int i, ok = id < producers && seq == next_seq[id];
+    for(i=PACKET_MIN; ok && i<packet[0]; ++i)
+      ok = packet[i] == payload(id, seq, i);
+
+    if( !ok ) {
+      if( errors++ < 10 )
+        printf("ERROR: producer %d packet %u (expected %u) corrupted after %llu bytes\n",
+               id, seq, (id < producers) ? next_seq[id] : 0, bytes_received);
+      if( id < producers )
+        next_seq[id] = seq + 1;
+    } else {
+      ++next_seq[id];
+    }
+    pos = 0;
+  }
+
+  int id;
+  for(id=0; id<producers; ++id) {
+    if( next_seq[id] != packets ) {
+      ++errors;
+      printf("ERROR: producer %d: %u of %u packets received\n", id, next_seq[id], packets);
+    }
+  }
+
+  return NULL;
+}
+
+
+int main(int argc, char **argv)
+{
+  pthread_t threads[PRODUCERS_MAX + 1];
+  unsigned long long sent = 0, overflow = 0;
+  int i;
+
+  if( argc > 1 )
+    producers = atoi(argv[1]);
+  if( argc > 2 )
+    packets = strtoul(argv[2], NULL, 0);
+  if( producers < 1 || producers > PRODUCERS_MAX || packets < 1 || packets > 0xffffff ) {
+    printf("usage: %s [<producers 1..%d> [<packets per producer>]]\n", argv[0], PRODUCERS_MAX);
+    return 2;
+  }
+
+  printf("Tx ring stress test: %d producers, %u packets each, Tx buffer %d bytes\n",
+         producers, packets, FBV_UART_TX_BUFFER_SIZE);
+
+  pthread_create(&threads[producers], NULL, consumer, NULL);
+  for(i=0; i<producers; ++i)
+    pthread_create(&threads[i], NULL, producer, (void *)(long)i);
+  for(i=0; i<=producers; ++i)
+    pthread_join(threads[i], NULL);
+
+  for(i=0; i<producers; ++i) {
+    sent += bytes_sent[i];
+    overflow += overflows[i];
+  }
+
+  fbv_uart_stats_t stats;
+  FBV_UART_StatsGet(0, &stats);
+
+  printf("sent %llu bytes, received %llu bytes, %llu non-blocking retries (tx_overflows: %u)\n",
+         sent, bytes_received, overflow, stats.tx_overflows);
+
+  if( bytes_received != sent ) {
+    ++errors;
+    printf("ERROR: %lld bytes lost\n", (long long)(sent - bytes_received));
+  }
+  if( stats.tx_overflows != (u32)overflow ) {
+    ++errors;
+    printf("ERROR: tx_overflows doesn't match the rejected requests\n");
+  }
+
+  printf("%s\n", errors ? "FAILED" : "PASSED");
+  return errors ? 1 : 0;
+}
@@ -16,6 +16,8 @@
 /////////////////////////////////////////////////////////////////////////////
 
 #include <mios32.h>
+#include <string.h>
+#include <stdlib.h>
 
 #include "app.h"
 #include "axefx_info.h"
@@ -47,28 +49,164 @@
 /////////////////////////////////////////////////////////////////////////////
 // AxeFX SysEx stuff
 /////////////////////////////////////////////////////////////////////////////
-#define SYSEX_HEADER          0
-#define SYSEX_CMD_STATE_BEGIN 1
-#define SYSEX_CMD_STATE_CONT  2
-#define SYSEX_CMD_STATE_END   3
+// a message is F0 00 00 7D <model> <command> <data...> F7
+#define SYSEX_HEADER          0 // matching the manufacturer ID (sysex_count bytes matched)
+#define SYSEX_MODEL           1 // waiting for the model
+#define SYSEX_CMD             2 // waiting for the command
+#define SYSEX_DATA            3 // receiving the data of a known command
+#define SYSEX_SKIP            4 // ignoring the message until the next F0
 #define SYSEX_MAX_LEN		  256
+#define SYSEX_RECORD_LEN      5 // size of sysex_record
+#define SYSEX_BLOCK_RECORD_LEN 5 // block status result: id (2), cc (2), status (1)
+#define SYSEX_LEN_ANY         0xffff
+#define SYSEX_CMD_NUM         0x20 // commands 0x00..0x1f can be handled
+
+#define AXEFX_MODEL_STANDARD  0x00
+#define AXEFX_MODEL_ULTRA     0x01
+#define AXEFX_MODEL_NUM       2
 
 static u8 sysex_state = SYSEX_HEADER;
-static u8 sysex_count = 0;
+static u16 sysex_count = 0; // number of received data bytes, saturates at SYSEX_LEN_ANY
 static u8 sysex_axefx_type = 0;
 static u8 sysex_cmd;
 
+// data of short commands and the current record of streamed commands,
+// these commands never touch sysex_buffer
+static u8 sysex_record[SYSEX_RECORD_LEN];
+static u8 sysex_record_pos = 0;
 
-const u8 sysex_header[5] = { 0xf0, 0x00, 0x00, 0x7d, 0x01 };
+const u8 sysex_header[4] = { 0xf0, 0x00, 0x00, 0x7d };
 u8 sysex_buffer[SYSEX_MAX_LEN];
 
 
+/////////////////////////////////////////////////////////////////////////////
+// AxeFX request tracker
+/////////////////////////////////////////////////////////////////////////////
+// Only one request of each kind is in flight. A request for a kind which is
+// already in flight is queued and sent after the reply (or the timeout), a
+// queued request is replaced by a newer one, so that stomping through the
+// presets doesn't pile up requests. Requests are tagged with axefx_req_seq,
+// which is incremented by each program change: replies to requests of a
+// previous preset are stale and ignored. In addition each request is tagged
+// with the state_seq of its kind, which is incremented when the state is
+// changed locally (AxeFX_RequestInvalidate): a reply to a request sent before
+// e.g. a block has been toggled doesn't contain the toggle and is ignored.
+#define AXEFX_REQ_VERSION     0
+#define AXEFX_REQ_BLOCKS      1
+#define AXEFX_REQ_PATCH_NAME  2
+#define AXEFX_REQ_NUM         3
+
+#define AXEFX_REQ_TIMEOUT_MS  500 // the block status result alone takes ~120 mS
+#define AXEFX_REQ_RETRIES     2
+#define AXEFX_REQ_POLL_MS     10  // timeout check interval of TASK_FBV_Check
+#define AXEFX_REQ_RTT_BUCKETS 8   // <8, <16, <32, <64, <128, <256, <512, >=512 mS
+
+typedef struct {
+  const char *name;
+  const u8 *sysex;
+  const u32 *len;
+  u8 per_preset; // the reply depends on the selected preset
+} axefx_req_info_t;
+
+static const axefx_req_info_t axefx_req_info[AXEFX_REQ_NUM] = {
+  [AXEFX_REQ_VERSION]    = { "version",    axefx_request_version_sysex,    &axefx_request_version_length,    0 },
+  [AXEFX_REQ_BLOCKS]     = { "blocks",     axefx_request_blocks_sysex,     &axefx_request_blocks_length,     1 },
+  [AXEFX_REQ_PATCH_NAME] = { "patch name", axefx_request_patch_name_sysex, &axefx_request_patch_name_length, 1 },
+};
+
+typedef struct {
+  u8 in_flight;
+  u8 in_flight_seq;
+  u8 in_flight_state_seq;
+  u8 state_seq;      // incremented by AxeFX_RequestInvalidate
+  u8 queued;
+  u8 retries;
+  u32 sent_tick;
+
+  // statistics
+  u32 sent;
+  u32 coalesced;     // identical to a queued or in-flight request
+  u32 dropped;       // queued request replaced before it has been sent
+  u32 stale;         // reply to a request of a previous preset or state
+  u32 timeouts;      // requests which have been sent again
+  u32 failed;        // requests which didn't get a reply after all retries
+  u32 rtt_max;
+  u32 rtt_hist[AXEFX_REQ_RTT_BUCKETS];
+} axefx_req_t;
+
+static axefx_req_t axefx_req[AXEFX_REQ_NUM];
+static u8 axefx_req_seq;
+static u8 axefx_preset; // preset which is selected on the Axe-FX
+static u8 axefx_blocks_stale; // the block status result currently received is ignored
+static u8 axefx_blocks_seq;   // state_seq of the blocks request when the result started
+
+
 /////////////////////////////////////////////////////////////////////////////
 // Local variables
 /////////////////////////////////////////////////////////////////////////////
 
 static u32 ms_counter;
 
+// wakes up TASK_FBV_Check (received FBV frames, deferred FBV commands)
+static xQueueHandle xFBVEventQueue;
+
+// MIDI routing matrix: message classes and channels which are forwarded
+// from each source to each destination port. It is compiled into a table of
+// destination port masks per source port, class and channel, so that a
+// package is forwarded with a single lookup. Two tables are used alternately,
+// a changed matrix is compiled into the unused one which is then switched
+// in with a single pointer write while packages are forwarded.
+#define ROUTE_PORT_NUM 4 // USB0, USB1, UART0, UART1
+
+#define ROUTE_CLASS_NOTE    0x01 // note off/on, poly pressure
+#define ROUTE_CLASS_CC      0x02
+#define ROUTE_CLASS_PC      0x04
+#define ROUTE_CLASS_CHN     0x08 // channel pressure, pitch bend
+#define ROUTE_CLASS_SYSEX   0x10
+#define ROUTE_CLASS_SYSTEM  0x20 // system common and realtime
+#define ROUTE_CLASS_NUM     6
+#define ROUTE_CLASS_ALL     0x3f
+
+static const mios32_midi_port_t route_port[ROUTE_PORT_NUM] = { USB0, USB1, UART0, UART1 };
+static const char *route_port_name[ROUTE_PORT_NUM] = { "usb0", "usb1", "uart0", "uart1" };
+
+// class index of each Code Index Number of a USB MIDI package
+static const u8 route_cin_class[16] = {
+  5, 5, 5, 5,   // misc, cable events, system common
+  4, 4, 4, 4,   // SysEx (0x5 also single byte system common)
+  0, 0, 0,      // note off, note on, poly pressure
+  1, 2, 3, 3,   // CC, program change, channel pressure, pitch bend
+  5             // single byte (realtime)
+};
+
+static u8 route_classes[ROUTE_PORT_NUM][ROUTE_PORT_NUM];   // [src][dst] ROUTE_CLASS_* mask
+static u16 route_channels[ROUTE_PORT_NUM][ROUTE_PORT_NUM]; // [src][dst] channel mask of channel messages
+
+typedef u8 route_table_t[ROUTE_PORT_NUM][ROUTE_CLASS_NUM][16]; // destination port mask
+static route_table_t route_tables[2];
+static route_table_t * volatile route_table = &route_tables[0];
+
+// output stage: controller generated MIDI is sent once to a mask of ports
+// (bit numbers are the indices of route_port); the packages are sent
+// immediately, the USB MIDI driver already collects them for its next transfer
+#define MIDI_OUT_USB0   0x01
+#define MIDI_OUT_USB1   0x02
+#define MIDI_OUT_UART0  0x04
+#define MIDI_OUT_UART1  0x08
+
+#define MIDI_OUT_RACK   (MIDI_OUT_USB1 | MIDI_OUT_UART1) // CCs and program changes of the controls
+#define MIDI_OUT_AXEFX  MIDI_OUT_UART1                   // Axe-FX only (AXEFX_PORT)
+
+// UART ports which send with running status (MIDI_OUT_UART* mask), the status
+// byte is repeated at least each MIDI_OUT_RS_REFRESH_MS so that a receiver
+// which missed it (e.g. after power-on) recovers
+#ifndef MIDI_OUT_RS_DEFAULT
+#define MIDI_OUT_RS_DEFAULT MIDI_OUT_UART1
+#endif
+#define MIDI_OUT_RS_REFRESH_MS 1000
+static u8 midi_out_rs = MIDI_OUT_RS_DEFAULT;
+static u32 midi_out_rs_tick;
+
 static  u8 midi_channel = 0x01;
 static  u8 midi_bank_size = 0x04;
 static  u8 midi_bank = 0x00;
@@ -124,28 +262,62 @@ enum {
 	FBV_ID_ON,
 };
 
-#define FBV_ID_MAX_BLOCKS 8
+// FBV interface of the floorboard with the channel display, the bank and the preset switches
+// controls are addressed by (board, fbv_id), further floorboards are FBV interfaces 1..FBV_UART_NUM-1
+#define FBV_BOARD_MAIN 0
+
+// model of each floorboard, FBV_MODEL_* or APP_FBV_MODEL_AUTO: taken from the
+// init frame (most payloads aren't documented, so that all controls are
+// served); the models which have been set on the terminal are handed over
+// to TASK_FBV_Check
+#define APP_FBV_MODEL_AUTO FBV_MODEL_NUM
+static const char *fbv_model_name[FBV_MODEL_NUM+1] = { "full", "shortboard", "express", "auto" };
+static u8 fbv_model[FBV_UART_NUM];
+static u8 fbv_handshake[FBV_UART_NUM];  // first data byte of the last init frame
+static volatile u8 fbv_model_changed;   // boards whose model has been set on the terminal
 
 typedef struct {
+	u8 board;
 	u8 fbv_id;
 	u8 type;
 	u8 cc;
 	u8 status;
-	u8 len;
-	axefx_block_status_struct blocks[FBV_ID_MAX_BLOCKS];
 } fbv_ctrl_t;
 
+// a pedal drives up to PEDAL_TARGET_NUM CCs, each through its own response
+// table which is generated from the curve, the output range and the
+// calibration of the pedal (APP_PedalTablesBuild)
+#define PEDAL_TARGET_NUM 4
+#define PEDAL_CC_NONE 0xff     // target not used
+#define PEDAL_STATUS_ANY 0xff  // target is active independent of the foot control status
+
+enum {
+	PEDAL_CURVE_LINEAR,
+	PEDAL_CURVE_LOG,    // fast start (inverted square)
+	PEDAL_CURVE_EXP,    // slow start (square)
+	PEDAL_CURVE_CUSTOM, // pedal_curve_custom
+	PEDAL_CURVE_NUM
+};
+
+typedef struct {
+	u8 cc;
+	u8 status; // sent while the foot control has this status (FBV_ID_OFF/FBV_ID_ON)
+	u8 curve;
+	u8 min;    // CC value at heel position
+	u8 max;    // CC value at toe position (max < min inverts the pedal)
+} fbv_foottarget_t;
+
 typedef struct {
+	u8 board;
 	u8 fbv_id_foot;
 	u8 fbv_id_btn;
 	u8 fbv_id_led1;
 	u8 fbv_id_led2;
 	u8 cc;
-	u8 cc_value1;
-	u8 cc_value2;
+	u8 cal_min; // range of the pedal values which the pedal actually reaches
+	u8 cal_max;
+	fbv_foottarget_t targets[PEDAL_TARGET_NUM];
 	u8 status;
-	u8 len;
-	axefx_block_status_struct blocks[FBV_ID_MAX_BLOCKS];
 } fbv_footctrl_t;
 
 #define FBV_ID_MAX_FOOT_INDEX 2
@@ -153,10 +325,14 @@ typedef struct {
 fbv_ctrl_t FBV_ctrls[FBV_ID_MAX_INDEX] = {};
 fbv_footctrl_t FBV_ctrls_cont[FBV_ID_MAX_FOOT_INDEX] = {};
 
+// reverse index: FBV id of each floorboard -> index of FBV_ctrls (FBV_ID_NONE: no control)
+// built by do_init_info, so that a button is dispatched without searching
+static u8 fbv_id_to_ctrl[FBV_UART_NUM][256];
 
 
 
-static const u8 block_to_id[] = {
+
+static const u8 block_to_id[AXEFX_BLOCK_NUM] = {
 		FBV_ID_FX_LOOP_i,//    ID_COMP1 = 100,
 		FBV_ID_NONE,//    ID_COMP2,
 		FBV_ID_NONE,//    ID_GRAPHEQ1,
@@ -228,7 +404,129 @@ static const u8 block_to_id[] = {
 		FBV_ID_NONE,//    ID_VOLUME4,
 };
 
+// Axe-FX block state of the current patch, one bit per block (index: block ID - ID_COMP1)
+// the blocks of a control are selected with its membership mask, so that the
+// state of all blocks of a control is tested or toggled with a few word operations
+static u32 axefx_block_present[AXEFX_BLOCK_WORDS]; // block is part of the patch
+static u32 axefx_block_on[AXEFX_BLOCK_WORDS];      // block is engaged (not bypassed)
+static u8 axefx_block_cc[AXEFX_BLOCK_NUM];          // bypass CC of the block (128: none)
+static u32 ctrl_block_mask[FBV_ID_MAX_INDEX][AXEFX_BLOCK_WORDS]; // blocks assigned to each control, built from block_to_id
+
+// reverse index of the CCs on RACK_MIDI_CHN, so that CCs sent by the Axe-FX
+// or the DAW update the LEDs directly: the controls which send a CC (one bit
+// per index of FBV_ctrls, built by do_init_info) and the block which is
+// bypassed by a CC (learned from the block status results)
+#define CC_BLOCK_NONE 0xff
+static u32 cc_to_ctrls[128];
+static u8 cc_to_block[128];
+
+// block state and patch name of each preset, so that the FBV shows a preset
+// as soon as the program change has been sent; the results of the Axe-FX
+// correct the LEDs afterwards and refresh the entry
+#define PRESET_CACHE_NUM    128
+#define PRESET_CACHE_BLOCKS 0x01 // block state valid
+#define PRESET_CACHE_NAME   0x02 // patch name valid
+
+typedef struct {
+	u32 block_present[AXEFX_BLOCK_WORDS];
+	u32 block_on[AXEFX_BLOCK_WORDS];
+	u32 ctrl_on; // status of the controls with blocks, one bit per index of FBV_ctrls
+	u8 name[16];
+	u8 flags;
+} preset_cache_t;
+
+static preset_cache_t preset_cache[PRESET_CACHE_NUM];
+static u32 preset_cache_hits;
+static u32 preset_cache_misses;
+static u32 preset_cache_corrections; // control states of a hit which differed from the result
+
+// the block status result is collected here for the cache, it doesn't
+// necessarily belong to the preset which is shown (see preset prefetch)
+static u32 blocks_rx_present[AXEFX_BLOCK_WORDS];
+static u32 blocks_rx_on[AXEFX_BLOCK_WORDS];
+static u32 blocks_rx_ctrl_seen; // controls with at least one block, one bit per index of FBV_ctrls
+static u32 blocks_rx_ctrl_on;   // status of the first block of each control
+static u8 blocks_rx_show;       // the result belongs to the selected preset and updates the LEDs
+
+// The Axe-FX only reports the state of the preset which is selected on it,
+// the prefetch therefore switches the Axe-FX through the presets of a new
+// bank and back. The patch sounds different meanwhile, so it is disabled by
+// default (terminal command "prefetch on"), only runs if the FBV and the
+// Axe-FX have been idle for PRESET_PREFETCH_IDLE_MS and is aborted by any FBV
+// event and by MIDI from the Axe-FX (see APP_MIDI_NotifyPackage).
+#define PRESET_PREFETCH_IDLE_MS     2000
+#define PRESET_PREFETCH_INTERVAL_MS 100 // pause between two presets
+
+static u8 preset_prefetch_enabled = 0;
+static u8 preset_prefetch_pending;  // presets of the selected bank not fetched yet
+static u8 preset_prefetch_next;     // next preset of the bank (0..midi_bank_size-1)
+static u8 preset_prefetch_active;   // the Axe-FX is switched to a prefetched preset
+static u32 preset_prefetch_tick;    // last prefetch step
+static u32 preset_prefetch_count;   // number of prefetched presets
+static u8 preset_modified;          // blocks of the selected preset have been toggled
+static u32 fbv_activity_tick;       // last FBV button or pedal event, or MIDI from the Axe-FX
+static volatile u8 preset_prefetch_abort; // MIDI from the Axe-FX, the abort is done by TASK_FBV_Check
+
+// The block status is polled to follow blocks which are switched on the
+// Axe-FX itself (front panel, editor). The interval starts at AXEFX_POLL_MIN_MS
+// after FBV activity or a changed result and doubles with each unchanged
+// result. Each poll is followed by a pause which keeps the result below
+// AXEFX_POLL_BANDWIDTH_PCT of the UART bandwidth (31250 baud: 3125 bytes/s).
+// Polling is suspended while tuner info or SysEx from the editor is received.
+#define AXEFX_POLL_MIN_MS         250
+#define AXEFX_POLL_MAX_MS         8000
+#define AXEFX_POLL_BANDWIDTH_PCT  5
+#define AXEFX_POLL_QUIET_MS       2000 // suspended until the tuner/editor is quiet for this time
+#define AXEFX_POLL_REQUEST_LEN    7    // length of the request, the result has 7 bytes around its data
+
+static u8 axefx_poll_enabled = 1;
+static u32 axefx_poll_interval = AXEFX_POLL_MIN_MS;
+static u32 axefx_poll_min = AXEFX_POLL_MIN_MS; // bandwidth limit derived from the last result
+static u32 axefx_poll_tick;       // last poll
+static u8 axefx_poll_quiet;       // tuner info or editor SysEx received
+static u32 axefx_poll_quiet_tick; // ... at this time
+static u32 axefx_poll_count;      // statistics
+static u32 axefx_poll_changes;
+static u32 axefx_poll_suspended;
+
+// Pedal values pass a pipeline before they are sent: positions which jitter
+// back by up to pedal_hysteresis steps are held back, each target translates
+// the position with its response table, drops repeated values and sends at
+// most one CC each pedal_interval_ms. A value which is held back by the rate
+// limit is sent by TASK_FBV_Check when the interval has passed, a held back
+// reversal when no further position has arrived within the interval (at
+// least PEDAL_HOLD_MS_MIN), so the final position of the pedal always arrives.
+#define PEDAL_HYSTERESIS_DEFAULT 1
+#define PEDAL_INTERVAL_MS_DEFAULT 10
+#define PEDAL_HOLD_MS_MIN 10
+#define PEDAL_VALUE_NONE 0xff
+
+typedef struct {
+  u8 value;         // last sent value (PEDAL_VALUE_NONE: nothing sent)
+  u8 pending;       // pending_value waits for the rate limit
+  u8 pending_value;
+  u32 tick;         // time of the last sent value
+} pedal_state_t;
+
+static u8 pedal_table[FBV_ID_MAX_FOOT_INDEX][PEDAL_TARGET_NUM][128];
+static pedal_state_t pedal_state[FBV_ID_MAX_FOOT_INDEX][PEDAL_TARGET_NUM];
+static u8 pedal_position[FBV_ID_MAX_FOOT_INDEX]; // last accepted position (PEDAL_VALUE_NONE: none)
+static s8 pedal_dir[FBV_ID_MAX_FOOT_INDEX];      // direction of the last accepted change (-1, 0, 1)
+static u8 pedal_held[FBV_ID_MAX_FOOT_INDEX];     // held back reversal (PEDAL_VALUE_NONE: none)
+static u32 pedal_held_tick[FBV_ID_MAX_FOOT_INDEX]; // ... received at this time
+static volatile u8 pedal_rebuild;                // pedals which have been reconfigured on the terminal
+
+// PEDAL_CURVE_CUSTOM: CC values at 9 equidistant pedal positions, interpolated
+static const u8 pedal_curve_custom[9] = { 0, 4, 14, 34, 64, 93, 113, 123, 127 };
+static const char *pedal_curve_name[PEDAL_CURVE_NUM] = { "linear", "log", "exp", "custom" };
+
+static u8 pedal_hysteresis = PEDAL_HYSTERESIS_DEFAULT;
+static u16 pedal_interval_ms = PEDAL_INTERVAL_MS_DEFAULT;
+static u32 pedal_sent;  // statistics
+static u32 pedal_saved; // values which haven't been sent
+
 void do_init_info(void) {
+	int i;
 
 	FBV_ctrls[FBV_ID_TAP_i].fbv_id = FBV_ID_TAP;
 	//FBV_ctrls[FBV_ID_TAP_i].type = FBV_ID_TYPE_TEMPO;
@@ -314,15 +612,22 @@ void do_init_info(void) {
 	FBV_ctrls[FBV_ID_FOOT_CTRL_W_BTN_i].type = FBV_ID_TYPE_FOOT_CTRL;
 	FBV_ctrls[FBV_ID_FOOT_CTRL_W_BTN_i].cc = FBV_ID_FOOT_CTRL_W_VAL_i;
 
+	for(i = 0; i<FBV_ID_MAX_FOOT_INDEX; i++) {
+		int t;
+		FBV_ctrls_cont[i].cal_min = 0;
+		FBV_ctrls_cont[i].cal_max = 127;
+		for(t = 0; t<PEDAL_TARGET_NUM; t++)
+			FBV_ctrls_cont[i].targets[t] = (fbv_foottarget_t){ PEDAL_CC_NONE, PEDAL_STATUS_ANY, PEDAL_CURVE_LINEAR, 0, 127 };
+	}
+
 	FBV_ctrls_cont[FBV_ID_FOOT_CTRL_V_VAL_i].fbv_id_foot = FBV_ID_FOOT_CTRL_V_VAL;
 	FBV_ctrls_cont[FBV_ID_FOOT_CTRL_V_VAL_i].fbv_id_btn= FBV_ID_FOOT_CTRL_V_BTN;
 	FBV_ctrls_cont[FBV_ID_FOOT_CTRL_V_VAL_i].fbv_id_led1 = FBV_ID_FOOT_CTRL_P2_LED;
 	FBV_ctrls_cont[FBV_ID_FOOT_CTRL_V_VAL_i].fbv_id_led2 = FBV_ID_FOOT_CTRL_V_LED;
 	FBV_ctrls_cont[FBV_ID_FOOT_CTRL_V_VAL_i].cc = 105;
-	FBV_ctrls_cont[FBV_ID_FOOT_CTRL_V_VAL_i].cc_value1 = 125;
-	FBV_ctrls_cont[FBV_ID_FOOT_CTRL_V_VAL_i].cc_value2 = 7;
+	FBV_ctrls_cont[FBV_ID_FOOT_CTRL_V_VAL_i].targets[0] = (fbv_foottarget_t){ 125, FBV_ID_OFF, PEDAL_CURVE_LINEAR, 0, 127 };
+	FBV_ctrls_cont[FBV_ID_FOOT_CTRL_V_VAL_i].targets[1] = (fbv_foottarget_t){ 7, FBV_ID_ON, PEDAL_CURVE_LINEAR, 0, 127 };
 	FBV_ctrls_cont[FBV_ID_FOOT_CTRL_V_VAL_i].status = FBV_ID_OFF;
-	FBV_ctrls_cont[FBV_ID_FOOT_CTRL_V_VAL_i].len = 0;
 
 
 	FBV_ctrls_cont[FBV_ID_FOOT_CTRL_W_VAL_i].fbv_id_foot = FBV_ID_FOOT_CTRL_W_VAL;
@@ -334,11 +639,36 @@ void do_init_info(void) {
 	FBV_ctrls_cont[FBV_ID_FOOT_CTRL_W_VAL_i].fbv_id_led2 = FBV_ID_FOOT_CTRL_P1_LED;
 
 	FBV_ctrls_cont[FBV_ID_FOOT_CTRL_W_VAL_i].cc = 43;
-	FBV_ctrls_cont[FBV_ID_FOOT_CTRL_W_VAL_i].cc_value1 = 126;
-	FBV_ctrls_cont[FBV_ID_FOOT_CTRL_W_VAL_i].cc_value2 = 2;
+	FBV_ctrls_cont[FBV_ID_FOOT_CTRL_W_VAL_i].targets[0] = (fbv_foottarget_t){ 126, FBV_ID_OFF, PEDAL_CURVE_LINEAR, 0, 127 };
+	FBV_ctrls_cont[FBV_ID_FOOT_CTRL_W_VAL_i].targets[1] = (fbv_foottarget_t){ 2, FBV_ID_ON, PEDAL_CURVE_LINEAR, 0, 127 };
 	FBV_ctrls_cont[FBV_ID_FOOT_CTRL_W_VAL_i].status = FBV_ID_OFF;
-	FBV_ctrls_cont[FBV_ID_FOOT_CTRL_W_VAL_i].len = 0;
 
+	// build the reverse index of the controls
+	memset(fbv_id_to_ctrl, FBV_ID_NONE, sizeof(fbv_id_to_ctrl));
+	for(i = 0; i<FBV_ID_MAX_INDEX; i++) {
+		if( FBV_ctrls[i].board < FBV_UART_NUM )
+			fbv_id_to_ctrl[FBV_ctrls[i].board][FBV_ctrls[i].fbv_id] = i;
+	}
+
+	// build the block membership masks of the controls
+	for(i = 0; i<AXEFX_BLOCK_NUM; i++) {
+		if( block_to_id[i] < FBV_ID_MAX_INDEX )
+			ctrl_block_mask[block_to_id[i]][i >> 5] |= AXEFX_BLOCK_BIT(i);
+	}
+
+	// build the reverse index of the CCs, the block CCs are learned later
+	memset(cc_to_ctrls, 0, sizeof(cc_to_ctrls));
+	memset(cc_to_block, CC_BLOCK_NONE, sizeof(cc_to_block));
+	memset(axefx_block_cc, 128, sizeof(axefx_block_cc));
+	for(i = 0; i<FBV_ID_MAX_INDEX; i++) {
+		u8 cc = 128;
+		if( FBV_ctrls[i].type == FBV_ID_TYPE_BTN_LED )
+			cc = FBV_ctrls[i].cc;
+		else if( FBV_ctrls[i].type == FBV_ID_TYPE_FOOT_CTRL )
+			cc = FBV_ctrls_cont[FBV_ctrls[i].cc].cc;
+		if( cc < 128 )
+			cc_to_ctrls[cc] |= (u32)1 << i;
+	}
 }
 
 
@@ -346,6 +676,7 @@ typedef struct {
 	u8 status;
 	u8 led_count;
 	u16 btn_count;
+	volatile u8 tuner_pending;
 } FBV_tempo_tuner_info_struct;
 
 FBV_tempo_tuner_info_struct FBV_tempo_tuner_info = {0};
@@ -355,8 +686,64 @@ FBV_tempo_tuner_info_struct FBV_tempo_tuner_info = {0};
 /////////////////////////////////////////////////////////////////////////////
 static void APP_Periodic_100uS(void);
 static void TASK_FBV_Check(void *pvParameters);
+static void APP_FBV_NotifyFromISR(u8 board);
+static void APP_FBV_LedDeferred(u8 board, u8 led, u8 status);
+static s32 APP_FBV_RxFrameGet(fbv_uart_frame_t *frame);
+static fbv_ctrl_t *APP_FBV_CtrlGet(u8 board, u8 fbv_id);
+static u8 APP_BlockToCtrl(u16 block_id);
+static u8 APP_CtrlBlocksAssigned(u8 index);
+static u8 APP_CtrlBlocksUsed(u8 index);
+static u8 APP_CtrlBlocksBypassed(u8 index);
+static void APP_CtrlBlocksToggle(u8 index);
+static void APP_CtrlStatusShow(u8 index, u8 status);
+static void APP_MIDI_CCReceived(u8 cc, u8 value);
+static u8 APP_PresetCacheApply(u8 preset);
+static void APP_PresetCacheStoreBlocks(u8 preset);
+static void APP_PresetCacheStoreName(u8 preset, const u8 *name, u16 len);
+static void APP_PresetPrefetchStart(void);
+static void APP_PresetPrefetchAbort(void);
+static s32 APP_PresetPrefetchStep(s32 req_pending);
+static void AxeFX_PollActivity(void);
+static void AxeFX_PollResult(u8 changed, u16 len);
+static u32 AxeFX_PollStep(s32 req_pending);
+static void APP_PedalTablesBuild(u8 index);
+static void APP_PedalInput(u8 index, u8 value);
+static void APP_PedalMove(u8 index, u8 value, u32 now);
+static void APP_PedalSend(u8 index, u8 target, u8 value, u32 now);
+static u32 APP_PedalFlush(void);
+static void APP_PedalPrint(void);
+static s32 APP_PedalCommand(char *args);
+static int APP_TerminalSplit(char *args, char **arg, int max);
+static void AxeFX_Request(u8 kind);
+static void AxeFX_RequestPresetChanged(u8 preset);
+static void AxeFX_RequestInvalidate(u8 kind);
+static s32 AxeFX_RequestFlush(void);
+static u8 AxeFX_RequestReply(u8 kind);
+static void AxeFX_RequestStatsPrint(void);
+static void AxeFX_RequestStatsClear(void);
+static void APP_FBVStatsPrint(void);
+static void APP_FBVModelApply(u8 board);
+static s32 APP_FBVModelCommand(char *args);
+static s32 APP_TerminalParse(mios32_midi_port_t port, char c);
+static s32 APP_RoutePortGet(mios32_midi_port_t port);
+static void APP_RouteSet(u8 src, u8 dst, u8 classes, u16 channels);
+static void APP_RouteCompile(void);
+static void APP_RoutePrint(void);
+static s32 APP_RouteCommand(char *args);
+static void APP_MIDI_Send(u8 ports, mios32_midi_package_t package);
+static void APP_MIDI_SendCC(u8 ports, u8 cc, u8 value);
+static void APP_MIDI_SendProgramChange(u8 ports, u8 prg);
+static void APP_MIDI_RunningStatusSet(u8 ports);
+static void APP_MIDI_RunningStatusRefresh(void);
 static s32 AxeFX_SYSEX_Parser(mios32_midi_port_t port, u8 midi_in);
-static void AxeFX_SYSEX_Handle_Package(void);
+static void AxeFX_SYSEX_Complete(void);
+static void AxeFX_SYSEX_Version(const u8 *data, u16 len);
+static void AxeFX_SYSEX_Tuner(const u8 *data, u16 len);
+static void AxeFX_SYSEX_BlockStatusBegin(void);
+static void AxeFX_SYSEX_BlockStatusRecord(const u8 *record);
+static void AxeFX_SYSEX_BlockStatusEnd(const u8 *data, u16 len);
+static void AxeFX_SYSEX_PatchName(const u8 *data, u16 len);
+static void AxeFX_SYSEX_TempoTap(const u8 *data, u16 len);
 
 /////////////////////////////////////////////////////////////////////////////
 // This hook is called after startup to initialize the application
@@ -384,25 +771,52 @@ void APP_Init(void)
   MIOS32_BOARD_LED_Set(1, 0);
 
   FBV_UART_Init(0);
+  {
+    u8 board;
+    for(board=0; board<FBV_UART_NUM; ++board) {
+      fbv_model[board] = APP_FBV_MODEL_AUTO;
+      fbv_handshake[board] = 0xff;
+    }
+  }
+
+  // TASK_FBV_Check sleeps until a FBV frame has been received or a command has been deferred
+  xFBVEventQueue = xQueueCreate(1, sizeof(u8));
+  FBV_UART_RxFrameCallback_Init(APP_FBV_NotifyFromISR);
 
   do_init_info();
+  {
+    u8 index;
+    for(index=0; index<FBV_ID_MAX_FOOT_INDEX; ++index)
+      APP_PedalTablesBuild(index);
+  }
+
+  // default routes: USBx->UARTx and UARTx->USBx
+  APP_RouteSet(0, 2, ROUTE_CLASS_ALL, 0xffff);
+  APP_RouteSet(1, 3, ROUTE_CLASS_ALL, 0xffff);
+  APP_RouteSet(2, 0, ROUTE_CLASS_ALL, 0xffff);
+  APP_RouteSet(3, 1, ROUTE_CLASS_ALL, 0xffff);
+  APP_RouteCompile();
+  APP_MIDI_RunningStatusSet(midi_out_rs);
 
   midi_channel = 0;
   midi_bank_size = 4;
   midi_bank = 0;
 
-  FBV_UART_TxBufferSendChannelCommand(FBV_CHANNEL_USER,'0' + (midi_bank/10),'0' + (midi_bank%10)); //ascii code for numbers
-  FBV_UART_TxBufferSendLedCommand(FBV_ID_CHAN_A, FBV_LED_ON);
+  FBV_UART_TxBufferSendChannelCommand(FBV_BOARD_MAIN, FBV_CHANNEL_USER,'0' + (midi_bank/10),'0' + (midi_bank%10)); //ascii code for numbers
+  FBV_UART_TxBufferSendLedCommand(FBV_BOARD_MAIN, FBV_ID_CHAN_A, FBV_LED_ON);
 
-  FBV_UART_TxBufferSendDisplay("VLoTech FBV ctrl",16);
+  FBV_UART_TxBufferSendDisplay(FBV_BOARD_MAIN, "VLoTech FBV ctrl",16);
 
-  MIOS32_MIDI_SendProgramChange(USB1, RACK_MIDI_CHN, midi_channel);
-  MIOS32_MIDI_SendProgramChange(UART1, RACK_MIDI_CHN, midi_channel);
+  APP_MIDI_SendProgramChange(MIDI_OUT_RACK, midi_channel);
+  AxeFX_RequestPresetChanged(midi_channel);
 
   MIOS32_MIDI_SysExCallback_Init(AxeFX_SYSEX_Parser);
-  MIOS32_MIDI_SendSysEx(AXEFX_PORT,axefx_request_version_sysex,axefx_request_version_length);
-  MIOS32_MIDI_SendSysEx(AXEFX_PORT,axefx_request_blocks_sysex,axefx_request_blocks_length);
-  MIOS32_MIDI_SendSysEx(AXEFX_PORT,axefx_request_patch_name_sysex,axefx_request_patch_name_length);
+  AxeFX_Request(AXEFX_REQ_VERSION);
+  AxeFX_Request(AXEFX_REQ_BLOCKS);
+  AxeFX_Request(AXEFX_REQ_PATCH_NAME);
+
+  // statistics can be requested from the MIOS terminal
+  MIOS32_MIDI_DebugCommandCallback_Init(APP_TerminalParse);
 
   // install timer function which is called each 100 uS
   MIOS32_TIMER_Init(0, 100, APP_Periodic_100uS, MIOS32_IRQ_PRIO_MID);
@@ -436,23 +850,40 @@ void APP_Background(void)
 /////////////////////////////////////////////////////////////////////////////
 void APP_MIDI_NotifyPackage(mios32_midi_port_t port, mios32_midi_package_t midi_package)
 {
-  // forward packages USBx->UARTx and UARTx->USBx
-  switch( port ) {
-    case USB0:
-      MIOS32_MIDI_SendPackage(UART0, midi_package);
-      break;
-
-    case USB1:
-      MIOS32_MIDI_SendPackage(UART1, midi_package);
-      break;
+  // CCs of the Axe-FX or the DAW update the LEDs
+  if( (port == UART1 || port == USB1) && midi_package.event == CC && midi_package.chn == RACK_MIDI_CHN )
+    APP_MIDI_CCReceived(midi_package.cc_number, midi_package.value);
+
+  // SysEx from the editor suspends the polling of the block status
+  if( port == USB1 && midi_package.type >= 0x4 && midi_package.type <= 0x7 ) {
+    axefx_poll_quiet_tick = xTaskGetTickCount() * portTICK_RATE_MS;
+    axefx_poll_quiet = 1;
+  }
 
-    case UART0:
-      MIOS32_MIDI_SendPackage(USB0, midi_package);
-      break;
+  // the Axe-FX is used (e.g. from its front panel or a device at its MIDI in),
+  // the prefetch must not switch its presets meanwhile. SysEx (the results of
+  // the requests, tempo), realtime messages and the echo of the own program
+  // change don't count.
+  if( port == AXEFX_PORT && preset_prefetch_pending &&
+      !(midi_package.type >= 0x4 && midi_package.type <= 0x7) &&
+      !(midi_package.type == 0xf && midi_package.evnt0 >= 0xf8) &&
+      !(midi_package.event == ProgramChange && midi_package.evnt1 == axefx_preset) ) {
+    u8 event = 0;
+    preset_prefetch_abort = 1;
+    xQueueSend(xFBVEventQueue, &event, 0);
+  }
 
-    case UART1:
-      MIOS32_MIDI_SendPackage(USB1, midi_package);
-      break;
+  // forward the package as configured in the routing matrix
+  s32 src = APP_RoutePortGet(port);
+  if( src >= 0 ) {
+    u8 dst = (*route_table)[src][route_cin_class[midi_package.type]][midi_package.chn];
+    if( dst & midi_out_rs )
+      APP_MIDI_RunningStatusRefresh();
+    while( dst ) {
+      u8 i = __builtin_ctz(dst);
+      dst &= dst - 1;
+      MIOS32_MIDI_SendPackage(route_port[i], midi_package);
+    }
   }
   // forward to MIDI Monitor
   // SysEx messages have to be filtered for USB0 and UART0 to avoid data corruption
@@ -462,12 +893,226 @@ void APP_MIDI_NotifyPackage(mios32_midi_port_t port, mios32_midi_package_t midi_
 }
 
 
+/////////////////////////////////////////////////////////////////////////////
+// returns the routing index of a MIDI port, -1 if the port isn't routed
+/////////////////////////////////////////////////////////////////////////////
+static s32 APP_RoutePortGet(mios32_midi_port_t port)
+{
+  switch( port ) {
+    case USB0:  return 0;
+    case USB1:  return 1;
+    case UART0: return 2;
+    case UART1: return 3;
+    default:    return -1;
+  }
+}
+
+
+/////////////////////////////////////////////////////////////////////////////
+// sets a route of the matrix (classes 0: no route)
+// the change takes effect with APP_RouteCompile
+/////////////////////////////////////////////////////////////////////////////
+static void APP_RouteSet(u8 src, u8 dst, u8 classes, u16 channels)
+{
+  route_classes[src][dst] = classes & ROUTE_CLASS_ALL;
+  route_channels[src][dst] = channels;
+}
+
+
+/////////////////////////////////////////////////////////////////////////////
+// compiles the routing matrix into the unused table and switches to it
+// the channel mask only applies to channel messages
+/////////////////////////////////////////////////////////////////////////////
+static void APP_RouteCompile(void)
+{
+  route_table_t *table = (route_table == &route_tables[0]) ? &route_tables[1] : &route_tables[0];
+  int src, dst, cls, chn;
+
+  memset(table, 0, sizeof(route_table_t));
+  for(src=0; src<ROUTE_PORT_NUM; ++src) {
+    for(dst=0; dst<ROUTE_PORT_NUM; ++dst) {
+      for(cls=0; cls<ROUTE_CLASS_NUM; ++cls) {
+        if( !(route_classes[src][dst] & (1 << cls)) )
+          continue;
+
+        u8 channel_msg = (1 << cls) < ROUTE_CLASS_SYSEX;
+        for(chn=0; chn<16; ++chn) {
+          if( !channel_msg || (route_channels[src][dst] & (1 << chn)) )
+            (*table)[src][cls][chn] |= 1 << dst;
+        }
+      }
+    }
+  }
+
+  route_table = table;
+}
+
+
+/////////////////////////////////////////////////////////////////////////////
+// prints the routing matrix on the MIOS terminal
+/////////////////////////////////////////////////////////////////////////////
+static void APP_RoutePrint(void)
+{
+  int src, dst;
+
+  DEBUG_MSG("Routes (classes: 01 note, 02 CC, 04 PC, 08 pressure/pitch bend, 10 SysEx, 20 system):\n");
+  for(src=0; src<ROUTE_PORT_NUM; ++src) {
+    for(dst=0; dst<ROUTE_PORT_NUM; ++dst) {
+      if( route_classes[src][dst] )
+        DEBUG_MSG("  %-5s -> %-5s classes %02x channels %04x\n", route_port_name[src], route_port_name[dst],
+                  route_classes[src][dst], route_channels[src][dst]);
+    }
+  }
+}
+
+
+/////////////////////////////////////////////////////////////////////////////
+// terminal command: route <src> <dst> <classes> [<channels>]
+// classes and channels are hexadecimal masks, classes 0 removes the route
+/////////////////////////////////////////////////////////////////////////////
+static s32 APP_RouteCommand(char *args)
+{
+  char *arg[4];
+  int num = APP_TerminalSplit(args, arg, 4);
+  int src = -1, dst = -1, i;
+
+  if( num < 3 )
+    return -1;
+
+  for(i=0; i<ROUTE_PORT_NUM; ++i) {
+    if( strcmp(arg[0], route_port_name[i]) == 0 )
+      src = i;
+    if( strcmp(arg[1], route_port_name[i]) == 0 )
+      dst = i;
+  }
+  if( src < 0 || dst < 0 )
+    return -1;
+
+  APP_RouteSet(src, dst, strtoul(arg[2], NULL, 16), (num >= 4) ? strtoul(arg[3], NULL, 16) : 0xffff);
+  APP_RouteCompile();
+  return 0;
+}
+
+
+/////////////////////////////////////////////////////////////////////////////
+// sends a package to all ports of the mask (MIDI_OUT_*)
+/////////////////////////////////////////////////////////////////////////////
+static void APP_MIDI_Send(u8 ports, mios32_midi_package_t package)
+{
+  if( ports & midi_out_rs )
+    APP_MIDI_RunningStatusRefresh();
+
+  while( ports ) {
+    u8 i = __builtin_ctz(ports);
+    ports &= ports - 1;
+    MIOS32_MIDI_SendPackage(route_port[i], package);
+  }
+}
+
+
+/////////////////////////////////////////////////////////////////////////////
+// sends a CC on RACK_MIDI_CHN to all ports of the mask
+/////////////////////////////////////////////////////////////////////////////
+static void APP_MIDI_SendCC(u8 ports, u8 cc, u8 value)
+{
+  mios32_midi_package_t package;
+
+  package.ALL = 0;
+  package.type = CC;
+  package.event = CC;
+  package.chn = RACK_MIDI_CHN;
+  package.cc_number = cc;
+  package.value = value;
+  APP_MIDI_Send(ports, package);
+}
+
+
+/////////////////////////////////////////////////////////////////////////////
+// sends a program change on RACK_MIDI_CHN to all ports of the mask
+/////////////////////////////////////////////////////////////////////////////
+static void APP_MIDI_SendProgramChange(u8 ports, u8 prg)
+{
+  mios32_midi_package_t package;
+
+  package.ALL = 0;
+  package.type = ProgramChange;
+  package.event = ProgramChange;
+  package.chn = RACK_MIDI_CHN;
+  package.evnt1 = prg;
+  APP_MIDI_Send(ports, package);
+}
+
+
+/////////////////////////////////////////////////////////////////////////////
+// enables running status on the UART ports of the mask (MIDI_OUT_UART*),
+// it is disabled on all other UART ports
+/////////////////////////////////////////////////////////////////////////////
+static void APP_MIDI_RunningStatusSet(u8 ports)
+{
+  int i;
+
+  midi_out_rs = ports & (MIDI_OUT_UART0 | MIDI_OUT_UART1);
+  for(i=0; i<ROUTE_PORT_NUM; ++i) {
+    if( (route_port[i] & 0xf0) == UART0 )
+      MIOS32_MIDI_RS_OptimisationSet(route_port[i], (midi_out_rs >> i) & 1);
+  }
+  midi_out_rs_tick = xTaskGetTickCount() * portTICK_RATE_MS;
+}
+
+
+/////////////////////////////////////////////////////////////////////////////
+// lets the UART driver send the next status byte again once the refresh
+// period has been passed, called before packages are sent to these ports
+/////////////////////////////////////////////////////////////////////////////
+static void APP_MIDI_RunningStatusRefresh(void)
+{
+  u32 now = xTaskGetTickCount() * portTICK_RATE_MS;
+  int i;
+
+  if( (now - midi_out_rs_tick) < MIDI_OUT_RS_REFRESH_MS )
+    return;
+
+  midi_out_rs_tick = now;
+  for(i=0; i<ROUTE_PORT_NUM; ++i) {
+    if( midi_out_rs & (1 << i) )
+      MIOS32_MIDI_RS_Reset(route_port[i]);
+  }
+}
+
+
 void APP_SRIO_ServicePrepare(void) { }
 void APP_SRIO_ServiceFinish(void) { }
 void APP_DIN_NotifyToggle(u32 pin, u32 pin_value) { }
 void APP_ENC_NotifyChange(u32 encoder, s32 incrementer) { }
 void APP_AIN_NotifyChange(u32 pin, u32 pin_value) { }
 
+/////////////////////////////////////////////////////////////////////////////
+// Axe-FX commands, indexed by the command byte
+// Commands without record_len are delivered to the handler after F7 if the
+// number of data bytes is in the range min_len..max_len. Short commands
+// (max_len <= SYSEX_RECORD_LEN) are kept in sysex_record, all others in
+// sysex_buffer. Commands with record_len are delivered to the record function
+// in records of this size while they are received.
+/////////////////////////////////////////////////////////////////////////////
+typedef struct {
+  u16 min_len;
+  u16 max_len;
+  u8  record_len;
+  void (*begin)(void);                      // command received (optional)
+  void (*record)(const u8 *record);         // record received (record_len > 0)
+  void (*handler)(const u8 *data, u16 len); // message complete (optional)
+} axefx_sysex_cmd_t;
+
+static const axefx_sysex_cmd_t axefx_sysex_cmds[SYSEX_CMD_NUM] = {
+  //        min_len, max_len,         record_len,             begin,                        record,                        handler
+  [0x08] = { 2,      SYSEX_MAX_LEN-1, 0,                      NULL,                         NULL,                          AxeFX_SYSEX_Version },       // version
+  [0x0d] = { 3,      3,               0,                      NULL,                         NULL,                          AxeFX_SYSEX_Tuner },         // tuner info
+  [0x0e] = { 0,      SYSEX_LEN_ANY,   SYSEX_BLOCK_RECORD_LEN, AxeFX_SYSEX_BlockStatusBegin, AxeFX_SYSEX_BlockStatusRecord, AxeFX_SYSEX_BlockStatusEnd }, // block status
+  [0x0f] = { 1,      SYSEX_MAX_LEN-1, 0,                      NULL,                         NULL,                          AxeFX_SYSEX_PatchName },     // patch name
+  [0x10] = { 0,      SYSEX_RECORD_LEN, 0,                     NULL,                         NULL,                          AxeFX_SYSEX_TempoTap },      // tempo tap
+};
+
+
 /////////////////////////////////////////////////////////////////////////////
 // This function parses an incoming sysex stream for SysEx messages
 /////////////////////////////////////////////////////////////////////////////
@@ -476,337 +1121,430 @@ s32 AxeFX_SYSEX_Parser(mios32_midi_port_t port, u8 midi_in)
   if( port != AXEFX_PORT )
     return 0; // forward package to APP_MIDI_NotifyPackage()
 
-  // branch depending on state
-  if( sysex_state == SYSEX_HEADER ) {
-    if( midi_in != sysex_header[sysex_count]) {
-      // incoming byte doesn't match
-    	sysex_count = 0;
-    	sysex_cmd = 0;
-    	DEBUG_MSG("AxeFX other byte found than header\n");
+  if( midi_in >= 0xf8 )
+    return 0; // realtime messages can be inserted anywhere
+
+  if( midi_in >= 0x80 ) {
+    // F7 completes the message, F0 starts a new one, any other status byte aborts it
+    if( midi_in == 0xf7 && sysex_state == SYSEX_DATA )
+      AxeFX_SYSEX_Complete();
+
+    sysex_state = SYSEX_HEADER;
+    sysex_count = (midi_in == 0xf0) ? 1 : 0;
+    return 0; // don't forward package to APP_MIDI_NotifyPackage()
+  }
+
+  switch( sysex_state ) {
+  case SYSEX_HEADER:
+    // on a mismatch the next message is matched from its F0
+    if( sysex_count > 0 && midi_in == sysex_header[sysex_count] ) {
+      if( ++sysex_count == sizeof(sysex_header) )
+        sysex_state = SYSEX_MODEL;
+    } else {
+      sysex_count = 0;
+    }
+    break;
+
+  case SYSEX_MODEL:
+    if( midi_in < AXEFX_MODEL_NUM ) {
+      sysex_axefx_type = midi_in;
+      sysex_state = SYSEX_CMD;
+    } else {
+      sysex_state = SYSEX_SKIP;
+    }
+    break;
+
+  case SYSEX_CMD: {
+    sysex_cmd = midi_in;
+    sysex_count = 0;
+    sysex_record_pos = 0;
+
+    const axefx_sysex_cmd_t *cmd = (midi_in < SYSEX_CMD_NUM) ? &axefx_sysex_cmds[midi_in] : NULL;
+    if( cmd == NULL || (cmd->handler == NULL && cmd->record == NULL) ) {
+      sysex_state = SYSEX_SKIP; // (yet) unknown command
     } else {
-      sysex_buffer[sysex_count++] = midi_in;
-      if( sysex_count == sizeof(sysex_header) ) {
-		// complete header received, waiting for data
-		sysex_state = SYSEX_CMD_STATE_BEGIN;
-		sysex_count = 0;
-		sysex_axefx_type = sysex_buffer[4];
-
-		DEBUG_MSG("AxeFX %s header found\n", sysex_axefx_type==0?"Standard":"Ultra");
+      sysex_state = SYSEX_DATA;
+      if( cmd->begin != NULL )
+        cmd->begin();
+    }
+  } break;
+
+  case SYSEX_DATA: {
+    const axefx_sysex_cmd_t *cmd = &axefx_sysex_cmds[sysex_cmd];
+
+    if( cmd->record_len ) {
+      sysex_record[sysex_record_pos++] = midi_in;
+      if( sysex_record_pos == cmd->record_len ) {
+        cmd->record(sysex_record);
+        sysex_record_pos = 0;
       }
+    } else if( cmd->max_len <= SYSEX_RECORD_LEN ) {
+      if( sysex_count < SYSEX_RECORD_LEN )
+        sysex_record[sysex_count] = midi_in;
+    } else {
+      if( sysex_count < (SYSEX_MAX_LEN-1) ) // one byte is reserved for the terminator
+        sysex_buffer[sysex_count] = midi_in;
     }
-  } else {
-	    // check for end of SysEx message or invalid status byte
-	    if( midi_in >= 0x80 ) {
-	      if( midi_in == 0xf7 && sysex_state == SYSEX_CMD_STATE_CONT ) {
-	    	  sysex_state = SYSEX_CMD_STATE_END;
-	    	  DEBUG_MSG("AxeFX data done\n");
-	      } else {
-	    	sysex_state = SYSEX_HEADER;
-	      	sysex_count = 0;
-	      	sysex_cmd = 0;
-	      	DEBUG_MSG("AxeFX data broken\n");
-	      }
-	    } else {
-	      // check if command byte has been received
-	  	  if (sysex_state == SYSEX_CMD_STATE_BEGIN) {
-	  		  sysex_cmd = midi_in;
-	  		  sysex_state = SYSEX_CMD_STATE_CONT;
-	  		  sysex_count = 0;
-	  		  DEBUG_MSG("AxeFX CMD received %02X\n", sysex_cmd);
-	  	  } else {
-	  		  if(sysex_count<SYSEX_MAX_LEN)
-	  		    sysex_buffer[sysex_count++] = midi_in;
-	  		  else
-	  			sysex_count++;  // ignore additional bytes...
-	  	  }
-	    }
-	    if (sysex_state == SYSEX_CMD_STATE_END) {
-	    	//process the package !!
-	    	AxeFX_SYSEX_Handle_Package();
-	    	sysex_state = SYSEX_HEADER;
-	    	sysex_count = 0;
-	    	sysex_cmd = 0;
-	    }
+
+    if( sysex_count < SYSEX_LEN_ANY )
+      ++sysex_count;
+  } break;
+
+  default: // SYSEX_SKIP
+    break;
   }
 
   return 0; // don't forward package to APP_MIDI_NotifyPackage()
 }
 
-void AxeFX_SYSEX_Handle_Package(void) {
 
-	if( sysex_state != SYSEX_CMD_STATE_END)
+/////////////////////////////////////////////////////////////////////////////
+// called on F7, validates the length and calls the handler of the command
+/////////////////////////////////////////////////////////////////////////////
+static void AxeFX_SYSEX_Complete(void)
+{
+  const axefx_sysex_cmd_t *cmd = &axefx_sysex_cmds[sysex_cmd];
+
+  if( sysex_count < cmd->min_len || sysex_count > cmd->max_len ) {
+    DEBUG_MSG("AxeFX CMD %02X: invalid length %d\n", sysex_cmd, sysex_count);
+    return;
+  }
+
+  if( cmd->handler == NULL )
+    return;
+
+  if( cmd->record_len || cmd->max_len <= SYSEX_RECORD_LEN ) {
+    cmd->handler(sysex_record, sysex_count);
+  } else {
+    sysex_buffer[sysex_count] = 0; // terminate strings
+    cmd->handler(sysex_buffer, sysex_count);
+  }
+}
+
+
+/////////////////////////////////////////////////////////////////////////////
+// version status result
+/////////////////////////////////////////////////////////////////////////////
+static void AxeFX_SYSEX_Version(const u8 *data, u16 len)
+{
+	AxeFX_RequestReply(AXEFX_REQ_VERSION);
+
+	u8 axefx_major = data[0];
+	u8 axefx_minor = data[1];
+	DEBUG_MSG("AxeFX major: %02i\n", axefx_major);
+	DEBUG_MSG("AxeFX minor: %02i\n", axefx_minor);
+
+	if(sysex_axefx_type==0x0) {
+		u8 buf[17] = "Axe-FX Std v0.00";
+		if(axefx_major>9)
+			buf[11] = '0'+ axefx_major/10;
+		buf[12] = '0'+ axefx_major%10;
+		buf[14] = '0'+ axefx_minor/10;
+		buf[15] = '0'+ axefx_minor%10;
+		//FBV_UART_TxBufferSendDisplay(FBV_BOARD_MAIN, buf,16);
+	} else if(sysex_axefx_type==0x1) {
+		u8 buf[17] = "Axe-FX Ult v0.00";
+		if(axefx_major>9)
+			buf[11] = '0'+ axefx_major/10;
+		buf[12] = '0'+ axefx_major%10;
+		buf[14] = '0'+ axefx_minor/10;
+		buf[15] = '0'+ axefx_minor%10;
+		//FBV_UART_TxBufferSendDisplay(FBV_BOARD_MAIN, buf,16);
+	}
+}
+
+
+/////////////////////////////////////////////////////////////////////////////
+// tuner info: note, string, position of the needle
+/////////////////////////////////////////////////////////////////////////////
+static void AxeFX_SYSEX_Tuner(const u8 *data, u16 len)
+{
+	//u8 string = '1' + data[1]; // string number
+	u8 needle[17] = "                ";
+
+	// no polling while the tuner is active
+	axefx_poll_quiet_tick = xTaskGetTickCount() * portTICK_RATE_MS;
+	axefx_poll_quiet = 1;
+
+	if(data[2] >=0x10 || data[2] <0x70) {
+
+		switch(data[0]) {
+			case 0:FBV_UART_TxBufferSendTuner(FBV_BOARD_MAIN, 'A',0);break;
+			case 1:FBV_UART_TxBufferSendTuner(FBV_BOARD_MAIN, 'B',1);break;
+			case 2:FBV_UART_TxBufferSendTuner(FBV_BOARD_MAIN, 'B',0);break;
+			case 3:FBV_UART_TxBufferSendTuner(FBV_BOARD_MAIN, 'C',0);break;
+			case 4:FBV_UART_TxBufferSendTuner(FBV_BOARD_MAIN, 'D',1);break;
+			case 5:FBV_UART_TxBufferSendTuner(FBV_BOARD_MAIN, 'D',0);break;
+			case 6:FBV_UART_TxBufferSendTuner(FBV_BOARD_MAIN, 'E',1);break;
+			case 7:FBV_UART_TxBufferSendTuner(FBV_BOARD_MAIN, 'E',0);break;
+			case 8:FBV_UART_TxBufferSendTuner(FBV_BOARD_MAIN, 'F',0);break;
+			case 9:FBV_UART_TxBufferSendTuner(FBV_BOARD_MAIN, 'G',1);break;
+			case 10:FBV_UART_TxBufferSendTuner(FBV_BOARD_MAIN, 'G',0);break;
+			case 11:FBV_UART_TxBufferSendTuner(FBV_BOARD_MAIN, 'A',1);break;
+			default:FBV_UART_TxBufferSendTuner(FBV_BOARD_MAIN, ' ',0);break;
+		}
+
+		// data[2] == pos from 0x10 to 0x6F
+		if(data[2] < 0x1A) {
+			needle[0] = ')';
+		}
+		if(data[2] < 0x20) {
+			needle[1] = ')';
+		}
+		if(data[2] < 0x26) {
+			needle[2] = ')';
+		}
+		if(data[2] < 0x2C) {
+			needle[3] = ')';
+		}
+		if(data[2] < 0x32) {
+			needle[4] = ')';
+		}
+		if(data[2] < 0x38) {
+			needle[5] = ')';
+		}
+		if(data[2] < 0x3E) {
+			needle[6] = ')';
+		}
+		if(data[2] < 0x42) {
+			needle[7] = ')';
+		}
+		if(data[2] > 0x3E) {
+			needle[8] = '(';
+		}
+		if(data[2] > 0x41) {
+			needle[9] = '(';
+		}
+		if(data[2] > 0x47) {
+			needle[10] = '(';
+		}
+		if(data[2] > 0x4D) {
+			needle[11] = '(';
+		}
+		if(data[2] > 0x53) {
+			needle[12] = '(';
+		}
+		if(data[2] > 0x59) {
+			needle[13] = '(';
+		}
+		if(data[2] > 0x5F) {
+			needle[14] = '(';
+		}
+		if(data[2] > 0x65) {
+			needle[15] = '(';
+		}
+		if(data[2] > 0x3E && data[2] < 0x42) {
+			needle[6] = '-';
+			needle[7] = '*';
+			needle[8] = '*';
+			needle[9] = '-';
+		}
+
+
+	FBV_UART_TxBufferSendDisplay(FBV_BOARD_MAIN, needle,16);
+
+	} else {
+		FBV_UART_TxBufferSendTuner(FBV_BOARD_MAIN, ' ',0);
+		FBV_UART_TxBufferSendDisplay(FBV_BOARD_MAIN, "                ",16);
+	}
+}
+
+
+/////////////////////////////////////////////////////////////////////////////
+// called when a block status result starts, the result contains all blocks
+// of the patch and replaces the block state when it is complete
+/////////////////////////////////////////////////////////////////////////////
+static void AxeFX_SYSEX_BlockStatusBegin(void)
+{
+  axefx_blocks_seq = axefx_req[AXEFX_REQ_BLOCKS].state_seq;
+  axefx_blocks_stale = !AxeFX_RequestReply(AXEFX_REQ_BLOCKS);
+  if( axefx_blocks_stale )
+    return;
+
+  memset(blocks_rx_present, 0, sizeof(blocks_rx_present));
+  memset(blocks_rx_on, 0, sizeof(blocks_rx_on));
+  blocks_rx_ctrl_seen = 0;
+  blocks_rx_ctrl_on = 0;
+
+  // results of prefetched presets only go to the cache
+  blocks_rx_show = (axefx_preset == midi_channel);
+}
+
+
+/////////////////////////////////////////////////////////////////////////////
+// applies a single record of the block status result while the result is
+// still being received
+/////////////////////////////////////////////////////////////////////////////
+static void AxeFX_SYSEX_BlockStatusRecord(const u8 *record)
+{
+	u16 fx_id = record[0] + (record[1]*0x10);
+	u16 fx_cc = record[2] + (record[3]*0x10);
+	u8 status = record[4]; //status
+	u8 index = APP_BlockToCtrl(fx_id);
+
+	// a block has been toggled while the result is received
+	if( !axefx_blocks_stale && axefx_blocks_seq != axefx_req[AXEFX_REQ_BLOCKS].state_seq ) {
+		axefx_blocks_stale = 1;
+		++axefx_req[AXEFX_REQ_BLOCKS].stale;
+	}
+	if( axefx_blocks_stale )
 		return;
 
+	if(index < FBV_ID_MAX_INDEX ) {
+		u8 block = fx_id - ID_COMP1;
+		u32 ctrl_bit = (u32)1 << index;
+		u8 first = !(blocks_rx_ctrl_seen & ctrl_bit);
+
+		// the bypass CCs don't depend on the preset
+		// values above 127 are no MIDI CC, the block is stored without CC (128)
+		u8 cc = (fx_cc < 128) ? fx_cc : 128;
+		if( axefx_block_cc[block] != cc ) {
+			if( axefx_block_cc[block] < 128 && cc_to_block[axefx_block_cc[block]] == block )
+				cc_to_block[axefx_block_cc[block]] = CC_BLOCK_NONE;
+			if( cc < 128 )
+				cc_to_block[cc] = block;
+			axefx_block_cc[block] = cc;
+		}
+		blocks_rx_present[block >> 5] |= AXEFX_BLOCK_BIT(block);
+		if( status != FBV_ID_OFF )
+			blocks_rx_on[block >> 5] |= AXEFX_BLOCK_BIT(block);
+
+		// the control shows the state of its first block, the driver skips
+		// LED commands which don't change the LED (e.g. if shown from the cache)
+		if(first) {
+			blocks_rx_ctrl_seen |= ctrl_bit;
+			if( status != FBV_ID_OFF )
+				blocks_rx_ctrl_on |= ctrl_bit;
+			if( blocks_rx_show )
+				APP_CtrlStatusShow(index, status);
+		}
+	}
+#if DEBUG_VERBOSE_LEVEL >= 2
+	DEBUG_MSG("AxeFX fx-ID: %02X, CC: %02X, status: %02X -> FBV ctrl %d\n", fx_id, fx_cc, status, index);
+#endif
+}
+
+
+/////////////////////////////////////////////////////////////////////////////
+// block status result complete, the records have already been applied by
+// AxeFX_SYSEX_BlockStatusRecord
+/////////////////////////////////////////////////////////////////////////////
+static void AxeFX_SYSEX_BlockStatusEnd(const u8 *data, u16 len)
+{
 	int i;
 
-	DEBUG_MSG("AxeFX handling package with CMD: %02X\n", sysex_cmd);
-	DEBUG_MSG("AxeFX handling package with LEN: %02X\n", sysex_count);
-
-	switch(sysex_cmd) {
-		case 0x0d:
-			// tuner info
-			{
-				//u8 string = '1' + sysex_buffer[1]; // string number
-				u8 needle[17] = "                ";
-
-				if(sysex_buffer[2] >=0x10 || sysex_buffer[2] <0x70) {
-
-					switch(sysex_buffer[0]) {
-						case 0:FBV_UART_TxBufferSendTuner('A',0);break;
-						case 1:FBV_UART_TxBufferSendTuner('B',1);break;
-						case 2:FBV_UART_TxBufferSendTuner('B',0);break;
-						case 3:FBV_UART_TxBufferSendTuner('C',0);break;
-						case 4:FBV_UART_TxBufferSendTuner('D',1);break;
-						case 5:FBV_UART_TxBufferSendTuner('D',0);break;
-						case 6:FBV_UART_TxBufferSendTuner('E',1);break;
-						case 7:FBV_UART_TxBufferSendTuner('E',0);break;
-						case 8:FBV_UART_TxBufferSendTuner('F',0);break;
-						case 9:FBV_UART_TxBufferSendTuner('G',1);break;
-						case 10:FBV_UART_TxBufferSendTuner('G',0);break;
-						case 11:FBV_UART_TxBufferSendTuner('A',1);break;
-						default:FBV_UART_TxBufferSendTuner(' ',0);break;
-					}
-
-					// sysex_buffer[2] == pos from 0x10 to 0x6F
-					if(sysex_buffer[2] < 0x1A) {
-						needle[0] = ')';
-					}
-					if(sysex_buffer[2] < 0x20) {
-						needle[1] = ')';
-					}
-					if(sysex_buffer[2] < 0x26) {
-						needle[2] = ')';
-					}
-					if(sysex_buffer[2] < 0x2C) {
-						needle[3] = ')';
-					}
-					if(sysex_buffer[2] < 0x32) {
-						needle[4] = ')';
-					}
-					if(sysex_buffer[2] < 0x38) {
-						needle[5] = ')';
-					}
-					if(sysex_buffer[2] < 0x3E) {
-						needle[6] = ')';
-					}
-					if(sysex_buffer[2] < 0x42) {
-						needle[7] = ')';
-					}
-					if(sysex_buffer[2] > 0x3E) {
-						needle[8] = '(';
-					}
-					if(sysex_buffer[2] > 0x41) {
-						needle[9] = '(';
-					}
-					if(sysex_buffer[2] > 0x47) {
-						needle[10] = '(';
-					}
-					if(sysex_buffer[2] > 0x4D) {
-						needle[11] = '(';
-					}
-					if(sysex_buffer[2] > 0x53) {
-						needle[12] = '(';
-					}
-					if(sysex_buffer[2] > 0x59) {
-						needle[13] = '(';
-					}
-					if(sysex_buffer[2] > 0x5F) {
-						needle[14] = '(';
-					}
-					if(sysex_buffer[2] > 0x65) {
-						needle[15] = '(';
-					}
-					if(sysex_buffer[2] > 0x3E && sysex_buffer[2] < 0x42) {
-						needle[6] = '-';
-						needle[7] = '*';
-						needle[8] = '*';
-						needle[9] = '-';
-					}
-
-
-				FBV_UART_TxBufferSendDisplay(needle,16);
-
-				} else {
-					FBV_UART_TxBufferSendTuner(' ',0);
-					FBV_UART_TxBufferSendDisplay("                ",16);
-				}
-
-			}
-			break;
+	if( !axefx_blocks_stale && axefx_blocks_seq != axefx_req[AXEFX_REQ_BLOCKS].state_seq ) {
+		axefx_blocks_stale = 1;
+		++axefx_req[AXEFX_REQ_BLOCKS].stale;
+	}
+	if( axefx_blocks_stale )
+		return;
 
-		case 0x0e:
-			// block status result
-			DEBUG_MSG("AxeFX block status result\n");
-			for(i = 0; i<FBV_ID_MAX_INDEX;i++)
-				FBV_ctrls[i].len = 0;
-			for(i = 0; i<FBV_ID_MAX_FOOT_INDEX;i++)
-				FBV_ctrls_cont[i].len = 0;
-
-
-			for(i = 0; i<sysex_count && sysex_count<SYSEX_MAX_LEN; i+=5) {
-				u16 fx_id = sysex_buffer[i] + (sysex_buffer[i+1]*0x10);
-				u16 fx_cc = sysex_buffer[i+2] + (sysex_buffer[i+3]*0x10);
-				u8 status = sysex_buffer[i+4]; //status
-				int index = block_to_id[fx_id-100];
-				if(index < FBV_ID_MAX_INDEX ) {
-					fbv_ctrl_t *ctrl = &(FBV_ctrls[index]);
-					if(ctrl->type == FBV_ID_TYPE_BTN_LED) {
-						ctrl->blocks[ctrl->len].cc = fx_cc;
-						ctrl->blocks[ctrl->len].id = fx_id;
-						ctrl->blocks[ctrl->len].status = status;
-
-						if(ctrl->len == 0)
-							ctrl->status = status;
-
-						FBV_UART_TxBufferSendLedCommand(ctrl->fbv_id, status);
-
-						ctrl->len++;
-					} else if(ctrl->type == FBV_ID_TYPE_FOOT_CTRL) {
-						fbv_footctrl_t *foot = &(FBV_ctrls_cont[ctrl->cc]);
-
-						foot->blocks[foot->len].cc = fx_cc;
-						foot->blocks[foot->len].id = fx_id;
-						foot->blocks[foot->len].status = status;
-
-						if(foot->len == 0) {
-							foot->status = status;
-							if(status== FBV_ID_OFF) {
-								FBV_UART_TxBufferSendLedCommand(foot->fbv_id_led1, FBV_ID_ON);
-								FBV_UART_TxBufferSendLedCommand(foot->fbv_id_led2, FBV_ID_OFF);
-							} else {
-								FBV_UART_TxBufferSendLedCommand(foot->fbv_id_led1, FBV_ID_OFF);
-								FBV_UART_TxBufferSendLedCommand(foot->fbv_id_led2, FBV_ID_ON);
-							}
-						}
-
-
-						foot->len++;
-					}
-					DEBUG_MSG("------  for FBV: %02X\n", ctrl->fbv_id);
-				} else {
-					DEBUG_MSG("------  NOT USED !!\n");
-				}
-				DEBUG_MSG("AxeFX fx-ID: %02X\n", fx_id);
-				DEBUG_MSG("AxeFX fx-CC: %02X\n", fx_cc);
-				DEBUG_MSG("AxeFX fx-status: %02X\n", status);
-			}
-			break;
-		case 0x0f:
-			// patch name result
-			DEBUG_MSG("AxeFX patch name status result\n");
-			DEBUG_MSG(sysex_buffer);
-			FBV_UART_TxBufferSendDisplay(sysex_buffer,16);
-			break;
-		case 0x08:
-			// version status result
-			DEBUG_MSG("AxeFX version status result\n");
-			u8 axefx_major = sysex_buffer[i];
-			u8 axefx_minor = sysex_buffer[i+1];
-			DEBUG_MSG("AxeFX major: %02i\n", axefx_major);
-			DEBUG_MSG("AxeFX minor: %02i\n", axefx_minor);
-
-			if(sysex_axefx_type==0x0) {
-				u8 buf[17] = "Axe-FX Std v0.00";
-				if(axefx_major>9)
-					buf[11] = '0'+ axefx_major/10;
-				buf[12] = '0'+ axefx_major%10;
-				buf[14] = '0'+ axefx_minor/10;
-				buf[15] = '0'+ axefx_minor%10;
-				//FBV_UART_TxBufferSendDisplay(buf,16);
-			} else if(sysex_axefx_type==0x1) {
-				u8 buf[17] = "Axe-FX Ult v0.00";
-				if(axefx_major>9)
-					buf[11] = '0'+ axefx_major/10;
-				buf[12] = '0'+ axefx_major%10;
-				buf[14] = '0'+ axefx_minor/10;
-				buf[15] = '0'+ axefx_minor%10;
-				//FBV_UART_TxBufferSendDisplay(buf,16);
-			}
+	if( len % SYSEX_BLOCK_RECORD_LEN )
+		DEBUG_MSG("AxeFX block status result: incomplete record ignored\n");
 
-			break;
-		case 0x10:
-			// tempo tap info
-			FBV_tempo_tuner_info.led_count = 0x01;
-			for(i = 0; i<FBV_ID_MAX_INDEX;i++) {
-				if( FBV_ctrls[i].type == FBV_ID_TYPE_TEMPO_TUNER || FBV_ctrls[i].type == FBV_ID_TYPE_TEMPO ) {
-					FBV_UART_TxBufferSendLedCommand(FBV_ctrls[i].fbv_id, FBV_LED_ON);
-					break;
-				}
-			}
-			break;
+	// the live block state is replaced as a whole, so that it can be compared
+	if( blocks_rx_show ) {
+		u8 changed = memcmp(axefx_block_present, blocks_rx_present, sizeof(blocks_rx_present)) != 0 ||
+		             memcmp(axefx_block_on, blocks_rx_on, sizeof(blocks_rx_on)) != 0;
+		memcpy(axefx_block_present, blocks_rx_present, sizeof(axefx_block_present));
+		memcpy(axefx_block_on, blocks_rx_on, sizeof(axefx_block_on));
+		AxeFX_PollResult(changed, len);
+	}
 
-		default:
-			// (yet) unknown command
-			break;
+	// switch off the LEDs of controls whose blocks are not part of the patch
+	for(i = 0; i<FBV_ID_MAX_INDEX && blocks_rx_show;i++) {
+		if( FBV_ctrls[i].type == FBV_ID_TYPE_BTN_LED && APP_CtrlBlocksAssigned(i) && !APP_CtrlBlocksUsed(i) ) {
+			FBV_ctrls[i].status = FBV_ID_OFF;
+			FBV_UART_TxBufferSendLedCommand(FBV_ctrls[i].board, FBV_ctrls[i].fbv_id, FBV_LED_OFF);
+		}
+	}
+
+	APP_PresetCacheStoreBlocks(axefx_preset);
+}
+
+
+/////////////////////////////////////////////////////////////////////////////
+// patch name result
+/////////////////////////////////////////////////////////////////////////////
+static void AxeFX_SYSEX_PatchName(const u8 *data, u16 len)
+{
+	if( !AxeFX_RequestReply(AXEFX_REQ_PATCH_NAME) )
+		return;
+
+	if( axefx_preset == midi_channel ) {
+#if DEBUG_VERBOSE_LEVEL >= 2
+		DEBUG_MSG("AxeFX patch name: %s\n", data);
+#endif
+		FBV_UART_TxBufferSendDisplay(FBV_BOARD_MAIN, (u8 *)data, (len < 16) ? len : 16);
+	}
+	APP_PresetCacheStoreName(axefx_preset, data, len);
+}
+
+
+/////////////////////////////////////////////////////////////////////////////
+// tempo tap info
+/////////////////////////////////////////////////////////////////////////////
+static void AxeFX_SYSEX_TempoTap(const u8 *data, u16 len)
+{
+	int i;
 
+	FBV_tempo_tuner_info.led_count = 0x01;
+	for(i = 0; i<FBV_ID_MAX_INDEX;i++) {
+		if( FBV_ctrls[i].type == FBV_ID_TYPE_TEMPO_TUNER || FBV_ctrls[i].type == FBV_ID_TYPE_TEMPO ) {
+			FBV_UART_TxBufferSendLedCommand(FBV_ctrls[i].board, FBV_ctrls[i].fbv_id, FBV_LED_ON);
+			break;
+		}
 	}
 }
 
 
 /////////////////////////////////////////////////////////////////////////////
 // This timer function is periodically called each 100 uS
+// it runs in interrupt context: FBV commands are only deferred here and
+// sent by TASK_FBV_Check, so that a full Tx buffer never stalls the timer
 /////////////////////////////////////////////////////////////////////////////
 static void APP_Periodic_100uS(void)
 {
 
   static u32 flash_cnt = 0;
 //  mios32_fbv_message_t msg = {0};
-  int i,j;
+  int i;
   if((flash_cnt) == 0) {
 	  for(i = 0; i<FBV_ID_MAX_INDEX;i++) {
-		  if( FBV_ctrls[i].type == FBV_ID_TYPE_BTN_LED && FBV_ctrls[i].len > 0 ) {
-			  for(j=0; j< FBV_ctrls[i].len; j++ ) {
-				  if(FBV_ctrls[i].blocks[j].status == 0) {
-					  FBV_UART_TxBufferSendLedCommand(FBV_ctrls[i].fbv_id, FBV_LED_ON);
-					  break;
-				  }
-			  }
-
-		  }
+		  if( FBV_ctrls[i].type == FBV_ID_TYPE_BTN_LED && APP_CtrlBlocksBypassed(i) )
+			  APP_FBV_LedDeferred(FBV_ctrls[i].board, FBV_ctrls[i].fbv_id, FBV_LED_ON);
 	  }
 
 	  if((midi_channel)/midi_bank_size != midi_bank ) {
 		  for(i = 0;i<midi_bank_size;i++) {
 			  if(midi_channel%midi_bank_size == i)
-				  FBV_UART_TxBufferSendLedCommand(bank_ids[i], FBV_LED_ON);
+				  APP_FBV_LedDeferred(FBV_BOARD_MAIN, bank_ids[i], FBV_LED_ON);
 			  else
-				  FBV_UART_TxBufferSendLedCommand(bank_ids[i], FBV_LED_OFF);
+				  APP_FBV_LedDeferred(FBV_BOARD_MAIN, bank_ids[i], FBV_LED_OFF);
 		  }
 	  }
   } else if((flash_cnt) == 0x400) {
 	  for(i = 0; i<FBV_ID_MAX_INDEX;i++) {
-		  if( FBV_ctrls[i].type == FBV_ID_TYPE_BTN_LED && FBV_ctrls[i].len > 0 ) {
-			  for(j=0; j< FBV_ctrls[i].len; j++ ) {
-				  if(FBV_ctrls[i].blocks[j].status == 0) {
-					  FBV_UART_TxBufferSendLedCommand(FBV_ctrls[i].fbv_id, FBV_LED_OFF);
-					  break;
-				  }
-			  }
-
-		  }
+		  if( FBV_ctrls[i].type == FBV_ID_TYPE_BTN_LED && APP_CtrlBlocksBypassed(i) )
+			  APP_FBV_LedDeferred(FBV_ctrls[i].board, FBV_ctrls[i].fbv_id, FBV_LED_OFF);
 	  }
 
 
   } else if((flash_cnt) == 0x1000) {
 	  if((midi_channel)/midi_bank_size != midi_bank ) {
 		  for(i = 0;i<midi_bank_size;i++)
-			  FBV_UART_TxBufferSendLedCommand(bank_ids[i], FBV_LED_OFF);
+			  APP_FBV_LedDeferred(FBV_BOARD_MAIN, bank_ids[i], FBV_LED_OFF);
 	  }
   }
 
   if((flash_cnt&0x0F) == 0) {
 	  if(FBV_tempo_tuner_info.status == FBV_BUTTON_PRESSED) {
 		  if(FBV_tempo_tuner_info.btn_count >= 1875)  {// 3 sec.
-			  for(i = 0; i<FBV_ID_MAX_INDEX;i++) {
-				  if( FBV_ctrls[i].type == FBV_ID_TYPE_TEMPO_TUNER  ) {
-					  MIOS32_MIDI_SendCC(USB1, RACK_MIDI_CHN, FBV_ctrls[i].status, 127); // status == tuner-cc == non-latching
-					  MIOS32_MIDI_SendCC(UART1, RACK_MIDI_CHN, FBV_ctrls[i].status, 127); // status == tuner-cc == non-latching
-					  break;
-				  }
-			  }
 			  FBV_tempo_tuner_info.status = FBV_BUTTON_RELEASED; // prevent endless loop
 			  FBV_tempo_tuner_info.btn_count = 0;
-			  FBV_UART_TxBufferSendChannelCommand('-','-','-');
+			  FBV_tempo_tuner_info.tuner_pending = 1; // tuner CC and display are sent by TASK_FBV_Check
+			  APP_FBV_NotifyFromISR(FBV_BOARD_MAIN);
 		  } else {
 			 FBV_tempo_tuner_info.btn_count++;
 		  }
@@ -816,7 +1554,7 @@ static void APP_Periodic_100uS(void)
 		  if(FBV_tempo_tuner_info.led_count == 0x0F) {
 			  for(i = 0; i<FBV_ID_MAX_INDEX;i++) {
 				  if( FBV_ctrls[i].type == FBV_ID_TYPE_TEMPO_TUNER || FBV_ctrls[i].type == FBV_ID_TYPE_TEMPO ) {
-					FBV_UART_TxBufferSendLedCommand(FBV_ctrls[i].fbv_id, FBV_LED_OFF);
+					APP_FBV_LedDeferred(FBV_ctrls[i].board, FBV_ctrls[i].fbv_id, FBV_LED_OFF);
 					break;
 				  }
 			  }
@@ -835,242 +1573,1384 @@ static void APP_Periodic_100uS(void)
 }
 
 
-static void TASK_FBV_Check(void *pvParameters)
+/////////////////////////////////////////////////////////////////////////////
+// wakes up TASK_FBV_Check, called from the FBV UART interrupt (complete
+// frame received) and from the timer (FBV command deferred)
+/////////////////////////////////////////////////////////////////////////////
+static void APP_FBV_NotifyFromISR(u8 board)
 {
-  portTickType xLastExecutionTime;
+  portBASE_TYPE xHigherPriorityTaskWoken = pdFALSE;
+  u8 event = 0;
 
-  // Initialise the xLastExecutionTime variable on task entry
-  xLastExecutionTime = xTaskGetTickCount();
+  // a single pending event is sufficient, the task drains everything on wakeup
+  xQueueSendFromISR(xFBVEventQueue, &event, &xHigherPriorityTaskWoken);
+  portEND_SWITCHING_ISR(xHigherPriorityTaskWoken);
+}
 
-  while( 1 ) {
-    vTaskDelayUntil(&xLastExecutionTime, 1 / portTICK_RATE_MS);
 
-    mios32_fbv_message_t msg = {0};
+/////////////////////////////////////////////////////////////////////////////
+// defers a LED command from the timer to TASK_FBV_Check
+/////////////////////////////////////////////////////////////////////////////
+static void APP_FBV_LedDeferred(u8 board, u8 led, u8 status)
+{
+  FBV_UART_TxBufferSendLedCommand_Deferred(board, led, status);
+  APP_FBV_NotifyFromISR(board);
+}
 
-    while(FBV_UART_RxBufferReceiveMessage(&msg) == 0) {
-  //	  DEBUG_MSG("FBV Message:\n");
-  //	  DEBUG_MSG("header: %08X\n", msg.header);
-  //	  DEBUG_MSG("size:   %08X\n", msg.size);
-  //	  DEBUG_MSG("cmd:    %08X\n", msg.cmd);
-  //	  if(msg.pos == 1)
-  //		  DEBUG_MSG("data:    %08X\n", msg.data[0]);
-  //	  else if(msg.pos > 1) {
-  //		  DEBUG_MSG("data:\n");
-  //		  MIOS32_MIDI_SendDebugHexDump(msg.data,msg.pos);
-  //	  }
-  //	  DEBUG_MSG("------------\n");
 
-  	  if(msg.cmd == 0x90) { //INIT ?!?
+/////////////////////////////////////////////////////////////////////////////
+// returns the next received frame of any floorboard (frame.fbv is the board)
+/////////////////////////////////////////////////////////////////////////////
+static s32 APP_FBV_RxFrameGet(fbv_uart_frame_t *frame)
+{
+  u8 board;
 
-  		  int i;
+  for(board=0; board<FBV_UART_NUM; ++board) {
+    if( FBV_UART_RxFrameGet(board, frame) > 0 )
+      return 1;
+  }
 
-  		  FBV_UART_TxBufferSendInit();
+  return 0; // no frame received
+}
 
-  		  FBV_UART_TxBufferSendChannelCommand(FBV_CHANNEL_USER,'0' + (midi_bank/10),'0' + (midi_bank%10)); //ascii code for numbers
-  		  FBV_UART_TxBufferSendLedCommand(FBV_ID_CHAN_A, FBV_LED_ON);
 
-  		  for(i = 0; i < midi_bank_size; i++)
-  		    FBV_UART_TxBufferSendLedCommand(bank_ids[i], FBV_LED_OFF);
-  		  FBV_UART_TxBufferSendLedCommand(bank_ids[(midi_channel%midi_bank_size)], FBV_LED_ON);
+/////////////////////////////////////////////////////////////////////////////
+// returns the control which is assigned to a button of a floorboard
+// (NULL if the button isn't assigned)
+/////////////////////////////////////////////////////////////////////////////
+static fbv_ctrl_t *APP_FBV_CtrlGet(u8 board, u8 fbv_id)
+{
+  if( board >= FBV_UART_NUM )
+    return NULL;
 
-  		  MIOS32_MIDI_SendSysEx(AXEFX_PORT,axefx_request_version_sysex,axefx_request_version_length);
-  		  MIOS32_MIDI_SendSysEx(AXEFX_PORT,axefx_request_blocks_sysex,axefx_request_blocks_length);
-  		  MIOS32_MIDI_SendSysEx(AXEFX_PORT,axefx_request_patch_name_sysex,axefx_request_patch_name_length);
+  u8 index = fbv_id_to_ctrl[board][fbv_id];
+  return (index < FBV_ID_MAX_INDEX) ? &FBV_ctrls[index] : NULL;
+}
+
+
+/////////////////////////////////////////////////////////////////////////////
+// returns the index of the control which displays an Axe-FX block
+// (FBV_ID_NONE if the block is unknown or not assigned)
+/////////////////////////////////////////////////////////////////////////////
+static u8 APP_BlockToCtrl(u16 block_id)
+{
+  if( block_id < ID_COMP1 || block_id >= ID_COMP1 + sizeof(block_to_id) )
+    return FBV_ID_NONE;
+
+  return block_to_id[block_id - ID_COMP1];
+}
+
+
+/////////////////////////////////////////////////////////////////////////////
+// returns 1 if Axe-FX blocks are assigned to the control
+/////////////////////////////////////////////////////////////////////////////
+static u8 APP_CtrlBlocksAssigned(u8 index)
+{
+  int w;
+  u32 assigned = 0;
+
+  for(w=0; w<AXEFX_BLOCK_WORDS; ++w)
+    assigned |= ctrl_block_mask[index][w];
+
+  return assigned ? 1 : 0;
+}
+
+
+/////////////////////////////////////////////////////////////////////////////
+// returns 1 if the current patch contains a block of the control
+/////////////////////////////////////////////////////////////////////////////
+static u8 APP_CtrlBlocksUsed(u8 index)
+{
+  int w;
+  u32 used = 0;
+
+  for(w=0; w<AXEFX_BLOCK_WORDS; ++w)
+    used |= ctrl_block_mask[index][w] & axefx_block_present[w];
+
+  return used ? 1 : 0;
+}
+
+
+/////////////////////////////////////////////////////////////////////////////
+// returns 1 if a block of the control is bypassed
+/////////////////////////////////////////////////////////////////////////////
+static u8 APP_CtrlBlocksBypassed(u8 index)
+{
+  int w;
+  u32 bypassed = 0;
+
+  for(w=0; w<AXEFX_BLOCK_WORDS; ++w)
+    bypassed |= ctrl_block_mask[index][w] & axefx_block_present[w] & ~axefx_block_on[w];
+
+  return bypassed ? 1 : 0;
+}
+
+
+/////////////////////////////////////////////////////////////////////////////
+// toggles all blocks of the control and sends their bypass CCs
+/////////////////////////////////////////////////////////////////////////////
+static void APP_CtrlBlocksToggle(u8 index)
+{
+  int w;
+
+  // the Axe-FX doesn't match the stored preset anymore
+  preset_modified = 1;
+  // a block status result which is on the way doesn't contain the toggle
+  AxeFX_RequestInvalidate(AXEFX_REQ_BLOCKS);
+
+  for(w=0; w<AXEFX_BLOCK_WORDS; ++w) {
+    u32 toggled = ctrl_block_mask[index][w] & axefx_block_present[w];
+    axefx_block_on[w] ^= toggled;
+
+    while( toggled ) {
+      u8 block = (w << 5) + __builtin_ctz(toggled);
+      toggled &= toggled - 1;
+
+      if( axefx_block_cc[block] != 128 ) {
+        u8 value = (axefx_block_on[w] & AXEFX_BLOCK_BIT(block)) ? 127 : 0;
+        APP_MIDI_SendCC(MIDI_OUT_RACK, axefx_block_cc[block], value);
+      } else {
+        // TODO: Add SysEx control
+      }
+    }
+  }
+}
+
+
+/////////////////////////////////////////////////////////////////////////////
+// sets the status of a control with Axe-FX blocks and updates its LEDs
+/////////////////////////////////////////////////////////////////////////////
+static void APP_CtrlStatusShow(u8 index, u8 status)
+{
+  fbv_ctrl_t *ctrl = &FBV_ctrls[index];
+
+  if( ctrl->type == FBV_ID_TYPE_BTN_LED ) {
+    ctrl->status = status;
+    FBV_UART_TxBufferSendLedCommand(ctrl->board, ctrl->fbv_id, status);
+  } else if( ctrl->type == FBV_ID_TYPE_FOOT_CTRL ) {
+    fbv_footctrl_t *foot = &FBV_ctrls_cont[ctrl->cc];
+
+    foot->status = status;
+    FBV_UART_TxBufferSendLedCommand(foot->board, foot->fbv_id_led1, (status == FBV_ID_OFF) ? FBV_LED_ON : FBV_LED_OFF);
+    FBV_UART_TxBufferSendLedCommand(foot->board, foot->fbv_id_led2, (status == FBV_ID_OFF) ? FBV_LED_OFF : FBV_LED_ON);
+  }
+}
+
+
+/////////////////////////////////////////////////////////////////////////////
+// a CC has been received on RACK_MIDI_CHN, the state of the block and of
+// the controls is taken over without requesting the block status
+/////////////////////////////////////////////////////////////////////////////
+static void APP_MIDI_CCReceived(u8 cc, u8 value)
+{
+  u32 ctrls = cc_to_ctrls[cc];
+  u8 block = cc_to_block[cc];
+  u8 status = (value >= 64) ? FBV_ID_ON : FBV_ID_OFF;
+
+  if( block != CC_BLOCK_NONE && (axefx_block_present[block >> 5] & AXEFX_BLOCK_BIT(block)) ) {
+    if( status != FBV_ID_OFF )
+      axefx_block_on[block >> 5] |= AXEFX_BLOCK_BIT(block);
+    else
+      axefx_block_on[block >> 5] &= ~AXEFX_BLOCK_BIT(block);
+
+    if( block_to_id[block] < FBV_ID_MAX_INDEX )
+      ctrls |= (u32)1 << block_to_id[block];
+  }
+
+  if( !ctrls )
+    return;
+
+  // the Axe-FX doesn't match the stored preset anymore
+  preset_modified = 1;
+  // a block status result which is on the way doesn't contain the change
+  AxeFX_RequestInvalidate(AXEFX_REQ_BLOCKS);
+
+  while( ctrls ) {
+    u8 index = __builtin_ctz(ctrls);
+    ctrls &= ctrls - 1;
+    APP_CtrlStatusShow(index, status);
+  }
+}
+
+
+/////////////////////////////////////////////////////////////////////////////
+// shows the cached state of a preset after a program change
+// returns 1 on a cache hit, 0 if the preset has to be requested first
+/////////////////////////////////////////////////////////////////////////////
+static u8 APP_PresetCacheApply(u8 preset)
+{
+  int i;
+
+  if( preset >= PRESET_CACHE_NUM || !(preset_cache[preset].flags & PRESET_CACHE_BLOCKS) ) {
+    ++preset_cache_misses;
+    return 0;
+  }
+
+  preset_cache_t *entry = &preset_cache[preset];
+  ++preset_cache_hits;
+
+  memcpy(axefx_block_present, entry->block_present, sizeof(axefx_block_present));
+  memcpy(axefx_block_on, entry->block_on, sizeof(axefx_block_on));
+
+  for(i=0; i<FBV_ID_MAX_INDEX; ++i) {
+    if( APP_CtrlBlocksAssigned(i) )
+      APP_CtrlStatusShow(i, ((entry->ctrl_on >> i) & 1) ? FBV_ID_ON : FBV_ID_OFF);
+  }
+
+  if( entry->flags & PRESET_CACHE_NAME )
+    FBV_UART_TxBufferSendDisplay(FBV_BOARD_MAIN, entry->name, sizeof(entry->name));
+
+  return 1;
+}
+
+
+/////////////////////////////////////////////////////////////////////////////
+// stores the block state of a complete block status result in the cache
+// differences to a valid entry are counted as corrections
+/////////////////////////////////////////////////////////////////////////////
+static void APP_PresetCacheStoreBlocks(u8 preset)
+{
+  if( preset >= PRESET_CACHE_NUM )
+    return;
+
+  preset_cache_t *entry = &preset_cache[preset];
+  u32 ctrl_on = blocks_rx_ctrl_on;
+
+  if( entry->flags & PRESET_CACHE_BLOCKS ) {
+    preset_cache_corrections += __builtin_popcount(entry->ctrl_on ^ ctrl_on);
+  }
+
+  memcpy(entry->block_present, blocks_rx_present, sizeof(entry->block_present));
+  memcpy(entry->block_on, blocks_rx_on, sizeof(entry->block_on));
+  entry->ctrl_on = ctrl_on;
+  entry->flags |= PRESET_CACHE_BLOCKS;
+}
+
+
+/////////////////////////////////////////////////////////////////////////////
+// stores the patch name of a preset in the cache
+/////////////////////////////////////////////////////////////////////////////
+static void APP_PresetCacheStoreName(u8 preset, const u8 *name, u16 len)
+{
+  int i;
+
+  if( preset >= PRESET_CACHE_NUM )
+    return;
+
+  preset_cache_t *entry = &preset_cache[preset];
+  for(i=0; i<sizeof(entry->name); ++i)
+    entry->name[i] = (i < len) ? name[i] : ' ';
+  entry->flags |= PRESET_CACHE_NAME;
+}
+
+
+/////////////////////////////////////////////////////////////////////////////
+// a new bank has been selected, its presets are prefetched when the FBV is idle
+/////////////////////////////////////////////////////////////////////////////
+static void APP_PresetPrefetchStart(void)
+{
+  preset_prefetch_pending = preset_prefetch_enabled;
+  preset_prefetch_next = 0;
+}
+
+
+/////////////////////////////////////////////////////////////////////////////
+// called on each FBV event and on MIDI from the Axe-FX, switches the Axe-FX
+// back to the selected preset before the event is handled
+/////////////////////////////////////////////////////////////////////////////
+static void APP_PresetPrefetchAbort(void)
+{
+  fbv_activity_tick = xTaskGetTickCount() * portTICK_RATE_MS;
+
+  if( preset_prefetch_active ) {
+    preset_prefetch_active = 0;
+    APP_MIDI_SendProgramChange(MIDI_OUT_AXEFX, midi_channel);
+    AxeFX_RequestPresetChanged(midi_channel);
+    // the results only verify the LEDs, they haven't been changed meanwhile
+    AxeFX_Request(AXEFX_REQ_BLOCKS);
+    AxeFX_Request(AXEFX_REQ_PATCH_NAME);
+  }
+}
+
+
+/////////////////////////////////////////////////////////////////////////////
+// prefetches the next uncached preset of the selected bank, called by
+// TASK_FBV_Check with the number of requests in flight
+// returns 1 if the prefetch isn't finished yet
+/////////////////////////////////////////////////////////////////////////////
+static s32 APP_PresetPrefetchStep(s32 req_pending)
+{
+  if( !preset_prefetch_pending )
+    return 0;
+
+  // toggled blocks would be lost by switching the presets
+  if( preset_modified && !preset_prefetch_active ) {
+    preset_prefetch_pending = 0;
+    return 0;
+  }
+
+  // disabled from the terminal while a bank is prefetched
+  if( !preset_prefetch_enabled )
+    preset_prefetch_next = midi_bank_size;
+
+  // never compete with FBV traffic or the requests of the selected preset
+  u32 now = xTaskGetTickCount() * portTICK_RATE_MS;
+  if( preset_prefetch_enabled &&
+      ((now - fbv_activity_tick) < PRESET_PREFETCH_IDLE_MS ||
+       (now - preset_prefetch_tick) < PRESET_PREFETCH_INTERVAL_MS ||
+       req_pending) )
+    return 1;
+
+  u8 preset = 0;
+  while( preset_prefetch_next < midi_bank_size ) {
+    preset = midi_bank*midi_bank_size + preset_prefetch_next;
+    if( preset < PRESET_CACHE_NUM && preset != midi_channel &&
+        (preset_cache[preset].flags & (PRESET_CACHE_BLOCKS | PRESET_CACHE_NAME)) != (PRESET_CACHE_BLOCKS | PRESET_CACHE_NAME) )
+      break;
+    ++preset_prefetch_next;
+  }
+
+  if( preset_prefetch_next >= midi_bank_size ) {
+    // all presets are cached, switch back (LEDs and display are still valid)
+    preset_prefetch_pending = 0;
+    if( preset_prefetch_active ) {
+      preset_prefetch_active = 0;
+      APP_MIDI_SendProgramChange(MIDI_OUT_AXEFX, midi_channel);
+      AxeFX_RequestPresetChanged(midi_channel);
+    }
+    return 0;
+  }
+
+  ++preset_prefetch_next;
+  ++preset_prefetch_count;
+  preset_prefetch_tick = now;
+  preset_prefetch_active = 1;
+  APP_MIDI_SendProgramChange(MIDI_OUT_AXEFX, preset);
+  AxeFX_RequestPresetChanged(preset);
+  AxeFX_Request(AXEFX_REQ_BLOCKS);
+  AxeFX_Request(AXEFX_REQ_PATCH_NAME);
+
+  return 1;
+}
+
+
+/////////////////////////////////////////////////////////////////////////////
+// FBV activity: the block status is polled with the shortest interval
+/////////////////////////////////////////////////////////////////////////////
+static void AxeFX_PollActivity(void)
+{
+  axefx_poll_interval = AXEFX_POLL_MIN_MS;
+  axefx_poll_tick = xTaskGetTickCount() * portTICK_RATE_MS;
+}
+
+
+/////////////////////////////////////////////////////////////////////////////
+// called for each block status result of the selected preset (polled or not)
+// len is the number of data bytes of the result
+/////////////////////////////////////////////////////////////////////////////
+static void AxeFX_PollResult(u8 changed, u16 len)
+{
+  if( changed ) {
+    ++axefx_poll_changes;
+    axefx_poll_interval = AXEFX_POLL_MIN_MS;
+  } else if( axefx_poll_interval < AXEFX_POLL_MAX_MS ) {
+    axefx_poll_interval *= 2;
+    if( axefx_poll_interval > AXEFX_POLL_MAX_MS )
+      axefx_poll_interval = AXEFX_POLL_MAX_MS;
+  }
+
+  // mS needed for request and result, scaled to the bandwidth share
+  u32 bytes = AXEFX_POLL_REQUEST_LEN + 7 + len;
+  axefx_poll_min = (bytes * 1000 * 100) / (3125 * AXEFX_POLL_BANDWIDTH_PCT);
+}
+
+
+/////////////////////////////////////////////////////////////////////////////
+// requests the block status when the poll interval has passed, called by
+// TASK_FBV_Check with the number of requests in flight
+// returns the number of mS until the next poll is due
+/////////////////////////////////////////////////////////////////////////////
+static u32 AxeFX_PollStep(s32 req_pending)
+{
+  if( !axefx_poll_enabled )
+    return AXEFX_POLL_MAX_MS;
+
+  u32 now = xTaskGetTickCount() * portTICK_RATE_MS;
+  u32 interval = (axefx_poll_interval > axefx_poll_min) ? axefx_poll_interval : axefx_poll_min;
+  u32 elapsed = now - axefx_poll_tick;
+
+  if( elapsed < interval )
+    return interval - elapsed;
+
+  // the next attempt is one interval later
+  axefx_poll_tick = now;
+
+  if( axefx_poll_quiet ) {
+    if( (now - axefx_poll_quiet_tick) < AXEFX_POLL_QUIET_MS ) {
+      ++axefx_poll_suspended;
+      return interval;
+    }
+    axefx_poll_quiet = 0;
+  }
+
+  // the result of a pending request or of the prefetch would arrive anyway
+  if( req_pending || preset_prefetch_active )
+    return interval;
+
+  ++axefx_poll_count;
+  AxeFX_Request(AXEFX_REQ_BLOCKS);
+  return interval;
+}
+
+
+/////////////////////////////////////////////////////////////////////////////
+// requests information from the Axe-FX, for per-preset requests the reply
+// has to match the preset which is selected now
+/////////////////////////////////////////////////////////////////////////////
+static void AxeFX_Request(u8 kind)
+{
+  axefx_req_t *req = &axefx_req[kind];
+
+  MIOS32_IRQ_Disable();
+  if( req->queued ) {
+    ++req->coalesced;
+  } else if( req->in_flight && req->in_flight_seq == axefx_req_seq ) {
+    ++req->coalesced; // the reply which is on the way is still valid
+  } else {
+    req->queued = 1;
+  }
+  MIOS32_IRQ_Enable();
+
+  AxeFX_RequestFlush();
+}
+
+
+/////////////////////////////////////////////////////////////////////////////
+// called after a program change has been sent to the Axe-FX, replies to
+// the previous preset are stale from now on and queued requests are replaced
+/////////////////////////////////////////////////////////////////////////////
+static void AxeFX_RequestPresetChanged(u8 preset)
+{
+  int kind;
+
+  MIOS32_IRQ_Disable();
+  ++axefx_req_seq;
+  axefx_preset = preset;
+  for(kind=0; kind<AXEFX_REQ_NUM; ++kind) {
+    if( axefx_req_info[kind].per_preset && axefx_req[kind].queued ) {
+      axefx_req[kind].queued = 0;
+      ++axefx_req[kind].dropped;
+    }
+  }
+  MIOS32_IRQ_Enable();
+}
+
+
+/////////////////////////////////////////////////////////////////////////////
+// called when the state which is requested by the kind has been changed
+// locally, replies to requests which have been sent before are stale
+/////////////////////////////////////////////////////////////////////////////
+static void AxeFX_RequestInvalidate(u8 kind)
+{
+  MIOS32_IRQ_Disable();
+  ++axefx_req[kind].state_seq;
+  MIOS32_IRQ_Enable();
+}
+
+
+/////////////////////////////////////////////////////////////////////////////
+// sends queued requests and repeats requests which timed out
+// returns the number of requests which are still in flight
+/////////////////////////////////////////////////////////////////////////////
+static s32 AxeFX_RequestFlush(void)
+{
+  int kind;
+  s32 in_flight = 0;
+  u32 now = xTaskGetTickCount() * portTICK_RATE_MS;
+
+  for(kind=0; kind<AXEFX_REQ_NUM; ++kind) {
+    axefx_req_t *req = &axefx_req[kind];
+    u8 send = 0;
+
+    MIOS32_IRQ_Disable();
+    if( req->in_flight && (now - req->sent_tick) >= AXEFX_REQ_TIMEOUT_MS ) {
+      if( req->queued || req->retries >= AXEFX_REQ_RETRIES || (axefx_req_info[kind].per_preset && req->in_flight_seq != axefx_req_seq) ) {
+        // give up, a queued request replaces it
+        if( !req->queued )
+          ++req->failed;
+        req->in_flight = 0;
+      } else {
+        ++req->retries;
+        ++req->timeouts;
+        req->in_flight_state_seq = req->state_seq;
+        send = 1;
+      }
+    }
+
+    if( !req->in_flight && req->queued ) {
+      req->queued = 0;
+      req->in_flight = 1;
+      req->in_flight_seq = axefx_req_seq;
+      req->in_flight_state_seq = req->state_seq;
+      req->retries = 0;
+      send = 1;
+    }
+
+    if( send ) {
+      req->sent_tick = now;
+      ++req->sent;
+    }
+    if( req->in_flight )
+      ++in_flight;
+    MIOS32_IRQ_Enable();
+
+    if( send )
+      MIOS32_MIDI_SendSysEx(AXEFX_PORT, axefx_req_info[kind].sysex, *axefx_req_info[kind].len);
+  }
+
+  return in_flight;
+}
+
+
+/////////////////////////////////////////////////////////////////////////////
+// called when a reply has been received
+// returns 0 if the reply is stale and should be ignored
+/////////////////////////////////////////////////////////////////////////////
+static u8 AxeFX_RequestReply(u8 kind)
+{
+  axefx_req_t *req = &axefx_req[kind];
+  u32 now = xTaskGetTickCount() * portTICK_RATE_MS;
+  u8 valid = 1;
+
+  MIOS32_IRQ_Disable();
+  if( req->in_flight ) {
+    u32 rtt = now - req->sent_tick;
+    u32 bucket = 0;
+    while( bucket < (AXEFX_REQ_RTT_BUCKETS-1) && rtt >= (8U << bucket) )
+      ++bucket;
+    ++req->rtt_hist[bucket];
+    if( rtt > req->rtt_max )
+      req->rtt_max = rtt;
+
+    if( (axefx_req_info[kind].per_preset && req->in_flight_seq != axefx_req_seq) ||
+        req->in_flight_state_seq != req->state_seq ) {
+      ++req->stale;
+      valid = 0;
+    }
+    req->in_flight = 0;
+  }
+  // unrequested results (e.g. requested by an editor) are applied as well
+  MIOS32_IRQ_Enable();
+
+  // a queued request is sent by TASK_FBV_Check
+  if( req->queued ) {
+    u8 event = 0;
+    xQueueSend(xFBVEventQueue, &event, 0);
+  }
+
+  return valid;
+}
+
+
+/////////////////////////////////////////////////////////////////////////////
+// prints the request statistics on the MIOS terminal
+/////////////////////////////////////////////////////////////////////////////
+static void AxeFX_RequestStatsPrint(void)
+{
+  int kind, i;
+
+  for(kind=0; kind<AXEFX_REQ_NUM; ++kind) {
+    axefx_req_t *req = &axefx_req[kind];
+
+    DEBUG_MSG("AxeFX %s: %u sent, %u coalesced, %u dropped, %u stale, %u timeouts, %u failed\n",
+              axefx_req_info[kind].name, req->sent, req->coalesced, req->dropped, req->stale, req->timeouts, req->failed);
+    for(i=0; i<AXEFX_REQ_RTT_BUCKETS; ++i) {
+      if( i < (AXEFX_REQ_RTT_BUCKETS-1) )
+        DEBUG_MSG("  RTT < %3u mS: %u\n", 8U << i, req->rtt_hist[i]);
+      else
+        DEBUG_MSG("  RTT >=%3u mS: %u\n", 8U << (i-1), req->rtt_hist[i]);
+    }
+    DEBUG_MSG("  RTT max: %u mS\n", req->rtt_max);
+  }
+}
+
+
+/////////////////////////////////////////////////////////////////////////////
+// clears the request statistics
+/////////////////////////////////////////////////////////////////////////////
+static void AxeFX_RequestStatsClear(void)
+{
+  int kind;
+
+  MIOS32_IRQ_Disable();
+  for(kind=0; kind<AXEFX_REQ_NUM; ++kind) {
+    axefx_req_t *req = &axefx_req[kind];
+    req->sent = req->coalesced = req->dropped = req->stale = req->timeouts = req->failed = req->rtt_max = 0;
+    memset(req->rtt_hist, 0, sizeof(req->rtt_hist));
+  }
+  MIOS32_IRQ_Enable();
+}
+
+
+/////////////////////////////////////////////////////////////////////////////
+// prints the driver statistics of the FBV interfaces on the MIOS terminal
+/////////////////////////////////////////////////////////////////////////////
+static void APP_FBVStatsPrint(void)
+{
+  fbv_uart_stats_t stats;
+  u8 board;
+
+  for(board=0; board<FBV_UART_NUM; ++board) {
+    FBV_UART_StatsGet(board, &stats);
+
+    DEBUG_MSG("FBV %d Tx: %u bytes, %u irqs (%d saved), %u DMA transfers, %u overflows, %u deferred\n",
+              board, stats.tx_bytes, stats.tx_irqs, FBV_UART_TxIrqsSavedGet(board), stats.tx_dma_transfers,
+              stats.tx_overflows, stats.tx_deferred);
+    DEBUG_MSG("  not sent: %u LED, %u display (unchanged), %u commands (not present on the model)\n",
+              stats.tx_led_skipped, stats.tx_display_skipped, stats.tx_caps_dropped);
+    DEBUG_MSG("FBV %d Rx: %u bytes, %u irqs, %u frames, %u overruns, %u frames dropped, %u bytes skipped\n",
+              board, stats.rx_bytes, stats.rx_irqs, stats.rx_frames, stats.rx_overruns,
+              stats.rx_frames_dropped, stats.rx_bytes_skipped);
+  }
+}
+
+
+/////////////////////////////////////////////////////////////////////////////
+// selects the model of a floorboard in the driver, either the one set on the
+// terminal or the one of the last init frame (TASK_FBV_Check only)
+/////////////////////////////////////////////////////////////////////////////
+static void APP_FBVModelApply(u8 board)
+{
+  if( fbv_model[board] == APP_FBV_MODEL_AUTO )
+    FBV_UART_ModelDetect(board, fbv_handshake[board]);
+  else
+    FBV_UART_ModelSet(board, fbv_model[board]);
+}
+
+
+/////////////////////////////////////////////////////////////////////////////
+// terminal command "fbv [<board> <model>]": prints or sets the models
+// returns -1 on invalid arguments
+/////////////////////////////////////////////////////////////////////////////
+static s32 APP_FBVModelCommand(char *args)
+{
+  char *arg[3];
+  int num = APP_TerminalSplit(args, arg, 3);
+  u8 board, model;
+
+  if( num == 1 ) {
+    for(board=0; board<FBV_UART_NUM; ++board)
+      DEBUG_MSG("FBV %d: model %s (%s)\n", board, fbv_model_name[fbv_model[board]], FBV_UART_ModelGet(board)->name);
+    return 0;
+  }
+
+  if( num != 3 )
+    return -1;
+
+  char *next;
+  u32 n = strtoul(arg[1], &next, 10);
+  if( next == arg[1] || *next || n >= FBV_UART_NUM )
+    return -1;
+  board = n;
+
+  for(model=0; model<=APP_FBV_MODEL_AUTO && strcmp(arg[2], fbv_model_name[model]) != 0; ++model);
+  if( model > APP_FBV_MODEL_AUTO )
+    return -1;
+
+  fbv_model[board] = model;
+  MIOS32_IRQ_Disable();
+  fbv_model_changed |= (1 << board);
+  MIOS32_IRQ_Enable();
+  DEBUG_MSG("FBV %d: model %s\n", board, fbv_model_name[model]);
+
+  return 0;
+}
+
+
+/////////////////////////////////////////////////////////////////////////////
+// generates the response tables of the pedal FBV_ctrls_cont[index] and
+// restarts its pipeline, called once the configuration has been loaded or
+// changed (TASK_FBV_Check only, except during APP_Init)
+/////////////////////////////////////////////////////////////////////////////
+static void APP_PedalTablesBuild(u8 index)
+{
+  fbv_footctrl_t *foot = &FBV_ctrls_cont[index];
+  s32 cal_range = foot->cal_max - foot->cal_min;
+  int t, x;
+
+  for(t=0; t<PEDAL_TARGET_NUM; ++t) {
+    fbv_foottarget_t *target = &foot->targets[t];
+    u8 *table = pedal_table[index][t];
+
+    for(x=0; x<128; ++x) {
+      // calibrated position 0..127
+      s32 pos;
+      if( cal_range <= 0 || x <= foot->cal_min )
+        pos = 0;
+      else if( x >= foot->cal_max )
+        pos = 127;
+      else
+        pos = ((x - foot->cal_min) * 127 + cal_range/2) / cal_range;
+
+      s32 y;
+      switch( target->curve ) {
+      case PEDAL_CURVE_LOG:
+        y = 127 - ((127 - pos) * (127 - pos) + 63) / 127;
+        break;
+      case PEDAL_CURVE_EXP:
+        y = (pos * pos + 63) / 127;
+        break;
+      case PEDAL_CURVE_CUSTOM: {
+        s32 p = (pos * 128) / 127; // 0..128, 16 per point
+        s32 k = p / 16;
+        if( k >= 8 )
+          y = pedal_curve_custom[8];
+        else
+          y = pedal_curve_custom[k] + ((pedal_curve_custom[k+1] - pedal_curve_custom[k]) * (p % 16)) / 16;
+      } break;
+      default:
+        y = pos;
+      }
+
+      table[x] = target->min + ((target->max - target->min) * y) / 127;
+    }
+
+    pedal_state[index][t].value = PEDAL_VALUE_NONE;
+    pedal_state[index][t].pending = 0;
+  }
+
+  pedal_position[index] = PEDAL_VALUE_NONE;
+  pedal_dir[index] = 0;
+  pedal_held[index] = PEDAL_VALUE_NONE;
+}
+
+
+/////////////////////////////////////////////////////////////////////////////
+// a new position of the pedal FBV_ctrls_cont[index] has been received, it is
+// sent to all targets which are active for the status of the foot control
+/////////////////////////////////////////////////////////////////////////////
+static void APP_PedalInput(u8 index, u8 value)
+{
+  u32 now = xTaskGetTickCount() * portTICK_RATE_MS;
+  u8 last = pedal_position[index];
+
+  value &= 0x7f;
+
+  // a reversal which is still held back is superseded by this position
+  if( pedal_held[index] != PEDAL_VALUE_NONE ) {
+    pedal_held[index] = PEDAL_VALUE_NONE;
+    ++pedal_saved;
+  }
+
+  // jitter against the direction of the movement is held back, the end
+  // positions always pass; if the pedal rests there, APP_PedalFlush sends it
+  if( last != PEDAL_VALUE_NONE && value != last ) {
+    s8 dir = (value > last) ? 1 : -1;
+    u8 delta = (dir > 0) ? (value - last) : (last - value);
+    if( pedal_dir[index] && dir != pedal_dir[index] && delta <= pedal_hysteresis && value != 0 && value != 127 ) {
+      pedal_held[index] = value;
+      pedal_held_tick[index] = now;
+      return;
+    }
+    pedal_dir[index] = dir;
+  }
+
+  APP_PedalMove(index, value, now);
+}
+
+
+/////////////////////////////////////////////////////////////////////////////
+// takes over an accepted position of the pedal FBV_ctrls_cont[index] and
+// sends it to all targets which are active for the status of the foot control
+/////////////////////////////////////////////////////////////////////////////
+static void APP_PedalMove(u8 index, u8 value, u32 now)
+{
+  fbv_footctrl_t *foot = &FBV_ctrls_cont[index];
+  int t;
+
+  pedal_position[index] = value;
+
+  for(t=0; t<PEDAL_TARGET_NUM; ++t) {
+    fbv_foottarget_t *target = &foot->targets[t];
+
+    if( target->cc == PEDAL_CC_NONE || (target->status != PEDAL_STATUS_ANY && target->status != foot->status) )
+      continue;
+
+    APP_PedalSend(index, t, pedal_table[index][t][value], now);
+  }
+}
+
+
+/////////////////////////////////////////////////////////////////////////////
+// sends a value to a pedal target, repeated values are dropped and values
+// within pedal_interval_ms after the last one are held back
+/////////////////////////////////////////////////////////////////////////////
+static void APP_PedalSend(u8 index, u8 target, u8 value, u32 now)
+{
+  pedal_state_t *pedal = &pedal_state[index][target];
+
+  if( pedal->pending ) {
+    ++pedal_saved; // the pending value is replaced or dropped
+    pedal->pending = 0;
+  }
+
+  if( value == pedal->value ) {
+    ++pedal_saved;
+    return;
+  }
+
+  if( pedal->value == PEDAL_VALUE_NONE || (now - pedal->tick) >= pedal_interval_ms ) {
+    APP_MIDI_SendCC(MIDI_OUT_RACK, FBV_ctrls_cont[index].targets[target].cc, value);
+    ++pedal_sent;
+    pedal->value = value;
+    pedal->tick = now;
+  } else {
+    pedal->pending = 1;
+    pedal->pending_value = value;
+  }
+}
+
+
+/////////////////////////////////////////////////////////////////////////////
+// sends the reversals at which the pedals have come to rest, and the values
+// which have been held back by the rate limit
+// returns the mS until the next pending value is due, 0 if none is pending
+/////////////////////////////////////////////////////////////////////////////
+static u32 APP_PedalFlush(void)
+{
+  u32 now = xTaskGetTickCount() * portTICK_RATE_MS;
+  u32 hold = (pedal_interval_ms > PEDAL_HOLD_MS_MIN) ? pedal_interval_ms : PEDAL_HOLD_MS_MIN;
+  u32 next = 0;
+  int i, t;
+
+  for(i=0; i<FBV_ID_MAX_FOOT_INDEX; ++i) {
+    u8 value = pedal_held[i];
+
+    if( value == PEDAL_VALUE_NONE )
+      continue;
+
+    u32 elapsed = now - pedal_held_tick[i];
+    if( elapsed >= hold ) {
+      pedal_held[i] = PEDAL_VALUE_NONE;
+      pedal_dir[i] = (value > pedal_position[i]) ? 1 : -1;
+      APP_PedalMove(i, value, now);
+    } else if( next == 0 || (hold - elapsed) < next ) {
+      next = hold - elapsed;
+    }
+  }
+
+  for(i=0; i<FBV_ID_MAX_FOOT_INDEX; ++i) {
+    for(t=0; t<PEDAL_TARGET_NUM; ++t) {
+      pedal_state_t *pedal = &pedal_state[i][t];
+
+      if( !pedal->pending )
+        continue;
+
+      u32 elapsed = now - pedal->tick;
+      if( elapsed >= pedal_interval_ms ) {
+        APP_MIDI_SendCC(MIDI_OUT_RACK, FBV_ctrls_cont[i].targets[t].cc, pedal->pending_value);
+        ++pedal_sent;
+        pedal->value = pedal->pending_value;
+        pedal->pending = 0;
+        pedal->tick = now;
+      } else if( next == 0 || (pedal_interval_ms - elapsed) < next ) {
+        next = pedal_interval_ms - elapsed;
+      }
+    }
+  }
+
+  return next;
+}
+
+
+/////////////////////////////////////////////////////////////////////////////
+// prints the calibration and the targets of the pedals on the MIOS terminal
+/////////////////////////////////////////////////////////////////////////////
+static void APP_PedalPrint(void)
+{
+  int i, t;
+
+  for(i=0; i<FBV_ID_MAX_FOOT_INDEX; ++i) {
+    fbv_footctrl_t *foot = &FBV_ctrls_cont[i];
+
+    DEBUG_MSG("Pedal %d: button CC %u, calibrated %u..%u\n", i, foot->cc, foot->cal_min, foot->cal_max);
+    for(t=0; t<PEDAL_TARGET_NUM; ++t) {
+      fbv_foottarget_t *target = &foot->targets[t];
+      if( target->cc == PEDAL_CC_NONE )
+        continue;
+      DEBUG_MSG("  target %d: CC %u, %s, %u..%u, %s\n", t, target->cc,
+                (target->curve < PEDAL_CURVE_NUM) ? pedal_curve_name[target->curve] : "?",
+                target->min, target->max,
+                (target->status == PEDAL_STATUS_ANY) ? "always" : ((target->status == FBV_ID_ON) ? "button on" : "button off"));
+    }
+  }
+}
+
+
+/////////////////////////////////////////////////////////////////////////////
+// terminal commands:
+//   target <pedal> <target> <cc|none> [<curve> [<min> <max> [off|on]]]
+//   calibrate <pedal> <min> <max>
+// the tables are generated again by TASK_FBV_Check
+/////////////////////////////////////////////////////////////////////////////
+static s32 APP_PedalCommand(char *args)
+{
+  char *arg[8];
+  int num = APP_TerminalSplit(args, arg, 8);
+  int index, i;
+
+  if( num < 2 )
+    return -1;
+
+  index = atoi(arg[1]);
+  if( index < 0 || index >= FBV_ID_MAX_FOOT_INDEX )
+    return -1;
+  fbv_footctrl_t *foot = &FBV_ctrls_cont[index];
+
+  if( strcmp(arg[0], "calibrate") == 0 ) {
+    if( num != 4 )
+      return -1;
+    int min = atoi(arg[2]);
+    int max = atoi(arg[3]);
+    if( min < 0 || max > 127 || min >= max )
+      return -1;
+    foot->cal_min = min;
+    foot->cal_max = max;
+  } else {
+    if( num < 4 || num == 6 || num > 8 )
+      return -1;
+    int t = atoi(arg[2]);
+    if( t < 0 || t >= PEDAL_TARGET_NUM )
+      return -1;
+
+    fbv_foottarget_t target = { PEDAL_CC_NONE, PEDAL_STATUS_ANY, PEDAL_CURVE_LINEAR, 0, 127 };
+    if( strcmp(arg[3], "none") != 0 ) {
+      int cc = atoi(arg[3]);
+      if( cc < 0 || cc > 127 )
+        return -1;
+      target.cc = cc;
+
+      if( num >= 5 ) {
+        for(i=0; i<PEDAL_CURVE_NUM; ++i)
+          if( strcmp(arg[4], pedal_curve_name[i]) == 0 )
+            break;
+        if( i >= PEDAL_CURVE_NUM )
+          return -1;
+        target.curve = i;
+      }
+      if( num >= 7 ) {
+        int min = atoi(arg[5]);
+        int max = atoi(arg[6]);
+        if( min < 0 || min > 127 || max < 0 || max > 127 )
+          return -1;
+        target.min = min;
+        target.max = max;
+      }
+      if( num >= 8 ) {
+        if( strcmp(arg[7], "off") == 0 )
+          target.status = FBV_ID_OFF;
+        else if( strcmp(arg[7], "on") == 0 )
+          target.status = FBV_ID_ON;
+        else
+          return -1;
+      }
+    }
+    foot->targets[t] = target;
+  }
+
+  MIOS32_IRQ_Disable();
+  pedal_rebuild |= (1 << index);
+  MIOS32_IRQ_Enable();
+  return 0;
+}
+
+
+/////////////////////////////////////////////////////////////////////////////
+// splits the arguments of a terminal command at spaces (in place)
+// returns the number of arguments
+/////////////////////////////////////////////////////////////////////////////
+static int APP_TerminalSplit(char *args, char **arg, int max)
+{
+  int num = 0;
+
+  while( num < max ) {
+    while( *args == ' ' )
+      ++args;
+    if( *args == 0 )
+      break;
+    arg[num++] = args;
+    while( *args && *args != ' ' )
+      ++args;
+    if( *args )
+      *args++ = 0;
+  }
+
+  return num;
+}
+
+
+/////////////////////////////////////////////////////////////////////////////
+// MIOS terminal commands, called for each received character
+/////////////////////////////////////////////////////////////////////////////
+#define TERMINAL_LINE_LEN 48
+
+static s32 APP_TerminalParse(mios32_midi_port_t port, char c)
+{
+  static char line[TERMINAL_LINE_LEN];
+  static u8 line_len = 0;
+
+  if( c != '\n' && c != '\r' ) {
+    if( line_len < (TERMINAL_LINE_LEN-1) )
+      line[line_len++] = c;
+    return 0;
+  }
+
+  line[line_len] = 0;
+  line_len = 0;
+  if( line[0] == 0 )
+    return 0;
+
+  if( strcmp(line, "help") == 0 ) {
+    DEBUG_MSG("Commands:\n");
+    DEBUG_MSG("  stats: print the Axe-FX request, preset cache and FBV driver statistics\n");
+    DEBUG_MSG("  reset: clear the statistics\n");
+    DEBUG_MSG("  fbv [<board> full|shortboard|express|auto]: print or set the models of the floorboards\n");
+    DEBUG_MSG("  prefetch on|off: prefetch the presets of a new bank (audible: switches the Axe-FX through the bank while idle)\n");
+    DEBUG_MSG("  poll on|off: poll the block status of the Axe-FX\n");
+    DEBUG_MSG("  routes: print the MIDI routing matrix\n");
+    DEBUG_MSG("  route <src> <dst> <classes> [<channels>]: set a route (ports usb0, usb1, uart0, uart1, hex masks)\n");
+    DEBUG_MSG("  rs <uart0|uart1> on|off: send with running status\n");
+    DEBUG_MSG("  pedal <interval mS> [<hysteresis>]: limit the CCs of the pedals\n");
+    DEBUG_MSG("  pedals: print the pedal targets\n");
+    DEBUG_MSG("  target <pedal> <target> <cc> [<curve> [<min> <max> [off|on]]]: set a pedal target (cc 'none' removes it)\n");
+    DEBUG_MSG("  calibrate <pedal> <min> <max>: pedal values at heel and toe position\n");
+  } else if( strcmp(line, "stats") == 0 ) {
+    AxeFX_RequestStatsPrint();
+    u32 hits = preset_cache_hits, lookups = hits + preset_cache_misses;
+    DEBUG_MSG("Preset cache: %u hits, %u misses (hit rate %u%%), %u corrections\n",
+              hits, lookups - hits, lookups ? (hits * 100 / lookups) : 0, preset_cache_corrections);
+    DEBUG_MSG("Preset prefetch: %s, %u presets prefetched\n", preset_prefetch_enabled ? "on" : "off", preset_prefetch_count);
+    DEBUG_MSG("Block status poll: %s, %u polls, %u changes, %u suspended, interval %u mS (min. %u mS)\n",
+              axefx_poll_enabled ? "on" : "off", axefx_poll_count, axefx_poll_changes, axefx_poll_suspended,
+              axefx_poll_interval, axefx_poll_min);
+    DEBUG_MSG("Running status: uart0 %s, uart1 %s\n",
+              (midi_out_rs & MIDI_OUT_UART0) ? "on" : "off", (midi_out_rs & MIDI_OUT_UART1) ? "on" : "off");
+    DEBUG_MSG("Pedals: %u CCs sent, %u values saved, interval %u mS, hysteresis %u\n",
+              pedal_sent, pedal_saved, pedal_interval_ms, pedal_hysteresis);
+    APP_FBVStatsPrint();
+  } else if( strcmp(line, "reset") == 0 ) {
+    AxeFX_RequestStatsClear();
+    preset_cache_hits = preset_cache_misses = preset_cache_corrections = 0;
+    preset_prefetch_count = 0;
+    axefx_poll_count = axefx_poll_changes = axefx_poll_suspended = 0;
+    pedal_sent = pedal_saved = 0;
+    u8 board;
+    for(board=0; board<FBV_UART_NUM; ++board)
+      FBV_UART_StatsClear(board);
+    DEBUG_MSG("Statistics cleared\n");
+  } else if( strcmp(line, "prefetch on") == 0 || strcmp(line, "prefetch off") == 0 ) {
+    // an ongoing prefetch is ended by TASK_FBV_Check
+    preset_prefetch_enabled = (line[10] == 'n');
+    DEBUG_MSG("Preset prefetch %s\n", preset_prefetch_enabled ? "enabled" : "disabled");
+  } else if( strcmp(line, "poll on") == 0 || strcmp(line, "poll off") == 0 ) {
+    axefx_poll_enabled = (line[6] == 'n');
+    DEBUG_MSG("Block status poll %s\n", axefx_poll_enabled ? "enabled" : "disabled");
+  } else if( strcmp(line, "fbv") == 0 || strncmp(line, "fbv ", 4) == 0 ) {
+    if( APP_FBVModelCommand(line) < 0 )
+      DEBUG_MSG("Usage: fbv [<board> full|shortboard|express|auto]\n");
+  } else if( strcmp(line, "routes") == 0 ) {
+    APP_RoutePrint();
+  } else if( strncmp(line, "route ", 6) == 0 ) {
+    if( APP_RouteCommand(line + 6) < 0 )
+      DEBUG_MSG("Usage: route <src> <dst> <classes> [<channels>]\n");
+    else
+      APP_RoutePrint();
+  } else if( strncmp(line, "rs uart", 7) == 0 && (line[7] == '0' || line[7] == '1') &&
+             (strcmp(line + 8, " on") == 0 || strcmp(line + 8, " off") == 0) ) {
+    u8 port = (line[7] == '0') ? MIDI_OUT_UART0 : MIDI_OUT_UART1;
+    APP_MIDI_RunningStatusSet((line[10] == 'n') ? (midi_out_rs | port) : (midi_out_rs & ~port));
+    DEBUG_MSG("Running status of uart%c %s\n", line[7], (midi_out_rs & port) ? "enabled" : "disabled");
+  } else if( strcmp(line, "pedals") == 0 ) {
+    APP_PedalPrint();
+  } else if( strncmp(line, "target ", 7) == 0 || strncmp(line, "calibrate ", 10) == 0 ) {
+    if( APP_PedalCommand(line) < 0 ) {
+      DEBUG_MSG("Usage: target <pedal> <target> <cc|none> [<linear|log|exp|custom> [<min> <max> [off|on]]]\n");
+      DEBUG_MSG("       calibrate <pedal> <min> <max>\n");
+    } else
+      APP_PedalPrint();
+  } else if( strncmp(line, "pedal ", 6) == 0 ) {
+    char *next;
+    u32 interval = strtoul(line + 6, &next, 10);
+    u32 hysteresis = (*next == ' ') ? strtoul(next, &next, 10) : pedal_hysteresis;
+    if( next == line + 6 || *next || interval > 1000 || hysteresis > 16 ) {
+      DEBUG_MSG("Usage: pedal <interval mS (0..1000)> [<hysteresis (0..16)>]\n");
+    } else {
+      pedal_interval_ms = interval;
+      pedal_hysteresis = hysteresis;
+      DEBUG_MSG("Pedals: interval %u mS, hysteresis %u\n", pedal_interval_ms, pedal_hysteresis);
+    }
+  } else {
+    DEBUG_MSG("Unknown command '%s', type 'help'\n", line);
+  }
+
+  return 0;
+}
+
+
+/////////////////////////////////////////////////////////////////////////////
+// This task handles the FBV messages, it is woken up by APP_FBV_NotifyFromISR
+/////////////////////////////////////////////////////////////////////////////
+static void TASK_FBV_Check(void *pvParameters)
+{
+  // deferred commands which didn't fit into the Tx buffer are retried after 1 mS
+  s32 tx_pending = 0;
+  // requests to the Axe-FX are checked for timeouts while they are in flight
+  s32 req_pending = 0;
+  // the presets of a new bank are prefetched while the FBV is idle
+  s32 prefetch_pending = 0;
+  // mS until the block status is polled again
+  u32 poll_delay = AXEFX_POLL_MIN_MS;
+  // mS until a pedal value which has been held back is sent
+  u32 pedal_pending = 0;
+
+  while( 1 ) {
+    u8 event;
+    u32 timeout = poll_delay;
+    if( prefetch_pending && timeout > PRESET_PREFETCH_INTERVAL_MS )
+      timeout = PRESET_PREFETCH_INTERVAL_MS;
+    if( req_pending && timeout > AXEFX_REQ_POLL_MS )
+      timeout = AXEFX_REQ_POLL_MS;
+    if( pedal_pending && timeout > pedal_pending )
+      timeout = pedal_pending;
+    if( tx_pending )
+      timeout = 1;
+    xQueueReceive(xFBVEventQueue, &event, timeout / portTICK_RATE_MS);
+
+    // the tables of pedals which have been reconfigured on the terminal
+    if( pedal_rebuild ) {
+      u8 index;
+      for(index=0; index<FBV_ID_MAX_FOOT_INDEX; ++index) {
+        if( pedal_rebuild & (1 << index) ) {
+          MIOS32_IRQ_Disable();
+          pedal_rebuild &= ~(1 << index);
+          MIOS32_IRQ_Enable();
+          APP_PedalTablesBuild(index);
+        }
+      }
+    }
+
+    // the models which have been set on the terminal
+    if( fbv_model_changed ) {
+      u8 board;
+      for(board=0; board<FBV_UART_NUM; ++board) {
+        if( fbv_model_changed & (1 << board) ) {
+          MIOS32_IRQ_Disable();
+          fbv_model_changed &= ~(1 << board);
+          MIOS32_IRQ_Enable();
+          APP_FBVModelApply(board);
+        }
+      }
+    }
+
+    // send the commands which have been deferred by APP_Periodic_100uS
+    if( FBV_tempo_tuner_info.tuner_pending ) {
+      int i;
+
+      FBV_tempo_tuner_info.tuner_pending = 0;
+      for(i = 0; i<FBV_ID_MAX_INDEX;i++) {
+        if( FBV_ctrls[i].type == FBV_ID_TYPE_TEMPO_TUNER ) {
+          APP_MIDI_SendCC(MIDI_OUT_RACK, FBV_ctrls[i].status, 127); // status == tuner-cc == non-latching
+          break;
+        }
+      }
+      FBV_UART_TxBufferSendChannelCommand(FBV_BOARD_MAIN, '-','-','-');
+    }
+    u8 board;
+    tx_pending = 0;
+    for(board=0; board<FBV_UART_NUM; ++board)
+      tx_pending += FBV_UART_TxDeferredFlush(board);
+
+    // MIDI from the Axe-FX, received by APP_MIDI_NotifyPackage
+    if( preset_prefetch_abort ) {
+      preset_prefetch_abort = 0;
+      APP_PresetPrefetchAbort();
+    }
+
+    // send queued requests, repeat requests which timed out
+    req_pending = AxeFX_RequestFlush();
+    prefetch_pending = APP_PresetPrefetchStep(req_pending);
+    poll_delay = AxeFX_PollStep(req_pending);
+
+    // handle all complete frames, they are evaluated directly inside of the Rx buffer
+    fbv_uart_frame_t frame;
+    while( APP_FBV_RxFrameGet(&frame) > 0 ) {
+      board = frame.fbv;
+      u8 cmd = frame.cmd;
+      u8 data0 = FBV_UART_RxFrameData(&frame, 0);
+      u8 data1 = FBV_UART_RxFrameData(&frame, 1);
+      if( FBV_UART_RxFrameRelease(&frame) < 0 )
+        continue; // overwritten by the Rx DMA while it was read
+
+      // the Axe-FX has to be back at the selected preset before buttons or pedals are handled
+      if( cmd == 0x81 || cmd == 0x82 ) {
+        APP_PresetPrefetchAbort();
+        AxeFX_PollActivity();
+      }
+
+  	  if(cmd == 0x90) { //INIT ?!?
+
+  		  int i;
+
+  		  // the model is reported in the init frame, commands for missing LEDs/displays are dropped by the driver
+  		  // (the raw byte is logged, the payload of most models is not documented yet, the model
+  		  // can be set on the terminal instead)
+  		  fbv_handshake[board] = data0;
+  		  APP_FBVModelApply(board);
+  		  DEBUG_MSG("FBV %d: %s (init frame %02X)\n", board, FBV_UART_ModelGet(board)->name, data0);
+
+  		  FBV_UART_TxBufferSendInit(board);
+  		  FBV_UART_DisplayInvalidate(board); // the FBV has been (re)started, its display is blank
+  		  FBV_UART_LedInvalidate(board);
+
+  		  if( board == FBV_BOARD_MAIN ) {
+  		    FBV_UART_TxBufferSendChannelCommand(FBV_BOARD_MAIN, FBV_CHANNEL_USER,'0' + (midi_bank/10),'0' + (midi_bank%10)); //ascii code for numbers
+  		    FBV_UART_TxBufferSendLedCommand(FBV_BOARD_MAIN, FBV_ID_CHAN_A, FBV_LED_ON);
+
+  		    for(i = 0; i < midi_bank_size; i++)
+  		      FBV_UART_TxBufferSendLedCommand(FBV_BOARD_MAIN, bank_ids[i], FBV_LED_OFF);
+  		    FBV_UART_TxBufferSendLedCommand(FBV_BOARD_MAIN, bank_ids[(midi_channel%midi_bank_size)], FBV_LED_ON);
+  		  }
+
+  		  // the block status request also restores the LEDs of the other floorboards
+
+  		  AxeFX_Request(AXEFX_REQ_VERSION);
+  		  AxeFX_Request(AXEFX_REQ_BLOCKS);
+  		  AxeFX_Request(AXEFX_REQ_PATCH_NAME);
 
   	  }
 
-  	  else if(msg.cmd == 0x81 && msg.data[1] == FBV_BUTTON_PRESSED ) { //BUTTON -> PRESSED
-  		  int i,j,k;
-  		  u8 handled = 0;
-  		  //FBV_UART_TxBufferSendLedCommand(msg.data[0], msg.data[1]);
-
-  		  DEBUG_MSG("FBV button pressed:\n");
-  		  DEBUG_MSG("FBV button  %08X\n",msg.data[0]);
-  		  for(i = 0; i<FBV_ID_MAX_INDEX;i++) {
-  			DEBUG_MSG("FBV checking    %08X\n",FBV_ctrls[i].fbv_id);
-  			  if( FBV_ctrls[i].fbv_id == msg.data[0] ) {
-  				  fbv_ctrl_t *ctrl = &(FBV_ctrls[i]);
-
-  				  DEBUG_MSG("FBV block found for %08X\n",ctrl->fbv_id);
-  				  DEBUG_MSG("type is %08X\n",ctrl->type);
-
-
-  				  if(ctrl->type == FBV_ID_TYPE_BTN_LED) {
-			          //if(ctrl->len == 0) {
-					    if(ctrl->status == FBV_ID_OFF) {
-						  MIOS32_MIDI_SendCC(USB1, RACK_MIDI_CHN, ctrl->cc, 127);
-						  MIOS32_MIDI_SendCC(UART1, RACK_MIDI_CHN, ctrl->cc, 127);
-						  FBV_UART_TxBufferSendLedCommand(ctrl->fbv_id, FBV_LED_ON);
-						  ctrl->status = FBV_ID_ON;
-						  DEBUG_MSG("to ON    %i\n",ctrl->cc);
-					    } else {
-						  MIOS32_MIDI_SendCC(USB1, RACK_MIDI_CHN, ctrl->cc, 0);
-						  MIOS32_MIDI_SendCC(UART1, RACK_MIDI_CHN, ctrl->cc, 0);
-						  FBV_UART_TxBufferSendLedCommand(ctrl->fbv_id, FBV_LED_OFF);
-						  ctrl->status = FBV_ID_OFF;
-						  DEBUG_MSG("to OFF    %i\n",ctrl->cc);
-					    }
-			          //} else {
-					    for(j=0; j< ctrl->len; j++ ) {
-						  if(ctrl->blocks[j].status == FBV_ID_OFF) {
-							  if(ctrl->blocks[j].cc != 128) {
-								  MIOS32_MIDI_SendCC(USB1, RACK_MIDI_CHN, ctrl->blocks[j].cc, 127);
-								  MIOS32_MIDI_SendCC(UART1, RACK_MIDI_CHN, ctrl->blocks[j].cc, 127);
-							  } else {
-								  // TODO: Add SysEx control
-							  }
-							  //FBV_UART_TxBufferSendLedCommand(ctrl->fbv_id, FBV_LED_ON);
-							  ctrl->blocks[j].status = FBV_ID_ON;
-							  //ctrl->status = FBV_ID_ON;
-							  DEBUG_MSG("to AxeFX block ON   %i\n",ctrl->cc);
-						  } else {
-							  if(ctrl->blocks[j].cc != 128) {
-								  MIOS32_MIDI_SendCC(USB1, RACK_MIDI_CHN, ctrl->blocks[j].cc, 0);
-								  MIOS32_MIDI_SendCC(UART1, RACK_MIDI_CHN, ctrl->blocks[j].cc, 0);
-							  } else {
-								  // TODO: Add SysEx control
-							  }
-							  //FBV_UART_TxBufferSendLedCommand(ctrl->fbv_id, FBV_LED_OFF);
-							  DEBUG_MSG("to AxeFX block OFF   %i\n",ctrl->cc);
-							  ctrl->blocks[j].status = FBV_ID_OFF;
-							  //ctrl->status = FBV_ID_OFF;
-						  }
-					    }
-			          //}
-				  } else if(ctrl->type == FBV_ID_TYPE_BANK) { // TODO: handle banks above preset 128
-					  if(ctrl->cc == 0) {
-						  //down
-						  if(midi_bank==0) midi_bank = 20; else midi_bank -= 1;
-					  } else {
-						  if(midi_bank==20) midi_bank = 0; else midi_bank += 1;
-					  }
-					  FBV_UART_TxBufferSendChannelCommand(FBV_CHANNEL_USER,'0' + (midi_bank/10),'0' + (midi_bank%10));
-				  } else if(ctrl->type == FBV_ID_TYPE_PRESET) { // TODO: handle banks above preset 128
-					  midi_channel = midi_bank*midi_bank_size + ctrl->cc;
-					  for(k = 0; k < midi_bank_size; k++)
-						  FBV_UART_TxBufferSendLedCommand(bank_ids[k], FBV_LED_OFF);
-					  FBV_UART_TxBufferSendLedCommand(ctrl->fbv_id, FBV_LED_ON);
-					  for(k = 0; k < FBV_ID_MAX_INDEX; k++) {
-						  if(FBV_ctrls[k].type == FBV_ID_TYPE_BTN_LED) {
-							  FBV_UART_TxBufferSendLedCommand(FBV_ctrls[k].fbv_id, FBV_LED_OFF);
-							  FBV_ctrls[k].status = FBV_ID_OFF;
-						  }
+  	  else if(cmd == 0x81 && data1 == FBV_BUTTON_PRESSED ) { //BUTTON -> PRESSED
+  		  int k;
+  		  //FBV_UART_TxBufferSendLedCommand(board, data0, data1);
+
+  		  fbv_ctrl_t *ctrl = APP_FBV_CtrlGet(board, data0);
+  		  if( ctrl != NULL ) {
+  			  if(ctrl->type == FBV_ID_TYPE_BTN_LED) {
+		          //if(ctrl->len == 0) {
+				    if(ctrl->status == FBV_ID_OFF) {
+					  APP_MIDI_SendCC(MIDI_OUT_RACK, ctrl->cc, 127);
+					  FBV_UART_TxBufferSendLedCommand(ctrl->board, ctrl->fbv_id, FBV_LED_ON);
+					  ctrl->status = FBV_ID_ON;
+				    } else {
+					  APP_MIDI_SendCC(MIDI_OUT_RACK, ctrl->cc, 0);
+					  FBV_UART_TxBufferSendLedCommand(ctrl->board, ctrl->fbv_id, FBV_LED_OFF);
+					  ctrl->status = FBV_ID_OFF;
+				    }
+		          //} else {
+				    APP_CtrlBlocksToggle(ctrl - FBV_ctrls);
+		          //}
+			  } else if(ctrl->type == FBV_ID_TYPE_BANK) { // TODO: handle banks above preset 128
+				  if(ctrl->cc == 0) {
+					  //down
+					  if(midi_bank==0) midi_bank = 20; else midi_bank -= 1;
+				  } else {
+					  if(midi_bank==20) midi_bank = 0; else midi_bank += 1;
+				  }
+				  FBV_UART_TxBufferSendChannelCommand(FBV_BOARD_MAIN, FBV_CHANNEL_USER,'0' + (midi_bank/10),'0' + (midi_bank%10));
+				  APP_PresetPrefetchStart();
+			  } else if(ctrl->type == FBV_ID_TYPE_PRESET) { // TODO: handle banks above preset 128
+				  midi_channel = midi_bank*midi_bank_size + ctrl->cc;
+				  for(k = 0; k < midi_bank_size; k++) {
+					  if(bank_ids[k] != ctrl->fbv_id)
+						  FBV_UART_TxBufferSendLedCommand(FBV_BOARD_MAIN, bank_ids[k], FBV_LED_OFF);
+				  }
+				  FBV_UART_TxBufferSendLedCommand(ctrl->board, ctrl->fbv_id, FBV_LED_ON);
+				  // LEDs of controls with Axe-FX blocks are updated by the block status
+				  // result of the new patch, switching them off now would only flicker
+				  for(k = 0; k < FBV_ID_MAX_INDEX; k++) {
+					  if(FBV_ctrls[k].type == FBV_ID_TYPE_BTN_LED) {
+						  if(!APP_CtrlBlocksAssigned(k))
+							  FBV_UART_TxBufferSendLedCommand(FBV_ctrls[k].board, FBV_ctrls[k].fbv_id, FBV_LED_OFF);
+						  FBV_ctrls[k].status = FBV_ID_OFF;
 					  }
-					  MIOS32_MIDI_SendProgramChange(USB1, RACK_MIDI_CHN, midi_channel);
-					  MIOS32_MIDI_SendProgramChange(UART1, RACK_MIDI_CHN, midi_channel);
-					  MIOS32_MIDI_SendSysEx(AXEFX_PORT,axefx_request_blocks_sysex,axefx_request_blocks_length);
-					  MIOS32_MIDI_SendSysEx(AXEFX_PORT,axefx_request_patch_name_sysex,axefx_request_patch_name_length);
-				  } else if (ctrl->type == FBV_ID_TYPE_TEMPO || ctrl->type == FBV_ID_TYPE_TEMPO_TUNER ) {
-					  // send tap tempo CC
-					  FBV_tempo_tuner_info.status = FBV_BUTTON_PRESSED;
-					  FBV_tempo_tuner_info.btn_count = 0;
-
-					  MIOS32_MIDI_SendCC(USB1, RACK_MIDI_CHN, ctrl->cc, 127);
-					  MIOS32_MIDI_SendCC(UART1, RACK_MIDI_CHN, ctrl->cc, 127);
-				  } else if(ctrl->type == FBV_ID_TYPE_FOOT_CTRL) {
-					  fbv_footctrl_t *foot = &FBV_ctrls_cont[ctrl->cc];
-			          //if(ctrl->len == 0) {
-					    if(foot->status == FBV_ID_OFF) {
-					      MIOS32_MIDI_SendCC(USB1, RACK_MIDI_CHN, foot->cc, 127);
-						  MIOS32_MIDI_SendCC(UART1, RACK_MIDI_CHN, foot->cc, 127);
-						  FBV_UART_TxBufferSendLedCommand(foot->fbv_id_led1, FBV_LED_OFF);
-						  FBV_UART_TxBufferSendLedCommand(foot->fbv_id_led2, FBV_LED_ON);
-						  foot->status = FBV_ID_ON;
-						  DEBUG_MSG("to ON    %i\n",foot->cc);
-					    } else {
-						  MIOS32_MIDI_SendCC(USB1, RACK_MIDI_CHN, foot->cc, 0);
-						  MIOS32_MIDI_SendCC(UART1, RACK_MIDI_CHN, foot->cc, 0);
-						  FBV_UART_TxBufferSendLedCommand(foot->fbv_id_led1, FBV_LED_ON);
-						  FBV_UART_TxBufferSendLedCommand(foot->fbv_id_led2, FBV_LED_OFF);
-						  foot->status = FBV_ID_OFF;
-						  DEBUG_MSG("to OFF    %i\n",ctrl->cc);
-					    }
-			          //} else {
-					    for(j=0; j< foot->len; j++ ) {
-						  if(foot->blocks[j].status == FBV_ID_OFF) {
-							  if(foot->blocks[j].cc != 128) {
-								  MIOS32_MIDI_SendCC(USB1, RACK_MIDI_CHN, foot->blocks[j].cc, 127);
-								  MIOS32_MIDI_SendCC(UART1, RACK_MIDI_CHN, foot->blocks[j].cc, 127);
-							  } else {
-								  // TODO: Add SysEx control
-							  }
-							  //FBV_UART_TxBufferSendLedCommand(ctrl->fbv_id, FBV_LED_ON);
-							  foot->blocks[j].status = FBV_ID_ON;
-							  //ctrl->status = FBV_ID_ON;
-							  DEBUG_MSG("to AxeFX block ON   %i\n",foot->cc);
-						  } else {
-							  if(foot->blocks[j].cc != 128) {
-								  MIOS32_MIDI_SendCC(USB1, RACK_MIDI_CHN, foot->blocks[j].cc, 0);
-								  MIOS32_MIDI_SendCC(UART1, RACK_MIDI_CHN, foot->blocks[j].cc, 0);
-							  } else {
-								  // TODO: Add SysEx control
-							  }
-							  //FBV_UART_TxBufferSendLedCommand(ctrl->fbv_id, FBV_LED_OFF);
-							  DEBUG_MSG("to AxeFX block OFF   %i\n",foot->cc);
-							  foot->blocks[j].status = FBV_ID_OFF;
-							  //ctrl->status = FBV_ID_OFF;
-						  }
-					    }
-			          //}
 				  }
-  				  break;
-  			  }
+				  APP_MIDI_SendProgramChange(MIDI_OUT_RACK, midi_channel);
+				  AxeFX_RequestPresetChanged(midi_channel);
+				  preset_modified = 0;
+				  // show the preset from the cache, the results below verify it
+				  APP_PresetCacheApply(midi_channel);
+				  AxeFX_Request(AXEFX_REQ_BLOCKS);
+				  AxeFX_Request(AXEFX_REQ_PATCH_NAME);
+			  } else if (ctrl->type == FBV_ID_TYPE_TEMPO || ctrl->type == FBV_ID_TYPE_TEMPO_TUNER ) {
+				  // send tap tempo CC
+				  FBV_tempo_tuner_info.status = FBV_BUTTON_PRESSED;
+				  FBV_tempo_tuner_info.btn_count = 0;
+
+				  APP_MIDI_SendCC(MIDI_OUT_RACK, ctrl->cc, 127);
+			  } else if(ctrl->type == FBV_ID_TYPE_FOOT_CTRL) {
+				  fbv_footctrl_t *foot = &FBV_ctrls_cont[ctrl->cc];
+		          //if(ctrl->len == 0) {
+				    if(foot->status == FBV_ID_OFF) {
+				      APP_MIDI_SendCC(MIDI_OUT_RACK, foot->cc, 127);
+					  FBV_UART_TxBufferSendLedCommand(foot->board, foot->fbv_id_led1, FBV_LED_OFF);
+					  FBV_UART_TxBufferSendLedCommand(foot->board, foot->fbv_id_led2, FBV_LED_ON);
+					  foot->status = FBV_ID_ON;
+				    } else {
+					  APP_MIDI_SendCC(MIDI_OUT_RACK, foot->cc, 0);
+					  FBV_UART_TxBufferSendLedCommand(foot->board, foot->fbv_id_led1, FBV_LED_ON);
+					  FBV_UART_TxBufferSendLedCommand(foot->board, foot->fbv_id_led2, FBV_LED_OFF);
+					  foot->status = FBV_ID_OFF;
+				    }
+		          //} else {
+				    APP_CtrlBlocksToggle(ctrl - FBV_ctrls);
+		          //}
+			  }
   		  }
   	  }
 
-  	  else if(msg.cmd == 0x81 && msg.data[1] == FBV_BUTTON_RELEASED ) { //BUTTON -> RELEASED
-  		  int i;
-  		  //FBV_UART_TxBufferSendLedCommand(msg.data[0], msg.data[1]);
+  	  else if(cmd == 0x81 && data1 == FBV_BUTTON_RELEASED ) { //BUTTON -> RELEASED
+  		  //FBV_UART_TxBufferSendLedCommand(board, data0, data1);
 
-  		  DEBUG_MSG("FBV button released:\n");
-  		  DEBUG_MSG("FBV button  %08X\n",msg.data[0]);
-  		  for(i = 0; i<FBV_ID_MAX_INDEX;i++) {
-  			DEBUG_MSG("FBV checking    %08X\n",FBV_ctrls[i].fbv_id);
-  			  if( FBV_ctrls[i].fbv_id == msg.data[0] ) {
-  				if (FBV_ctrls[i].type == FBV_ID_TYPE_TEMPO || FBV_ctrls[i].type == FBV_ID_TYPE_TEMPO_TUNER ) {
-					  // send tap tempo CC (release because tap tempo is non-latching)
+  		  fbv_ctrl_t *ctrl = APP_FBV_CtrlGet(board, data0);
+  		  if( ctrl != NULL ) {
+  			if (ctrl->type == FBV_ID_TYPE_TEMPO || ctrl->type == FBV_ID_TYPE_TEMPO_TUNER ) {
+				  // send tap tempo CC (release because tap tempo is non-latching)
 
-					  //MIOS32_MIDI_SendCC(USB1, RACK_MIDI_CHN, FBV_ctrls[i].cc, 0);
-					  //MIOS32_MIDI_SendCC(UART1, RACK_MIDI_CHN, FBV_ctrls[i].cc, 0);
+				  //MIOS32_MIDI_SendCC(USB1, RACK_MIDI_CHN, ctrl->cc, 0);
+				  //MIOS32_MIDI_SendCC(UART1, RACK_MIDI_CHN, ctrl->cc, 0);
 
-					  if (FBV_tempo_tuner_info.status == FBV_BUTTON_RELEASED) {
-						  MIOS32_MIDI_SendCC(USB1, RACK_MIDI_CHN, FBV_ctrls[i].status, 0); // status == tuner-cc == non-latching
-						  MIOS32_MIDI_SendCC(UART1, RACK_MIDI_CHN, FBV_ctrls[i].status, 0); // status == tuner-cc == non-latching
+				  if (FBV_tempo_tuner_info.status == FBV_BUTTON_RELEASED) {
+					  APP_MIDI_SendCC(MIDI_OUT_RACK, ctrl->status, 0); // status == tuner-cc == non-latching
 
-						  FBV_UART_TxBufferSendChannelCommand(FBV_CHANNEL_USER,'0' + (midi_bank/10),'0' + (midi_bank%10));
+					  FBV_UART_TxBufferSendChannelCommand(FBV_BOARD_MAIN, FBV_CHANNEL_USER,'0' + (midi_bank/10),'0' + (midi_bank%10));
 
-						  MIOS32_MIDI_SendSysEx(AXEFX_PORT,axefx_request_patch_name_sysex,axefx_request_patch_name_length);
-					  }
+					  AxeFX_Request(AXEFX_REQ_PATCH_NAME);
+				  }
 
-					  FBV_tempo_tuner_info.status = FBV_BUTTON_RELEASED;
-					  FBV_tempo_tuner_info.btn_count = 0;
-  				}
-  				break;
-  			  }
+				  FBV_tempo_tuner_info.status = FBV_BUTTON_RELEASED;
+				  FBV_tempo_tuner_info.btn_count = 0;
+  			}
   		  }
   	  }
 
-  	  else if(msg.cmd == 0x82) { //PEDAL
+  	  else if(cmd == 0x82) { //PEDAL
 		  fbv_footctrl_t *foot = 0;
-		  if(msg.data[0] == 0x00) { // WAH
-			  foot = &FBV_ctrls_cont[FBV_ID_FOOT_CTRL_W_VAL_i];
-		  } else if (msg.data[0] == 0x01) { // VOL
-			  foot = &FBV_ctrls_cont[FBV_ID_FOOT_CTRL_V_VAL_i];
+		  int i;
+		  for(i = 0; i<FBV_ID_MAX_FOOT_INDEX; i++) { // 0x00: WAH, 0x01: VOL
+			  if( FBV_ctrls_cont[i].board == board && FBV_ctrls_cont[i].fbv_id_foot == data0 ) {
+				  foot = &FBV_ctrls_cont[i];
+				  break;
+			  }
 		  }
 		  if(foot!=0 ) {
-			  if(foot->status == FBV_ID_OFF ) {
-				  MIOS32_MIDI_SendCC(USB1, RACK_MIDI_CHN, foot->cc_value1, msg.data[1]);
-				  MIOS32_MIDI_SendCC(UART1, RACK_MIDI_CHN, foot->cc_value1, msg.data[1]);
-			  } else {
-				  MIOS32_MIDI_SendCC(USB1, RACK_MIDI_CHN, foot->cc_value2, msg.data[1]);
-				  MIOS32_MIDI_SendCC(UART1, RACK_MIDI_CHN, foot->cc_value2, msg.data[1]);
-			  }
-
+			  APP_PedalInput(i, data1);
 		  }
 
 	  }
 
     }
 
+    // pedal values which are due after the rate limit
+    pedal_pending = APP_PedalFlush();
   }
 }
@@ -81,6 +81,11 @@ enum
     ID_VOLUME4,
 };
 
+// number of block IDs (ID_COMP1..ID_VOLUME4), and 32bit words of a block bitset
+#define AXEFX_BLOCK_NUM   (ID_VOLUME4 - ID_COMP1 + 1)
+#define AXEFX_BLOCK_WORDS ((AXEFX_BLOCK_NUM + 31) / 32)
+#define AXEFX_BLOCK_BIT(block) (1UL << ((block) & 31))
+
 extern const u8  axefx_request_blocks_sysex[];
 extern const u32 axefx_request_blocks_length;
 